@@ -0,0 +1,490 @@
+// 描画と読み込みのベンチマーク
+//
+// usage: make bench  または  ./host/bench [--root fs] [--filter NAME] [--min-time MS] [--cpus N]
+//
+// 1行に1つ、次の形のJSONを標準出力に出す
+//   {"bench":"fill-rect-full","width":800,"height":600,"iterations":4096,
+//    "ns_per_op":...,"pixels_per_op":...,"pixels_per_sec":...,"allocs_per_op":...}
+// pixels_per_opは1回で書き換えた範囲(dirty rect)の面積、画像の読み込みではデコードしたピクセル数
+// 計測は同じ回数を5回くり返した中央値
+#include "../main.cpp"
+#include "efi_shim.h"
+#include <stdio.h>
+
+#define BENCH_SAMPLES 5
+#define BENCH_TEXT_LENGTH 100
+#define BENCH_MAX_PRELOAD 64
+
+struct _BenchResolution {
+  UINT32 width;
+  UINT32 height;
+};
+
+typedef struct _BenchResolution BenchResolution;
+
+static const BenchResolution benchResolutions[] = {
+  {640, 480},
+  {800, 600},
+  {1280, 720},
+  {1920, 1080},
+};
+
+struct _Bench {
+  const char *name;
+  /** 画面の大きさで結果が変わるか falseなら最初の解像度でだけ測る */
+  bool perResolution;
+  /** 計測の前に1回だけ呼ぶ falseを返したら計測しない */
+  bool (*setup)();
+  void (*run)();
+  void (*teardown)();
+  /** 1回で処理するピクセル数 nullptrなら書き換えた範囲の面積を使う */
+  UINT64 (*pixels)();
+};
+
+typedef struct _Bench Bench;
+
+static UINT64 benchMinTime = 200 * 1000 * 1000ULL;
+static const char *benchFilter;
+
+static Graphics::Image *benchImage;
+static CHAR16 benchText[BENCH_TEXT_LENGTH + 1];
+static NovelScene *benchScene;
+static CHAR16 *preloadPaths[BENCH_MAX_PRELOAD];
+static UINTN preloadCount;
+static UINT64 preloadPixels;
+
+static bool sameString(const char *a, const char *b) {
+  while (*a && *a == *b) ++a, ++b;
+  return *a == *b;
+}
+
+static bool contains(const char *str, const char *part) {
+  for (; *str; ++str) {
+    const char *s = str, *p = part;
+    while (*p && *s == *p) ++s, ++p;
+    if (!*p) return true;
+  }
+  return !*part;
+}
+
+static bool setMode(const BenchResolution &resolution) {
+  for (UINT32 i = 0; i < Graphics::GraphicsOutputProtocol->Mode->MaxMode; ++i) {
+    UINTN sizeOfInfo;
+    EFI_GRAPHICS_OUTPUT_MODE_INFORMATION *info;
+    if (EFI_SUCCESS != Graphics::GraphicsOutputProtocol->QueryMode(Graphics::GraphicsOutputProtocol, i, &sizeOfInfo, &info)) break;
+    if (info->HorizontalResolution == resolution.width && info->VerticalResolution == resolution.height) {
+      Graphics::setMode(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+/** 書き換えた範囲の面積 */
+static UINT64 dirtyArea() {
+  UINT64 area = 0;
+  for (UINT32 i = 0; i < Graphics::Surface::dirtyCount; ++i) area += Graphics::Surface::area(Graphics::Surface::dirty[i]);
+  return area;
+}
+
+// 描画
+
+static void fillRectFull() {
+  Graphics::Pixel color {55, 44, 33, 0};
+  Graphics::fillRect(0, 0, Graphics::HorizontalResolution, Graphics::VerticalResolution, color);
+}
+
+static void fillCircle100() {
+  Graphics::Pixel color {127, 127, 0, 0};
+  Graphics::fillCircle(Graphics::HorizontalResolution / 2, Graphics::VerticalResolution / 2, 100, color);
+}
+
+static bool loadSprite() {
+  benchImage = Graphics::loadImageFromFile((EFI_STRING)L"surface0.png");
+  return benchImage != nullptr;
+}
+
+static void freeSprite() {
+  Graphics::freeImage(benchImage);
+  benchImage = nullptr;
+}
+
+static void drawImageOpaque() {
+  Graphics::drawImage(benchImage, (Graphics::HorizontalResolution - benchImage->x) / 2, (Graphics::VerticalResolution - benchImage->y) / 2, false);
+}
+
+static void drawImageTransparent() {
+  Graphics::drawImage(benchImage, (Graphics::HorizontalResolution - benchImage->x) / 2, (Graphics::VerticalResolution - benchImage->y) / 2);
+}
+
+static bool makeText() {
+  const CHAR16 *source = (const CHAR16 *)L"The quick brown fox jumps over the lazy dog. ";
+  UINTN length = strlen((CHAR16 *)source);
+  for (UINTN i = 0; i < BENCH_TEXT_LENGTH; ++i) benchText[i] = source[i % length];
+  benchText[BENCH_TEXT_LENGTH] = L'\0';
+  return true;
+}
+
+static void drawStr100() {
+  Graphics::Pixel black {0, 0, 0, 0};
+  Graphics::drawStr(benchText, black, 0, 0, Graphics::HorizontalResolution);
+}
+
+static void layoutText100() {
+  Graphics::LayoutCache::clear();
+  Graphics::LayoutCache::get(benchText, 800);
+}
+
+static void layoutText100Cached() {
+  Graphics::LayoutCache::get(benchText, 800);
+}
+
+static void flushFull() {
+  Graphics::Surface::markAllDirty();
+  Graphics::Surface::flush();
+}
+
+/** 画面を1色で消して送る 塗りつぶしはEfiBltVideoFill 1回になる */
+static void clearFlush() {
+  fillRectFull();
+  Graphics::Surface::flush();
+}
+
+static UINT64 screenPixels() {
+  return Graphics::TotalResolution;
+}
+
+static bool loadCursor() {
+  benchImage = Graphics::loadImageFromFile((EFI_STRING)L"cursor.png");
+  if (benchImage == nullptr) return false;
+  Graphics::Cursor::setImage(benchImage);
+  Input::setTrackMouseScreenCoordinate(true, Graphics::HorizontalResolution / 2, Graphics::VerticalResolution / 2);
+  return true;
+}
+
+static void freeCursor() {
+  Input::setTrackMouseScreenCoordinate(false);
+  Graphics::Cursor::setImage(nullptr);
+  freeSprite();
+}
+
+/** 1フレームに1回動かして転送する */
+static void cursorMove() {
+  Input::mouse.x += Input::mouse.x & 64 ? -63 : 1;
+  Graphics::Cursor::draw();
+  Graphics::Surface::flush();
+  Graphics::Cursor::restore();
+}
+
+/** 前の位置と今の位置 */
+static UINT64 cursorPixels() {
+  return (UINT64)benchImage->x * benchImage->y * 2;
+}
+
+// 読み込み
+
+static bool loadImageExists() {
+  auto image = Graphics::loadImageFromFile((EFI_STRING)L"surface0.png");
+  Graphics::freeImage(image);
+  return image != nullptr;
+}
+
+static void loadImageSurface0() {
+  Graphics::freeImage(Graphics::loadImageFromFile((EFI_STRING)L"surface0.png"));
+}
+
+static UINT64 surface0Pixels() {
+  auto image = Graphics::loadImageFromFile((EFI_STRING)L"surface0.png");
+  UINT64 pixels = (UINT64)image->x * image->y;
+  Graphics::freeImage(image);
+  return pixels;
+}
+
+static bool loadSpriteExists() {
+  auto image = Graphics::loadImageFromFile((EFI_STRING)L"surface0.spr");
+  Graphics::freeImage(image);
+  return image != nullptr;
+}
+
+static void loadSpriteSurface0() {
+  Graphics::freeImage(Graphics::loadImageFromFile((EFI_STRING)L"surface0.spr"));
+}
+
+static bool loadSpriteLz4Exists() {
+  auto image = Graphics::loadImageFromFile((EFI_STRING)L"surface0-lz4.spr");
+  Graphics::freeImage(image);
+  return image != nullptr;
+}
+
+static void loadSpriteLz4Surface0() {
+  Graphics::freeImage(Graphics::loadImageFromFile((EFI_STRING)L"surface0-lz4.spr"));
+}
+
+/** ルートにあるPNGをすべて先読みの対象にする */
+static bool listImages() {
+  auto root = FileSystem::Root;
+  root->SetPosition(root, 0);
+  preloadCount = 0;
+  preloadPixels = 0;
+  EFI_FILE_INFO *info;
+  while (preloadCount < BENCH_MAX_PRELOAD && (info = FileSystem::readdir(root)) != nullptr) {
+    UINTN length = strlen(info->FileName);
+    if (!(info->Attribute & EFI_FILE_DIRECTORY) && length > 4 && !strcmp(info->FileName + length - 4, (CHAR16*)L".png")) {
+      auto image = Graphics::loadImageFromFile(info->FileName);
+      if (image != nullptr) {
+        preloadPixels += (UINT64)image->x * image->y;
+        preloadPaths[preloadCount] = (CHAR16*)malloc(sizeof(CHAR16) * (length + 1));
+        strcpy(preloadPaths[preloadCount++], info->FileName);
+        Graphics::freeImage(image);
+      }
+    }
+    free(info);
+  }
+  root->SetPosition(root, 0);
+  return preloadCount > 0;
+}
+
+static void freeImageList() {
+  for (UINTN i = 0; i < preloadCount; ++i) free(preloadPaths[i]);
+  preloadCount = 0;
+}
+
+/** 冷えたキャッシュからJobsで全部読み込む APがあればデコードを分ける */
+static void preloadImages() {
+  Graphics::AssetCache::preloadAsync(preloadPaths, preloadCount);
+  Jobs::finish();
+  Graphics::AssetCache::setBudget(0);
+  Graphics::AssetCache::setBudget(ASSET_CACHE_DEFAULT_BUDGET);
+}
+
+static UINT64 imageListPixels() {
+  return preloadPixels;
+}
+
+// アセットファイル
+
+static EFI_FILE_PROTOCOL *assetPackFile;
+
+/** 先読みと同じPNGを開いて読むだけ デコードはしない */
+static void readAssets() {
+  for (UINTN i = 0; i < preloadCount; ++i) {
+    UINTN size;
+    free(FileSystem::readAll(preloadPaths[i], &size));
+  }
+}
+
+static bool listPackedImages() {
+  return FileSystem::AssetPack::file != nullptr && listImages();
+}
+
+/** アセットファイルを外してすべてFATから開く */
+static bool listLooseImages() {
+  assetPackFile = FileSystem::AssetPack::file;
+  FileSystem::AssetPack::file = nullptr;
+  return listImages();
+}
+
+static void restoreAssetPack() {
+  FileSystem::AssetPack::file = assetPackFile;
+  freeImageList();
+}
+
+// シナリオ
+
+static bool startScenario() {
+  benchScene = new NovelScene();
+  benchScene->init();
+  Jobs::finish();
+  if (!benchScene->ops && !benchScene->scenarioReader.file) {
+    delete benchScene;
+    benchScene = nullptr;
+    return false;
+  }
+  return true;
+}
+
+static void stopScenario() {
+  Graphics::AssetCache::release(benchScene->bg_image);
+  Graphics::AssetCache::release(benchScene->chara[0]);
+  Graphics::AssetCache::release(benchScene->chara[1]);
+  if (benchScene->ops) {
+    free(benchScene->ops);
+  } else {
+    FileSystem::closeReader(&benchScene->scenarioReader);
+  }
+  delete benchScene;
+  benchScene = nullptr;
+}
+
+/** 最後まで進んだら先頭へ戻す */
+static void rewindScenario() {
+  if (benchScene->ops) {
+    if (benchScene->ops[benchScene->pc].code == ScenarioOpEnd) benchScene->pc = 0;
+    return;
+  }
+  FileSystem::Reader &reader = benchScene->scenarioReader;
+  if (reader.pos >= reader.lengths[reader.current] && !reader.lengths[reader.current ^ 1]) FileSystem::seekReader(&reader, 0);
+}
+
+static void novelNext() {
+  benchScene->next();
+  rewindScenario();
+}
+
+/** 本文だけを2行のあいだで入れ替える */
+static CHAR16 textLines[2][64];
+static UINT32 textLineIndex;
+
+static bool startText() {
+  if (!startScenario()) return false;
+  benchScene->textSpeed = 0;
+  benchScene->next();
+  strcpy(textLines[0], (EFI_STRING)L"The quick brown fox jumps over the lazy dog.");
+  strcpy(textLines[1], (EFI_STRING)L"Pack my box with five dozen liquor jugs.");
+  return true;
+}
+
+static void novelText() {
+  textLineIndex ^= 1;
+  benchScene->currentText = textLines[textLineIndex];
+  benchScene->updateText();
+  Graphics::DisplayList::render();
+}
+
+/**
+ * 長い本文を1回に1文字ずつ出す 出し終えたら同じ本文を出し直す
+ *
+ * textSpeedを1tickに1文字にしてtickを進める 出し直しで前の本文を消す分も含む
+ */
+#define BENCH_REVEAL_LENGTH 200
+static CHAR16 revealText[BENCH_REVEAL_LENGTH + 1];
+
+static bool startReveal() {
+  if (!startScenario()) return false;
+  benchScene->next();
+  Jobs::finish();
+  const CHAR16 *source = (const CHAR16 *)L"The quick brown fox jumps over the lazy dog. ";
+  UINTN length = strlen((CHAR16 *)source);
+  for (UINTN i = 0; i < BENCH_REVEAL_LENGTH; ++i) revealText[i] = source[i % length];
+  revealText[BENCH_REVEAL_LENGTH] = L'\0';
+  benchScene->currentText = revealText;
+  benchScene->textSpeed = 10'000'000 / Main::stepTime;
+  return true;
+}
+
+static void novelReveal() {
+  ++benchScene->tick;
+  if (benchScene->textanim) {
+    benchScene->animateText();
+  } else {
+    benchScene->updateText();
+    Graphics::DisplayList::render();
+  }
+}
+
+static const Bench benches[] = {
+  {"fill-rect-full", true, nullptr, fillRectFull, nullptr, nullptr},
+  {"fill-circle-r100", true, nullptr, fillCircle100, nullptr, nullptr},
+  {"draw-image-opaque", true, loadSprite, drawImageOpaque, freeSprite, nullptr},
+  {"draw-image-transparent", true, loadSprite, drawImageTransparent, freeSprite, nullptr},
+  {"draw-str-100", true, makeText, drawStr100, nullptr, nullptr},
+  {"layout-text-100", false, makeText, layoutText100, nullptr, nullptr},
+  {"layout-text-100-cached", false, makeText, layoutText100Cached, nullptr, nullptr},
+  {"flush-full", true, nullptr, flushFull, nullptr, screenPixels},
+  {"clear-flush", true, nullptr, clearFlush, nullptr, screenPixels},
+  {"cursor-move", true, loadCursor, cursorMove, freeCursor, cursorPixels},
+  {"load-image-surface0", false, loadImageExists, loadImageSurface0, nullptr, surface0Pixels},
+  {"load-sprite-surface0", false, loadSpriteExists, loadSpriteSurface0, nullptr, surface0Pixels},
+  {"load-sprite-lz4-surface0", false, loadSpriteLz4Exists, loadSpriteLz4Surface0, nullptr, surface0Pixels},
+  {"preload-all-png", false, listImages, preloadImages, freeImageList, imageListPixels},
+  {"read-assets-pack", false, listPackedImages, readAssets, freeImageList, nullptr},
+  {"read-assets-loose", false, listLooseImages, readAssets, restoreAssetPack, nullptr},
+  {"novel-scene-next", true, startScenario, novelNext, stopScenario, nullptr},
+  {"novel-scene-text", true, startText, novelText, stopScenario, nullptr},
+  {"novel-scene-reveal", true, startReveal, novelReveal, stopScenario, nullptr},
+};
+
+// 計測
+
+static UINT64 runBatch(const Bench &bench, UINT64 iterations) {
+  Graphics::Surface::dirtyCount = 0;
+  UINT64 start = EfiShim::now();
+  for (UINT64 i = 0; i < iterations; ++i) bench.run();
+  return EfiShim::now() - start;
+}
+
+static void measure(const Bench &bench, const BenchResolution &resolution) {
+  if (bench.setup && !bench.setup()) {
+    printf("{\"bench\":\"%s\",\"width\":%u,\"height\":%u,\"skipped\":true}\n", bench.name, resolution.width, resolution.height);
+    return;
+  }
+
+  // 1回目は読み込みやキャッシュの準備が入るので数えない
+  Graphics::Surface::dirtyCount = 0;
+  bench.run();
+  Graphics::Surface::dirtyCount = 0;
+  bench.run();
+  UINT64 pixels = bench.pixels ? bench.pixels() : dirtyArea();
+
+  UINT64 iterations = 1;
+  while (runBatch(bench, iterations) < benchMinTime / BENCH_SAMPLES) iterations *= 2;
+
+  UINT64 allocations = libc::allocationCount;
+  UINT64 firmwareAllocations = libc::firmwareAllocations;
+  UINT64 samples[BENCH_SAMPLES];
+  for (UINT32 i = 0; i < BENCH_SAMPLES; ++i) {
+    UINT64 elapsed = runBatch(bench, iterations);
+    UINT32 j = i;
+    for (; j > 0 && samples[j - 1] > elapsed; --j) samples[j] = samples[j - 1];
+    samples[j] = elapsed;
+  }
+  UINT64 ops = iterations * BENCH_SAMPLES;
+  double allocsPerOp = (double)(libc::allocationCount - allocations) / ops;
+  double firmwareAllocsPerOp = (double)(libc::firmwareAllocations - firmwareAllocations) / ops;
+  double nsPerOp = (double)samples[BENCH_SAMPLES / 2] / iterations;
+
+  printf("{\"bench\":\"%s\",\"width\":%u,\"height\":%u,\"iterations\":%llu,\"ns_per_op\":%.1f,"
+    "\"pixels_per_op\":%llu,\"pixels_per_sec\":%.0f,\"allocs_per_op\":%.3f,\"firmware_allocs_per_op\":%.3f}\n",
+    bench.name, resolution.width, resolution.height, (unsigned long long)iterations, nsPerOp,
+    (unsigned long long)pixels, pixels * 1e9 / nsPerOp, allocsPerOp, firmwareAllocsPerOp);
+  fflush(stdout);
+
+  if (bench.teardown) bench.teardown();
+}
+
+static void usage(const char *program) {
+  fprintf(stderr, "usage: %s [--root DIR] [--filter NAME] [--min-time MS] [--cpus N]\n", program);
+}
+
+int main(int argc, char **argv) {
+  EfiShim::Options options;
+  options.quiet = true;
+  for (int i = 1; i < argc; ++i) {
+    bool hasValue = i + 1 < argc;
+    unsigned long long ms;
+    unsigned cpus;
+    if (sameString(argv[i], "--root") && hasValue) {
+      options.root = argv[++i];
+    } else if (sameString(argv[i], "--filter") && hasValue) {
+      benchFilter = argv[++i];
+    } else if (sameString(argv[i], "--min-time") && hasValue && sscanf(argv[++i], "%llu", &ms) == 1) {
+      benchMinTime = ms * 1000 * 1000;
+    } else if (sameString(argv[i], "--cpus") && hasValue && sscanf(argv[++i], "%u", &cpus) == 1 && cpus) {
+      options.cpus = cpus;
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+
+  initGame(EfiShim::init(&options));
+  for (const Bench &bench : benches) {
+    if (benchFilter && !contains(bench.name, benchFilter)) continue;
+    for (const BenchResolution &resolution : benchResolutions) {
+      if (!setMode(resolution)) continue;
+      measure(bench, resolution);
+      if (!bench.perResolution) break;
+    }
+  }
+  return 0;
+}
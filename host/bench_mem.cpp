@@ -0,0 +1,102 @@
+// libc/string.hのmemcpy/memset/memset32を、置き換える前の1要素ずつの実装と比べる
+//
+// usage: make bench-mem
+#include <Uefi.h>
+#include <Protocol/GraphicsOutput.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+typedef EFI_GRAPHICS_OUTPUT_BLT_PIXEL Pixel;
+
+// 以前の実装
+// 最適化で同じ命令に置き換えられないようにnoinlineにしてループのまま比べる
+
+__attribute__((noinline, optimize("no-tree-loop-distribute-patterns")))
+void* oldMemset(void *buf, int val, UINTN size) {
+  unsigned char *tmp = (unsigned char *)buf;
+  while (size--) *tmp++ = val;
+  return buf;
+}
+
+__attribute__((noinline, optimize("no-tree-loop-distribute-patterns")))
+void *oldMemcpy(void *dest, const void *src, UINTN n) {
+  unsigned char *d = (unsigned char *)dest;
+  unsigned char const *s = (unsigned char const *)src;
+  while (n--) *d++ = *s++;
+  return dest;
+}
+
+__attribute__((noinline, optimize("no-tree-loop-distribute-patterns")))
+void* oldMemsetPixel(Pixel *buf, Pixel val, UINTN size) {
+  Pixel *tmp = buf;
+  while (size--) *tmp++ = val;
+  return buf;
+}
+
+__attribute__((noinline))
+void* newMemsetPixel(Pixel *buf, Pixel val, UINTN size) {
+  return memset32(buf, *(UINT32*)&val, size);
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+struct Size {
+  const char *name;
+  UINTN bytes;
+};
+
+// グリフ1行から1080pの1画面まで
+static const Size sizes[] = {
+  {"glyph-row", 20 * 4},
+  {"glyph", 20 * 20 * 4},
+  {"line-800", 800 * 4},
+  {"line-1080p", 1920 * 4},
+  {"frame-600p", 800 * 600 * 4},
+  {"frame-1080p", 1920 * 1080 * 4},
+};
+
+#define TOTAL_BYTES (1024ULL * 1024 * 1024)
+
+static UINT8 src[1920 * 1080 * 4 + 64];
+static UINT8 dst[1920 * 1080 * 4 + 64];
+
+template <class F> double measure(UINTN bytes, F f) {
+  UINTN iterations = TOTAL_BYTES / bytes;
+  if (iterations < 8) iterations = 8;
+  f();
+  double start = now();
+  for (UINTN i = 0; i < iterations; ++i) f();
+  double elapsed = now() - start;
+  return bytes * iterations / elapsed / 1e9;
+}
+
+static void report(const char *op, const Size &size, double before, double after) {
+  printf("%-10s %-12s %10llu %8.2f %8.2f %7.2fx\n", op, size.name, (unsigned long long)size.bytes, before, after, after / before);
+}
+
+int main() {
+  Pixel color {12, 34, 56, 0};
+  printf("%-10s %-12s %10s %8s %8s %8s\n", "op", "size", "bytes", "old GB/s", "new GB/s", "speedup");
+  for (const Size &size : sizes) {
+    // 画素列は4バイト境界にしかそろっていないことがあるのでずらしておく
+    UINT8 *d = dst + 4;
+    UINT8 *s = src + 4;
+    UINTN bytes = size.bytes;
+    UINTN pixels = bytes / sizeof(Pixel);
+    report("memcpy", size,
+      measure(bytes, [&] { oldMemcpy(d, s, bytes); }),
+      measure(bytes, [&] { memcpy(d, s, bytes); }));
+    report("memset", size,
+      measure(bytes, [&] { oldMemset(d, 0x5A, bytes); }),
+      measure(bytes, [&] { memset(d, 0x5A, bytes); }));
+    report("fill-px", size,
+      measure(bytes, [&] { oldMemsetPixel((Pixel*)d, color, pixels); }),
+      measure(bytes, [&] { newMemsetPixel((Pixel*)d, color, pixels); }));
+  }
+  return 0;
+}
@@ -0,0 +1,1049 @@
+// EFI_SYSTEM_TABLEをLinuxの上で真似する
+//
+// 画面はメモリ上のフレームバッファ、ファイルはPOSIXのファイル、入力はスクリプトで与える
+// ブートサービスはmain.cppが呼ぶものだけを実装してある
+#include "efi_shim.h"
+#include <Protocol/SimplePointer.h>
+#include <Protocol/SimpleFileSystem.h>
+#include <Protocol/MpService.h>
+#include <Guid/FileInfo.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace EfiShim {
+  static Options options;
+  static Stats counters;
+
+  static EFI_GUID simplePointerGuid = EFI_SIMPLE_POINTER_PROTOCOL_GUID;
+  static EFI_GUID simpleFileSystemGuid = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
+  static EFI_GUID graphicsOutputGuid = EFI_GRAPHICS_OUTPUT_PROTOCOL_GUID;
+  static EFI_GUID fileInfoGuid = EFI_FILE_INFO_ID;
+  static EFI_GUID mpServicesGuid = EFI_MP_SERVICES_PROTOCOL_GUID;
+
+  static bool sameGuid(const EFI_GUID *a, const EFI_GUID *b) {
+    return memcmp(a, b, sizeof(EFI_GUID)) == 0;
+  }
+
+  UINT64 now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (UINT64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+  const Stats *stats() {
+    return &counters;
+  }
+
+  // 文字コード
+
+  /** UTF-16をUTF-8にする 長すぎる分は捨てる */
+  static void toUtf8(const CHAR16 *src, char *dest, size_t size) {
+    size_t n = 0;
+    for (; *src; ++src) {
+      UINT32 c = *src;
+      if (c >= 0xD800 && c < 0xDC00 && src[1] >= 0xDC00 && src[1] < 0xE000) {
+        c = 0x10000 + ((c - 0xD800) << 10) + (src[1] - 0xDC00);
+        ++src;
+      }
+      char buf[4];
+      size_t len;
+      if (c < 0x80) {
+        buf[0] = c;
+        len = 1;
+      } else if (c < 0x800) {
+        buf[0] = 0xC0 | (c >> 6);
+        buf[1] = 0x80 | (c & 0x3F);
+        len = 2;
+      } else if (c < 0x10000) {
+        buf[0] = 0xE0 | (c >> 12);
+        buf[1] = 0x80 | ((c >> 6) & 0x3F);
+        buf[2] = 0x80 | (c & 0x3F);
+        len = 3;
+      } else {
+        buf[0] = 0xF0 | (c >> 18);
+        buf[1] = 0x80 | ((c >> 12) & 0x3F);
+        buf[2] = 0x80 | ((c >> 6) & 0x3F);
+        buf[3] = 0x80 | (c & 0x3F);
+        len = 4;
+      }
+      if (n + len >= size) break;
+      memcpy(dest + n, buf, len);
+      n += len;
+    }
+    dest[n] = '\0';
+  }
+
+  /** UTF-8をUTF-16にする 書いた文字数(終端を含まない)を返す */
+  static size_t toUtf16(const char *src, CHAR16 *dest, size_t size) {
+    const unsigned char *s = (const unsigned char *)src;
+    size_t n = 0;
+    while (*s && n + 1 < size) {
+      UINT32 c = *s++;
+      if (c >= 0xF0) {
+        c = ((c & 0x07) << 18) | ((s[0] & 0x3F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+        s += 3;
+      } else if (c >= 0xE0) {
+        c = ((c & 0x0F) << 12) | ((s[0] & 0x3F) << 6) | (s[1] & 0x3F);
+        s += 2;
+      } else if (c >= 0xC0) {
+        c = ((c & 0x1F) << 6) | (s[0] & 0x3F);
+        s += 1;
+      }
+      if (c >= 0x10000) {
+        if (n + 2 >= size) break;
+        c -= 0x10000;
+        dest[n++] = 0xD800 + (c >> 10);
+        c = 0xDC00 + (c & 0x3FF);
+      }
+      dest[n++] = c;
+    }
+    dest[n] = 0;
+    return n;
+  }
+
+  // 入力スクリプト
+
+  enum ScriptEventType {
+    ScriptKey,
+    ScriptMove,
+    ScriptDown,
+    ScriptUp,
+  };
+
+  struct _ScriptEvent {
+    UINT64 tick;
+    ScriptEventType type;
+    EFI_INPUT_KEY key;
+    INT32 dx;
+    INT32 dy;
+    /** 同じティックのイベントを書いた順に並べるため */
+    UINT32 order;
+  };
+
+  typedef struct _ScriptEvent ScriptEvent;
+
+  static ScriptEvent *script;
+  static UINT32 scriptCount;
+  static UINT32 scriptCapacity;
+  /** 次に配るイベント */
+  static UINT32 scriptPos;
+
+  #define KEY_QUEUE_SIZE 64
+
+  static EFI_INPUT_KEY keyQueue[KEY_QUEUE_SIZE];
+  static UINT32 keyHead;
+  static UINT32 keyTail;
+
+  static EFI_SIMPLE_POINTER_STATE pointerState;
+  static bool pointerChanged;
+  static bool leftButton;
+
+  static void addScriptEvent(const ScriptEvent &event) {
+    if (scriptCount == scriptCapacity) {
+      scriptCapacity = scriptCapacity ? scriptCapacity * 2 : 64;
+      script = (ScriptEvent *)realloc(script, sizeof(ScriptEvent) * scriptCapacity);
+    }
+    script[scriptCount] = event;
+    script[scriptCount].order = scriptCount;
+    ++scriptCount;
+  }
+
+  static int compareScriptEvent(const void *a, const void *b) {
+    const ScriptEvent *x = (const ScriptEvent *)a;
+    const ScriptEvent *y = (const ScriptEvent *)b;
+    if (x->tick != y->tick) return x->tick < y->tick ? -1 : 1;
+    return x->order < y->order ? -1 : 1;
+  }
+
+  /** F1からF12はScanCodeの0x0Bから順に並んでいる */
+  #define SCAN_CODE_F1 0x000B
+
+  static EFI_INPUT_KEY parseKey(const char *str) {
+    EFI_INPUT_KEY key {0, 0};
+    if (str[0] != '\\') {
+      CHAR16 chars[4];
+      if (toUtf16(str, chars, 4)) key.UnicodeChar = chars[0];
+      return key;
+    }
+    switch (str[1]) {
+      case 'r': key.UnicodeChar = L'\r'; break;
+      case 'n': key.UnicodeChar = L'\n'; break;
+      case 't': key.UnicodeChar = L'\t'; break;
+      case 's': key.UnicodeChar = L' '; break;
+      case 'x': key.UnicodeChar = (CHAR16)strtoul(str + 2, nullptr, 16); break;
+      case 'F': key.ScanCode = SCAN_CODE_F1 + strtoul(str + 2, nullptr, 10) - 1; break;
+      default: key.UnicodeChar = str[1]; break;
+    }
+    return key;
+  }
+
+  static bool loadScript(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+      fprintf(stderr, "efi_shim: cannot open input script %s: %s\n", path, strerror(errno));
+      return false;
+    }
+    char line[256];
+    UINT32 number = 0;
+    while (fgets(line, sizeof(line), file)) {
+      ++number;
+      char *comment = strchr(line, '#');
+      if (comment) *comment = '\0';
+      char command[16], arg[32];
+      unsigned long long tick;
+      INT32 dx, dy;
+      int fields = sscanf(line, "%llu %15s %31s", &tick, command, arg);
+      if (fields <= 0) continue;
+      ScriptEvent event {};
+      event.tick = tick;
+      if (fields == 3 && strcmp(command, "key") == 0) {
+        event.type = ScriptKey;
+        event.key = parseKey(arg);
+        addScriptEvent(event);
+      } else if (strcmp(command, "move") == 0 && sscanf(line, "%llu %15s %d %d", &tick, command, &dx, &dy) == 4) {
+        event.type = ScriptMove;
+        event.dx = dx;
+        event.dy = dy;
+        addScriptEvent(event);
+      } else if (fields == 2 && strcmp(command, "down") == 0) {
+        event.type = ScriptDown;
+        addScriptEvent(event);
+      } else if (fields == 2 && strcmp(command, "up") == 0) {
+        event.type = ScriptUp;
+        addScriptEvent(event);
+      } else if (fields == 2 && strcmp(command, "click") == 0) {
+        event.type = ScriptDown;
+        addScriptEvent(event);
+        event.type = ScriptUp;
+        event.tick = tick + 1;
+        addScriptEvent(event);
+      } else {
+        fprintf(stderr, "efi_shim: %s:%u: bad input line\n", path, number);
+        fclose(file);
+        return false;
+      }
+    }
+    fclose(file);
+    if (scriptCount) qsort(script, scriptCount, sizeof(ScriptEvent), compareScriptEvent);
+    return true;
+  }
+
+  /** tickまでに起きるイベントをキーのキューとマウスの状態に移す */
+  static void dispatchScript(UINT64 tick) {
+    while (scriptPos < scriptCount && script[scriptPos].tick <= tick) {
+      const ScriptEvent &event = script[scriptPos++];
+      switch (event.type) {
+        case ScriptKey:
+          if (keyTail - keyHead < KEY_QUEUE_SIZE) keyQueue[keyTail++ % KEY_QUEUE_SIZE] = event.key;
+          break;
+        case ScriptMove:
+          pointerState.RelativeMovementX += event.dx;
+          pointerState.RelativeMovementY += event.dy;
+          pointerChanged = true;
+          break;
+        case ScriptDown:
+        case ScriptUp:
+          leftButton = event.type == ScriptDown;
+          pointerChanged = true;
+          break;
+      }
+    }
+  }
+
+  static bool scriptFinished() {
+    return scriptPos == scriptCount && keyHead == keyTail && !pointerChanged;
+  }
+
+  // コンソール
+
+  static EFI_STATUS EFIAPI textInReset(EFI_SIMPLE_TEXT_INPUT_PROTOCOL *, BOOLEAN) {
+    keyHead = keyTail = 0;
+    return EFI_SUCCESS;
+  }
+
+  static EFI_STATUS EFIAPI readKeyStroke(EFI_SIMPLE_TEXT_INPUT_PROTOCOL *, EFI_INPUT_KEY *key) {
+    if (keyHead == keyTail) return EFI_NOT_READY;
+    *key = keyQueue[keyHead++ % KEY_QUEUE_SIZE];
+    return EFI_SUCCESS;
+  }
+
+  static EFI_STATUS EFIAPI textOutReset(EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *, BOOLEAN) {
+    return EFI_SUCCESS;
+  }
+
+  static EFI_STATUS EFIAPI outputString(EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *, CHAR16 *str) {
+    if (options.quiet) return EFI_SUCCESS;
+    char buf[1024];
+    toUtf8(str, buf, sizeof(buf));
+    fputs(buf, stdout);
+    return EFI_SUCCESS;
+  }
+
+  static EFI_STATUS EFIAPI clearScreen(EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *) {
+    return EFI_SUCCESS;
+  }
+
+  // マウス
+
+  static EFI_STATUS EFIAPI pointerReset(EFI_SIMPLE_POINTER_PROTOCOL *, BOOLEAN) {
+    pointerChanged = false;
+    return EFI_SUCCESS;
+  }
+
+  /** 実機と同じく前回から変化が無ければEFI_NOT_READYを返す */
+  static EFI_STATUS EFIAPI getState(EFI_SIMPLE_POINTER_PROTOCOL *, EFI_SIMPLE_POINTER_STATE *state) {
+    if (!pointerChanged) return EFI_NOT_READY;
+    pointerState.LeftButton = leftButton;
+    *state = pointerState;
+    pointerState.RelativeMovementX = 0;
+    pointerState.RelativeMovementY = 0;
+    pointerState.RelativeMovementZ = 0;
+    pointerChanged = false;
+    return EFI_SUCCESS;
+  }
+
+  // 画面
+
+  typedef EFI_GRAPHICS_OUTPUT_BLT_PIXEL Pixel;
+
+  #define MAX_SHIM_MODES 8
+
+  static EFI_GRAPHICS_OUTPUT_MODE_INFORMATION modes[MAX_SHIM_MODES];
+  static EFI_GRAPHICS_OUTPUT_MODE_INFORMATION currentInfo;
+  static EFI_GRAPHICS_OUTPUT_PROTOCOL_MODE gopMode;
+  static Pixel *screen;
+
+  EFI_GRAPHICS_OUTPUT_BLT_PIXEL *framebuffer() {
+    return screen;
+  }
+
+  static void addMode(UINT32 width, UINT32 height) {
+    for (UINT32 i = 0; i < gopMode.MaxMode; ++i) {
+      if (modes[i].HorizontalResolution == width && modes[i].VerticalResolution == height) return;
+    }
+    if (gopMode.MaxMode == MAX_SHIM_MODES) return;
+    EFI_GRAPHICS_OUTPUT_MODE_INFORMATION &info = modes[gopMode.MaxMode++];
+    info.Version = 0;
+    info.HorizontalResolution = width;
+    info.VerticalResolution = height;
+    info.PixelFormat = PixelBlueGreenRedReserved8BitPerColor;
+    info.PixelsPerScanLine = width;
+  }
+
+  static EFI_STATUS EFIAPI queryMode(EFI_GRAPHICS_OUTPUT_PROTOCOL *, UINT32 mode, UINTN *sizeOfInfo, EFI_GRAPHICS_OUTPUT_MODE_INFORMATION **info) {
+    if (mode >= gopMode.MaxMode) return EFI_INVALID_PARAMETER;
+    *sizeOfInfo = sizeof(EFI_GRAPHICS_OUTPUT_MODE_INFORMATION);
+    *info = &modes[mode];
+    return EFI_SUCCESS;
+  }
+
+  static EFI_STATUS EFIAPI setMode(EFI_GRAPHICS_OUTPUT_PROTOCOL *, UINT32 mode) {
+    if (mode >= gopMode.MaxMode) return EFI_UNSUPPORTED;
+    currentInfo = modes[mode];
+    UINTN size = sizeof(Pixel) * currentInfo.HorizontalResolution * currentInfo.VerticalResolution;
+    free(screen);
+    screen = (Pixel *)calloc(1, size);
+    gopMode.Mode = mode;
+    gopMode.FrameBufferBase = (EFI_PHYSICAL_ADDRESS)screen;
+    gopMode.FrameBufferSize = size;
+    return EFI_SUCCESS;
+  }
+
+  static EFI_STATUS EFIAPI blt(EFI_GRAPHICS_OUTPUT_PROTOCOL *, Pixel *buffer, EFI_GRAPHICS_OUTPUT_BLT_OPERATION operation,
+    UINTN sourceX, UINTN sourceY, UINTN destinationX, UINTN destinationY, UINTN width, UINTN height, UINTN delta) {
+    UINTN screenWidth = currentInfo.HorizontalResolution;
+    UINTN screenHeight = currentInfo.VerticalResolution;
+    if (width == 0 || height == 0) return EFI_INVALID_PARAMETER;
+    if (delta == 0) delta = width * sizeof(Pixel);
+    ++counters.bltCalls;
+    switch (operation) {
+      case EfiBltVideoFill:
+        if (destinationX + width > screenWidth || destinationY + height > screenHeight) return EFI_INVALID_PARAMETER;
+        // EDK2のFrameBufferBltLibと同じく1行分を作って各行へ写す
+        for (UINTN x = 0; x < width; ++x) screen[destinationY * screenWidth + destinationX + x] = *buffer;
+        for (UINTN y = 1; y < height; ++y) {
+          memcpy(screen + (destinationY + y) * screenWidth + destinationX,
+            screen + destinationY * screenWidth + destinationX, width * sizeof(Pixel));
+        }
+        break;
+      case EfiBltVideoToBltBuffer:
+        if (sourceX + width > screenWidth || sourceY + height > screenHeight) return EFI_INVALID_PARAMETER;
+        for (UINTN y = 0; y < height; ++y) {
+          memcpy((UINT8 *)buffer + (destinationY + y) * delta + destinationX * sizeof(Pixel),
+            screen + (sourceY + y) * screenWidth + sourceX, width * sizeof(Pixel));
+        }
+        return EFI_SUCCESS;
+      case EfiBltBufferToVideo:
+        if (destinationX + width > screenWidth || destinationY + height > screenHeight) return EFI_INVALID_PARAMETER;
+        for (UINTN y = 0; y < height; ++y) {
+          memcpy(screen + (destinationY + y) * screenWidth + destinationX,
+            (UINT8 *)buffer + (sourceY + y) * delta + sourceX * sizeof(Pixel), width * sizeof(Pixel));
+        }
+        break;
+      case EfiBltVideoToVideo:
+        if (sourceX + width > screenWidth || sourceY + height > screenHeight ||
+          destinationX + width > screenWidth || destinationY + height > screenHeight) return EFI_INVALID_PARAMETER;
+        // 重なっていても壊れないよう下へ動かすときは下の行から写す
+        for (UINTN i = 0; i < height; ++i) {
+          UINTN y = destinationY > sourceY ? height - 1 - i : i;
+          memmove(screen + (destinationY + y) * screenWidth + destinationX,
+            screen + (sourceY + y) * screenWidth + sourceX, width * sizeof(Pixel));
+        }
+        break;
+      default:
+        return EFI_INVALID_PARAMETER;
+    }
+    counters.bltPixels += width * height;
+    return EFI_SUCCESS;
+  }
+
+  static bool dumpScreen(const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (!file) return false;
+    UINT32 width = currentInfo.HorizontalResolution;
+    UINT32 height = currentInfo.VerticalResolution;
+    fprintf(file, "P6\n%u %u\n255\n", width, height);
+    unsigned char *row = (unsigned char *)malloc(width * 3);
+    for (UINT32 y = 0; y < height; ++y) {
+      for (UINT32 x = 0; x < width; ++x) {
+        const Pixel &pixel = screen[y * width + x];
+        row[x * 3] = pixel.Red;
+        row[x * 3 + 1] = pixel.Green;
+        row[x * 3 + 2] = pixel.Blue;
+      }
+      fwrite(row, 3, width, file);
+    }
+    free(row);
+    return fclose(file) == 0;
+  }
+
+  // ファイル
+
+  #define EFI_FILE_PROTOCOL_REVISION_1 0x00010000
+  #define SHIM_PATH_MAX 1024
+
+  struct _ShimFile {
+    /** 先頭に置いてEFI_FILE_PROTOCOL*からキャストできるようにする */
+    EFI_FILE_PROTOCOL protocol;
+    int fd;
+    DIR *dir;
+    /** readdirで読んだがバッファが足りずに返せなかったエントリ */
+    struct dirent *pending;
+    /** ルートからの相対パス ルートなら空文字列 */
+    char path[SHIM_PATH_MAX];
+  };
+
+  typedef struct _ShimFile ShimFile;
+
+  static EFI_SIMPLE_FILE_SYSTEM_PROTOCOL simpleFileSystem;
+
+  static ShimFile *newFile(const char *path);
+
+  static void hostPath(const ShimFile *file, char *dest, size_t size) {
+    snprintf(dest, size, "%s%s%s", options.root, file->path[0] ? "/" : "", file->path);
+  }
+
+  /** UEFIのパスをdirからの相対として解決する "."と".."も解釈する */
+  static bool resolvePath(const char *dir, const CHAR16 *name, char *dest, size_t size) {
+    char utf8[PATH_MAX];
+    toUtf8(name, utf8, sizeof(utf8));
+    size_t n = 0;
+    if (utf8[0] != '\\' && utf8[0] != '/') {
+      n = strlen(dir);
+      if (n >= size) return false;
+      memcpy(dest, dir, n);
+    }
+    dest[n] = '\0';
+    char *save;
+    for (char *part = strtok_r(utf8, "\\/", &save); part; part = strtok_r(nullptr, "\\/", &save)) {
+      if (strcmp(part, ".") == 0) continue;
+      if (strcmp(part, "..") == 0) {
+        char *slash = strrchr(dest, '/');
+        n = slash ? slash - dest : 0;
+        dest[n] = '\0';
+        continue;
+      }
+      size_t len = strlen(part);
+      if (n + len + 2 > size) return false;
+      if (n) dest[n++] = '/';
+      memcpy(dest + n, part, len + 1);
+      n += len;
+    }
+    return true;
+  }
+
+  static EFI_STATUS statusOf(int error) {
+    switch (error) {
+      case ENOENT:
+      case ENOTDIR: return EFI_NOT_FOUND;
+      case EACCES:
+      case EPERM: return EFI_ACCESS_DENIED;
+      case EROFS: return EFI_WRITE_PROTECTED;
+      case ENOMEM: return EFI_OUT_OF_RESOURCES;
+      default: return EFI_DEVICE_ERROR;
+    }
+  }
+
+  static EFI_STATUS EFIAPI fileOpen(EFI_FILE_PROTOCOL *self, EFI_FILE_PROTOCOL **newHandle, CHAR16 *name, UINT64 mode, UINT64 attributes) {
+    ShimFile *parent = (ShimFile *)self;
+    char relative[SHIM_PATH_MAX];
+    if (!resolvePath(parent->path, name, relative, sizeof(relative))) return EFI_INVALID_PARAMETER;
+    ShimFile *file = newFile(relative);
+    char path[PATH_MAX];
+    hostPath(file, path, sizeof(path));
+    struct stat st;
+    bool exists = stat(path, &st) == 0;
+    if (exists && S_ISDIR(st.st_mode)) {
+      file->dir = opendir(path);
+    } else if (!exists && (mode & EFI_FILE_MODE_CREATE) && (attributes & EFI_FILE_DIRECTORY)) {
+      if (mkdir(path, 0777) == 0) file->dir = opendir(path);
+    } else {
+      int flags = (mode & EFI_FILE_MODE_WRITE) ? O_RDWR : O_RDONLY;
+      if (mode & EFI_FILE_MODE_CREATE) flags |= O_CREAT;
+      file->fd = ::open(path, flags, 0666);
+    }
+    if (file->fd < 0 && !file->dir) {
+      EFI_STATUS status = statusOf(errno);
+      free(file);
+      return status;
+    }
+    ++counters.fileOpens;
+    *newHandle = &file->protocol;
+    return EFI_SUCCESS;
+  }
+
+  static EFI_STATUS EFIAPI fileClose(EFI_FILE_PROTOCOL *self) {
+    ShimFile *file = (ShimFile *)self;
+    if (file->fd >= 0) ::close(file->fd);
+    if (file->dir) closedir(file->dir);
+    free(file);
+    return EFI_SUCCESS;
+  }
+
+  static EFI_STATUS EFIAPI fileDelete(EFI_FILE_PROTOCOL *self) {
+    ShimFile *file = (ShimFile *)self;
+    char path[PATH_MAX];
+    hostPath(file, path, sizeof(path));
+    bool directory = file->dir != nullptr;
+    fileClose(self);
+    return (directory ? rmdir(path) : unlink(path)) == 0 ? EFI_SUCCESS : EFI_WARN_DELETE_FAILURE;
+  }
+
+  /** statの内容をEFI_FILE_INFOに詰める bufferが足りなければ必要な大きさだけsizeに入れてfalseを返す */
+  static bool fillFileInfo(const char *path, const char *name, UINTN *size, void *buffer) {
+    CHAR16 fileName[NAME_MAX + 1];
+    UINTN length = toUtf16(name, fileName, NAME_MAX + 1);
+    UINTN needed = SIZE_OF_EFI_FILE_INFO + (length + 1) * sizeof(CHAR16);
+    if (*size < needed) {
+      *size = needed;
+      return false;
+    }
+    struct stat st;
+    if (stat(path, &st) != 0) memset(&st, 0, sizeof(st));
+    EFI_FILE_INFO *info = (EFI_FILE_INFO *)buffer;
+    memset(info, 0, SIZE_OF_EFI_FILE_INFO);
+    info->Size = needed;
+    info->FileSize = S_ISDIR(st.st_mode) ? 0 : st.st_size;
+    info->PhysicalSize = st.st_blocks * 512;
+    struct tm tm;
+    gmtime_r(&st.st_mtime, &tm);
+    EFI_TIME time {};
+    time.Year = tm.tm_year + 1900;
+    time.Month = tm.tm_mon + 1;
+    time.Day = tm.tm_mday;
+    time.Hour = tm.tm_hour;
+    time.Minute = tm.tm_min;
+    time.Second = tm.tm_sec;
+    time.TimeZone = 2047; // EFI_UNSPECIFIED_TIMEZONE
+    info->CreateTime = info->LastAccessTime = info->ModificationTime = time;
+    if (S_ISDIR(st.st_mode)) info->Attribute |= EFI_FILE_DIRECTORY;
+    if (access(path, W_OK) != 0) info->Attribute |= EFI_FILE_READ_ONLY;
+    memcpy(info->FileName, fileName, (length + 1) * sizeof(CHAR16));
+    *size = needed;
+    return true;
+  }
+
+  /** ディレクトリならEFI_FILE_INFOを1つずつ返し、終わりでは*bufferSizeを0にする */
+  static EFI_STATUS EFIAPI fileRead(EFI_FILE_PROTOCOL *self, UINTN *bufferSize, void *buffer) {
+    ShimFile *file = (ShimFile *)self;
+    ++counters.fileReadCalls;
+    if (file->dir) {
+      while (!file->pending) {
+        file->pending = readdir(file->dir);
+        if (!file->pending) {
+          *bufferSize = 0;
+          return EFI_SUCCESS;
+        }
+        if (strcmp(file->pending->d_name, ".") == 0 || strcmp(file->pending->d_name, "..") == 0) file->pending = nullptr;
+      }
+      char directory[PATH_MAX], path[PATH_MAX + NAME_MAX + 2];
+      hostPath(file, directory, sizeof(directory));
+      snprintf(path, sizeof(path), "%s/%s", directory, file->pending->d_name);
+      if (!fillFileInfo(path, file->pending->d_name, bufferSize, buffer)) return EFI_BUFFER_TOO_SMALL;
+      file->pending = nullptr;
+      return EFI_SUCCESS;
+    }
+    ssize_t n = ::read(file->fd, buffer, *bufferSize);
+    if (n < 0) {
+      *bufferSize = 0;
+      return EFI_DEVICE_ERROR;
+    }
+    *bufferSize = n;
+    counters.fileReadBytes += n;
+    return EFI_SUCCESS;
+  }
+
+  static EFI_STATUS EFIAPI fileWrite(EFI_FILE_PROTOCOL *self, UINTN *bufferSize, void *buffer) {
+    ShimFile *file = (ShimFile *)self;
+    if (file->dir) return EFI_UNSUPPORTED;
+    ssize_t n = ::write(file->fd, buffer, *bufferSize);
+    if (n < 0) {
+      *bufferSize = 0;
+      return statusOf(errno);
+    }
+    *bufferSize = n;
+    return EFI_SUCCESS;
+  }
+
+  static EFI_STATUS EFIAPI fileGetPosition(EFI_FILE_PROTOCOL *self, UINT64 *position) {
+    ShimFile *file = (ShimFile *)self;
+    if (file->dir) return EFI_UNSUPPORTED;
+    *position = lseek(file->fd, 0, SEEK_CUR);
+    return EFI_SUCCESS;
+  }
+
+  /** 0xFFFFFFFFFFFFFFFFはファイルの終端 ディレクトリは0へ戻すことだけできる */
+  static EFI_STATUS EFIAPI fileSetPosition(EFI_FILE_PROTOCOL *self, UINT64 position) {
+    ShimFile *file = (ShimFile *)self;
+    if (file->dir) {
+      if (position != 0) return EFI_UNSUPPORTED;
+      rewinddir(file->dir);
+      file->pending = nullptr;
+      return EFI_SUCCESS;
+    }
+    off_t result = position == 0xFFFFFFFFFFFFFFFFULL ? lseek(file->fd, 0, SEEK_END) : lseek(file->fd, position, SEEK_SET);
+    return result < 0 ? EFI_DEVICE_ERROR : EFI_SUCCESS;
+  }
+
+  static EFI_STATUS EFIAPI fileGetInfo(EFI_FILE_PROTOCOL *self, EFI_GUID *type, UINTN *bufferSize, void *buffer) {
+    ShimFile *file = (ShimFile *)self;
+    if (!sameGuid(type, &fileInfoGuid)) return EFI_UNSUPPORTED;
+    char path[PATH_MAX];
+    hostPath(file, path, sizeof(path));
+    const char *slash = strrchr(file->path, '/');
+    const char *name = slash ? slash + 1 : file->path;
+    return fillFileInfo(path, name, bufferSize, buffer) ? EFI_SUCCESS : EFI_BUFFER_TOO_SMALL;
+  }
+
+  static EFI_STATUS EFIAPI fileSetInfo(EFI_FILE_PROTOCOL *, EFI_GUID *, UINTN, void *) {
+    return EFI_WRITE_PROTECTED;
+  }
+
+  static EFI_STATUS EFIAPI fileFlush(EFI_FILE_PROTOCOL *self) {
+    ShimFile *file = (ShimFile *)self;
+    if (file->fd >= 0) fsync(file->fd);
+    return EFI_SUCCESS;
+  }
+
+  static ShimFile *newFile(const char *path) {
+    ShimFile *file = (ShimFile *)calloc(1, sizeof(ShimFile));
+    file->protocol.Revision = EFI_FILE_PROTOCOL_REVISION_1;
+    file->protocol.Open = fileOpen;
+    file->protocol.Close = fileClose;
+    file->protocol.Delete = fileDelete;
+    file->protocol.Read = fileRead;
+    file->protocol.Write = fileWrite;
+    file->protocol.GetPosition = fileGetPosition;
+    file->protocol.SetPosition = fileSetPosition;
+    file->protocol.GetInfo = fileGetInfo;
+    file->protocol.SetInfo = fileSetInfo;
+    file->protocol.Flush = fileFlush;
+    file->fd = -1;
+    snprintf(file->path, sizeof(file->path), "%s", path);
+    return file;
+  }
+
+  static EFI_STATUS EFIAPI openVolume(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *, EFI_FILE_PROTOCOL **root) {
+    ShimFile *file = newFile("");
+    file->dir = opendir(options.root);
+    if (!file->dir) {
+      EFI_STATUS status = statusOf(errno);
+      free(file);
+      return status;
+    }
+    *root = &file->protocol;
+    return EFI_SUCCESS;
+  }
+
+  // ブートサービス
+
+  /** イベントは種類を覚えておくだけ */
+  struct _ShimEvent {
+    UINT32 type;
+    UINT64 period;
+    UINT64 deadline;
+  };
+
+  typedef struct _ShimEvent ShimEvent;
+
+  static ShimEvent waitForKeyEvent;
+  static ShimEvent waitForInputEvent;
+  static UINT64 currentTick;
+
+  static EFI_STATUS EFIAPI allocatePages(EFI_ALLOCATE_TYPE type, EFI_MEMORY_TYPE, UINTN pages, EFI_PHYSICAL_ADDRESS *memory) {
+    ++counters.allocatePagesCalls;
+    // 指定アドレスへの確保は仮想メモリ上では約束できないので断る
+    if (type != AllocateAnyPages) return EFI_NOT_FOUND;
+    void *p;
+    if (posix_memalign(&p, EFI_PAGE_SIZE, EFI_PAGES_TO_SIZE(pages)) != 0) return EFI_OUT_OF_RESOURCES;
+    counters.allocatedPages += pages;
+    *memory = (EFI_PHYSICAL_ADDRESS)p;
+    return EFI_SUCCESS;
+  }
+
+  static EFI_STATUS EFIAPI freePages(EFI_PHYSICAL_ADDRESS memory, UINTN) {
+    free((void *)memory);
+    return EFI_SUCCESS;
+  }
+
+  static EFI_STATUS EFIAPI allocatePool(EFI_MEMORY_TYPE, UINTN size, void **buffer) {
+    ++counters.allocatePoolCalls;
+    *buffer = malloc(size);
+    return *buffer ? EFI_SUCCESS : EFI_OUT_OF_RESOURCES;
+  }
+
+  static EFI_STATUS EFIAPI freePool(void *buffer) {
+    free(buffer);
+    return EFI_SUCCESS;
+  }
+
+  static EFI_STATUS EFIAPI createEvent(UINT32 type, UINTN, EFI_EVENT_NOTIFY, void *, EFI_EVENT *event) {
+    ShimEvent *shimEvent = (ShimEvent *)calloc(1, sizeof(ShimEvent));
+    shimEvent->type = type;
+    *event = shimEvent;
+    return EFI_SUCCESS;
+  }
+
+  static EFI_STATUS EFIAPI closeEvent(EFI_EVENT event) {
+    if (event != &waitForKeyEvent && event != &waitForInputEvent) free(event);
+    return EFI_SUCCESS;
+  }
+
+  /** periodは100ns単位 */
+  static EFI_STATUS EFIAPI setTimer(EFI_EVENT event, EFI_TIMER_DELAY type, UINT64 period) {
+    ShimEvent *shimEvent = (ShimEvent *)event;
+    shimEvent->period = type == TimerCancel ? 0 : period * 100;
+    shimEvent->deadline = now() + shimEvent->period;
+    return EFI_SUCCESS;
+  }
+
+  /** タイマーを1回進める 上限に達していたら終える */
+  static void advanceTimer(ShimEvent *timer) {
+    if (options.maxTicks ? currentTick >= options.maxTicks : scriptFinished()) exit(0);
+    if (options.realtime && timer) {
+      UINT64 t = now();
+      if (t < timer->deadline) {
+        UINT64 wait = timer->deadline - t;
+        struct timespec ts {(time_t)(wait / 1000000000ULL), (long)(wait % 1000000000ULL)};
+        nanosleep(&ts, nullptr);
+      }
+      timer->deadline += timer->period;
+    }
+    ++currentTick;
+    ++counters.ticks;
+    dispatchScript(currentTick);
+  }
+
+  static bool signaled(EFI_EVENT event) {
+    if (event == &waitForKeyEvent) return keyHead != keyTail;
+    if (event == &waitForInputEvent) return pointerChanged;
+    return false;
+  }
+
+  /**
+   * キーが来ていればWaitForKeyを返す
+   *
+   * そうでなければ待っているタイマーを1ティック進めて返す タイマーを待っていなければ
+   * 入力が来るまでティックを進める
+   */
+  static EFI_STATUS EFIAPI waitForEvent(UINTN count, EFI_EVENT *events, UINTN *index) {
+    while (true) {
+      ShimEvent *timer = nullptr;
+      for (UINTN i = 0; i < count; ++i) {
+        if (signaled(events[i])) {
+          *index = i;
+          return EFI_SUCCESS;
+        }
+        ShimEvent *event = (ShimEvent *)events[i];
+        if (!timer && event != &waitForKeyEvent && event != &waitForInputEvent && (event->type & EVT_TIMER)) {
+          timer = event;
+          *index = i;
+        }
+      }
+      advanceTimer(timer);
+      if (timer) return EFI_SUCCESS;
+    }
+  }
+
+  static EFI_STATUS EFIAPI checkEvent(EFI_EVENT event) {
+    if (signaled(event)) return EFI_SUCCESS;
+    ShimEvent *shimEvent = (ShimEvent *)event;
+    if (event == &waitForKeyEvent || event == &waitForInputEvent || !(shimEvent->type & EVT_TIMER)) return EFI_NOT_READY;
+    if (options.realtime && now() < shimEvent->deadline) return EFI_NOT_READY;
+    advanceTimer(shimEvent);
+    return EFI_SUCCESS;
+  }
+
+  /** microsecondsはマイクロ秒 */
+  static EFI_STATUS EFIAPI stall(UINTN microseconds) {
+    struct timespec ts {(time_t)(microseconds / 1000000), (long)(microseconds % 1000000) * 1000};
+    nanosleep(&ts, nullptr);
+    return EFI_SUCCESS;
+  }
+
+  // マルチプロセッサ
+  //
+  // APはスレッドで真似する プロセッサ番号0がBSP
+
+  /** このスレッドのプロセッサ番号 */
+  static thread_local UINTN processorNumber;
+
+  struct _ApStart {
+    EFI_AP_PROCEDURE procedure;
+    void *argument;
+    UINTN number;
+  };
+
+  typedef struct _ApStart ApStart;
+
+  static void *apThread(void *arg) {
+    ApStart start = *(ApStart *)arg;
+    free(arg);
+    processorNumber = start.number;
+    start.procedure(start.argument);
+    return nullptr;
+  }
+
+  static EFI_STATUS startAp(EFI_AP_PROCEDURE procedure, UINTN number, void *argument) {
+    ApStart *start = (ApStart *)malloc(sizeof(ApStart));
+    *start = ApStart {procedure, argument, number};
+    pthread_t thread;
+    if (pthread_create(&thread, nullptr, apThread, start) != 0) {
+      free(start);
+      return EFI_OUT_OF_RESOURCES;
+    }
+    pthread_detach(thread);
+    return EFI_SUCCESS;
+  }
+
+  static EFI_STATUS EFIAPI getNumberOfProcessors(EFI_MP_SERVICES_PROTOCOL *, UINTN *count, UINTN *enabled) {
+    *count = *enabled = options.cpus;
+    return EFI_SUCCESS;
+  }
+
+  static EFI_STATUS EFIAPI getProcessorInfo(EFI_MP_SERVICES_PROTOCOL *, UINTN number, EFI_PROCESSOR_INFORMATION *info) {
+    if (number >= options.cpus) return EFI_NOT_FOUND;
+    memset(info, 0, sizeof(*info));
+    info->ProcessorId = number;
+    info->StatusFlag = PROCESSOR_ENABLED_BIT | PROCESSOR_HEALTH_STATUS_BIT | (number == 0 ? PROCESSOR_AS_BSP_BIT : 0);
+    info->Location.Core = number;
+    return EFI_SUCCESS;
+  }
+
+  /** 待たずに戻る形(WaitEventあり)だけを扱う 終わってもWaitEventは知らせない */
+  static EFI_STATUS EFIAPI startupAllAps(EFI_MP_SERVICES_PROTOCOL *, EFI_AP_PROCEDURE procedure, BOOLEAN singleThread,
+    EFI_EVENT waitEvent, UINTN, void *argument, UINTN **failedCpuList) {
+    if (processorNumber != 0) return EFI_DEVICE_ERROR;
+    if (singleThread || waitEvent == nullptr) return EFI_UNSUPPORTED;
+    if (options.cpus < 2) return EFI_NOT_STARTED;
+    if (failedCpuList) *failedCpuList = nullptr;
+    for (UINTN i = 1; i < options.cpus; ++i) {
+      EFI_STATUS status = startAp(procedure, i, argument);
+      if (status != EFI_SUCCESS) return status;
+    }
+    return EFI_SUCCESS;
+  }
+
+  static EFI_STATUS EFIAPI startupThisAp(EFI_MP_SERVICES_PROTOCOL *, EFI_AP_PROCEDURE procedure, UINTN number,
+    EFI_EVENT waitEvent, UINTN, void *argument, BOOLEAN *) {
+    if (processorNumber != 0) return EFI_DEVICE_ERROR;
+    if (number == 0 || number >= options.cpus) return EFI_INVALID_PARAMETER;
+    if (waitEvent == nullptr) return EFI_UNSUPPORTED;
+    return startAp(procedure, number, argument);
+  }
+
+  static EFI_STATUS EFIAPI switchBsp(EFI_MP_SERVICES_PROTOCOL *, UINTN, BOOLEAN) {
+    return EFI_UNSUPPORTED;
+  }
+
+  static EFI_STATUS EFIAPI enableDisableAp(EFI_MP_SERVICES_PROTOCOL *, UINTN, BOOLEAN, UINT32 *) {
+    return EFI_UNSUPPORTED;
+  }
+
+  static EFI_STATUS EFIAPI whoAmI(EFI_MP_SERVICES_PROTOCOL *, UINTN *number) {
+    *number = processorNumber;
+    return EFI_SUCCESS;
+  }
+
+  static EFI_SIMPLE_TEXT_INPUT_PROTOCOL textIn;
+  static EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL textOut;
+  static EFI_SIMPLE_POINTER_PROTOCOL simplePointer;
+  static EFI_GRAPHICS_OUTPUT_PROTOCOL graphicsOutput;
+  static EFI_MP_SERVICES_PROTOCOL mpServices;
+  static EFI_BOOT_SERVICES bootServices;
+  static EFI_SYSTEM_TABLE systemTable;
+
+  static EFI_STATUS EFIAPI locateProtocol(EFI_GUID *protocol, void *, void **interface) {
+    if (sameGuid(protocol, &graphicsOutputGuid)) {
+      *interface = &graphicsOutput;
+    } else if (sameGuid(protocol, &simpleFileSystemGuid)) {
+      *interface = &simpleFileSystem;
+    } else if (sameGuid(protocol, &simplePointerGuid)) {
+      *interface = &simplePointer;
+    } else if (sameGuid(protocol, &mpServicesGuid) && options.cpus > 1) {
+      *interface = &mpServices;
+    } else {
+      *interface = nullptr;
+      return EFI_NOT_FOUND;
+    }
+    return EFI_SUCCESS;
+  }
+
+  static void EFIAPI copyMem(void *destination, void *source, UINTN length) {
+    memmove(destination, source, length);
+  }
+
+  static void EFIAPI setMem(void *buffer, UINTN size, UINT8 value) {
+    memset(buffer, value, size);
+  }
+
+  // 全体
+
+  static void usage(const char *program) {
+    fprintf(stderr,
+      "usage: %s [--root DIR] [--screen WxH] [--ticks N] [--input SCRIPT] [--dump FILE.ppm] [--realtime] [--quiet] [--cpus N]\n",
+      program);
+  }
+
+  bool parseOptions(int argc, char **argv, Options *options) {
+    for (int i = 1; i < argc; ++i) {
+      const char *arg = argv[i];
+      bool hasValue = i + 1 < argc;
+      if (strcmp(arg, "--root") == 0 && hasValue) {
+        options->root = argv[++i];
+      } else if (strcmp(arg, "--screen") == 0 && hasValue) {
+        if (sscanf(argv[++i], "%ux%u", &options->width, &options->height) != 2 || !options->width || !options->height) {
+          usage(argv[0]);
+          return false;
+        }
+      } else if (strcmp(arg, "--ticks") == 0 && hasValue) {
+        options->maxTicks = strtoull(argv[++i], nullptr, 10);
+      } else if (strcmp(arg, "--input") == 0 && hasValue) {
+        options->script = argv[++i];
+      } else if (strcmp(arg, "--dump") == 0 && hasValue) {
+        options->dump = argv[++i];
+      } else if (strcmp(arg, "--realtime") == 0) {
+        options->realtime = true;
+      } else if (strcmp(arg, "--quiet") == 0) {
+        options->quiet = true;
+      } else if (strcmp(arg, "--cpus") == 0 && hasValue) {
+        options->cpus = strtoul(argv[++i], nullptr, 10);
+        if (!options->cpus) {
+          usage(argv[0]);
+          return false;
+        }
+      } else {
+        usage(argv[0]);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  EFI_SYSTEM_TABLE *init(const Options *shimOptions) {
+    options = *shimOptions;
+    if (options.script && !loadScript(options.script)) ::exit(2);
+    dispatchScript(0);
+
+    textIn.Reset = textInReset;
+    textIn.ReadKeyStroke = readKeyStroke;
+    textIn.WaitForKey = &waitForKeyEvent;
+    textOut.Reset = textOutReset;
+    textOut.OutputString = outputString;
+    textOut.ClearScreen = clearScreen;
+
+    simplePointer.Reset = pointerReset;
+    simplePointer.GetState = getState;
+    simplePointer.WaitForInput = &waitForInputEvent;
+
+    const UINT32 defaultModes[][2] = {{640, 480}, {800, 600}, {1024, 768}, {1280, 720}, {1920, 1080}};
+    for (const UINT32 *mode : defaultModes) addMode(mode[0], mode[1]);
+    addMode(options.width, options.height);
+    gopMode.Info = &currentInfo;
+    gopMode.SizeOfInfo = sizeof(EFI_GRAPHICS_OUTPUT_MODE_INFORMATION);
+    graphicsOutput.QueryMode = queryMode;
+    graphicsOutput.SetMode = setMode;
+    graphicsOutput.Blt = blt;
+    graphicsOutput.Mode = &gopMode;
+    for (UINT32 i = 0; i < gopMode.MaxMode; ++i) {
+      if (modes[i].HorizontalResolution == options.width && modes[i].VerticalResolution == options.height) {
+        setMode(&graphicsOutput, i);
+      }
+    }
+
+    mpServices.GetNumberOfProcessors = getNumberOfProcessors;
+    mpServices.GetProcessorInfo = getProcessorInfo;
+    mpServices.StartupAllAPs = startupAllAps;
+    mpServices.StartupThisAP = startupThisAp;
+    mpServices.SwitchBSP = switchBsp;
+    mpServices.EnableDisableAP = enableDisableAp;
+    mpServices.WhoAmI = whoAmI;
+
+    simpleFileSystem.Revision = 0x00010000;
+    simpleFileSystem.OpenVolume = openVolume;
+
+    bootServices.AllocatePages = allocatePages;
+    bootServices.FreePages = freePages;
+    bootServices.AllocatePool = allocatePool;
+    bootServices.FreePool = freePool;
+    bootServices.CreateEvent = createEvent;
+    bootServices.SetTimer = setTimer;
+    bootServices.WaitForEvent = waitForEvent;
+    bootServices.CheckEvent = checkEvent;
+    bootServices.CloseEvent = closeEvent;
+    bootServices.Stall = stall;
+    bootServices.LocateProtocol = locateProtocol;
+    bootServices.CopyMem = copyMem;
+    bootServices.SetMem = setMem;
+
+    systemTable.FirmwareVendor = (CHAR16 *)L"efigame host shim";
+    systemTable.ConIn = &textIn;
+    systemTable.ConOut = &textOut;
+    systemTable.BootServices = &bootServices;
+    return &systemTable;
+  }
+
+  void exit(int code) {
+    fflush(stdout);
+    if (options.dump && !dumpScreen(options.dump)) {
+      fprintf(stderr, "efi_shim: cannot write %s\n", options.dump);
+      code = 1;
+    }
+    fprintf(stderr, "efi_shim: %llu ticks, %llu blt (%llu px), %llu AllocatePages (%llu pages), %llu AllocatePool, %llu opens, %llu reads (%llu bytes)\n",
+      (unsigned long long)counters.ticks, (unsigned long long)counters.bltCalls, (unsigned long long)counters.bltPixels,
+      (unsigned long long)counters.allocatePagesCalls, (unsigned long long)counters.allocatedPages,
+      (unsigned long long)counters.allocatePoolCalls, (unsigned long long)counters.fileOpens,
+      (unsigned long long)counters.fileReadCalls, (unsigned long long)counters.fileReadBytes);
+    ::exit(code);
+  }
+};
@@ -0,0 +1,83 @@
+// Linux上でmain.cppを動かすためのEFI_SYSTEM_TABLEの代わり
+//
+// main.cppのmalloc/memsetなどはglibcと同じ名前なので、シムは別の翻訳単位に分けてあり
+// ここではUEFIの型しか使わない
+#ifndef EFI_SHIM_H
+#define EFI_SHIM_H
+
+#include <Uefi.h>
+#include <Protocol/GraphicsOutput.h>
+
+namespace EfiShim {
+  struct _Options {
+    /** EFI_FILE_PROTOCOLのルートにするディレクトリ */
+    const char *root = "fs";
+    /** 起動時の画面サイズ */
+    UINT32 width = 800;
+    UINT32 height = 600;
+    /** このティック数だけタイマーイベントを返したら終了する 0なら入力スクリプトが終わるまで */
+    UINT64 maxTicks = 0;
+    /** 入力スクリプトのパス */
+    const char *script = nullptr;
+    /** 終了時に画面をPPMで書き出すパス */
+    const char *dump = nullptr;
+    /** タイマーの周期どおりに待つか falseなら待たずに次のティックを返す */
+    bool realtime = false;
+    /** ConOutへの出力を捨てる */
+    bool quiet = false;
+    /** プロセッサの数 2以上ならEFI_MP_SERVICES_PROTOCOLを用意し、APをスレッドで動かす */
+    UINT32 cpus = 1;
+  };
+
+  typedef struct _Options Options;
+
+  struct _Stats {
+    /** 返したタイマーイベントの数 */
+    UINT64 ticks;
+    UINT64 bltCalls;
+    /** Bltで書き換えた画面上のピクセル数 */
+    UINT64 bltPixels;
+    UINT64 allocatePagesCalls;
+    UINT64 allocatedPages;
+    UINT64 allocatePoolCalls;
+    UINT64 fileOpens;
+    UINT64 fileReadCalls;
+    UINT64 fileReadBytes;
+  };
+
+  typedef struct _Stats Stats;
+
+  /**
+   * コマンドライン引数を読む
+   *
+   *   --root DIR  --screen WxH  --ticks N  --input SCRIPT  --dump FILE.ppm  --realtime  --quiet  --cpus N
+   *
+   * 知らない引数があれば使い方を出してfalseを返す
+   */
+  bool parseOptions(int argc, char **argv, Options *options);
+
+  /**
+   * シムのシステムテーブルを作る
+   *
+   * 入力スクリプトは1行1イベントで、ティック番号の順でなくてもよい
+   *   <tick> key <文字>     キー入力 \r \n \t \\ と \xHHHH、ファンクションキーは \F1 から \F12
+   *   <tick> move <dx> <dy> マウス移動
+   *   <tick> down / up      左ボタンを押す/離す
+   *   <tick> click          <tick>で押して次のティックで離す
+   *   # から行末まではコメント
+   */
+  EFI_SYSTEM_TABLE *init(const Options *options);
+
+  /** 画面を書き出し、統計を標準エラーに出してプロセスを終える */
+  [[noreturn]] void exit(int code = 0);
+
+  /** 画面の内容 PixelsPerScanLineは画面の幅と同じ */
+  EFI_GRAPHICS_OUTPUT_BLT_PIXEL *framebuffer();
+
+  const Stats *stats();
+
+  /** 単調増加する時刻(ナノ秒) */
+  UINT64 now();
+};
+
+#endif
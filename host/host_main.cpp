@@ -0,0 +1,14 @@
+// main.cppをLinuxのプロセスとして動かす
+//
+// usage: make host && ./host/efigame --ticks 300 --input host/demo.input --dump screen.ppm
+//
+// main.cppとシムは別の翻訳単位でビルドする(efi_shim.hを参照)
+#include "../main.cpp"
+#include "efi_shim.h"
+
+int main(int argc, char **argv) {
+  EfiShim::Options options;
+  if (!EfiShim::parseOptions(argc, argv, &options)) return 2;
+  efi_main(nullptr, EfiShim::init(&options));
+  EfiShim::exit();
+}
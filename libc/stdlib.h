@@ -5,24 +5,179 @@
 #ifndef STDLIB_H
 #define STDLIB_H
 
+/*
+ * AllocatePagesでまとめて確保したページを切り分けて使うアロケータ
+ *
+ * 4096バイトまでは2の累乗の大きさごとの空きリストから、それより大きいものは
+ * ページ単位で直接確保する ファームウェアを呼ぶのはページが足りない時だけ
+ */
+namespace libc {
+  #define HEAP_CHUNK_PAGES 16
+  #define HEAP_MIN_CLASS_SHIFT 4
+  #define HEAP_CLASS_COUNT 9
+  #define HEAP_MAX_CLASS_SIZE (1 << (HEAP_MIN_CLASS_SHIFT + HEAP_CLASS_COUNT - 1))
+  #define HEAP_LARGE_CLASS 0xFFFFFFFF
+  #define HEAP_MAGIC 0x48454150 // "HEAP"
+
+  /** 確保したブロックの直前に置く 16バイトなので中身も16バイト境界に揃う */
+  struct _BlockHeader {
+    /** 使える大きさ */
+    UINT64 capacity;
+    /** 空きリストの番号 ページ単位ならHEAP_LARGE_CLASS */
+    UINT32 sizeClass;
+    UINT32 magic;
+  };
+
+  typedef struct _BlockHeader BlockHeader;
+
+  static void *freeLists[HEAP_CLASS_COUNT];
+  /** 小さいブロックを切り出している途中のページ */
+  static UINT8 *chunkTop;
+  static UINT8 *chunkEnd;
+  /** ファームウェアのメモリ確保を呼んだ回数 */
+  static UINT64 firmwareAllocations;
+  /** mallocを呼んだ回数 reallocで移した分も含む */
+  static UINT64 allocationCount;
+
+  void* allocatePages(UINTN pages) {
+    EFI_PHYSICAL_ADDRESS address;
+    ++firmwareAllocations;
+    EFI_STATUS Status = BootServices->AllocatePages(AllocateAnyPages, EfiLoaderData, pages, &address);
+    return Status == EFI_SUCCESS ? (void*)address : nullptr;
+  }
+
+  auto sizeClassOf(UINTN size) {
+    UINT32 sizeClass = 0;
+    while (((UINTN)1 << (HEAP_MIN_CLASS_SHIFT + sizeClass)) < size) ++sizeClass;
+    return sizeClass;
+  }
+
+  auto headerOf(void *ptr) {
+    return (BlockHeader*)ptr - 1;
+  }
+
+  void* allocateSmall(UINTN size) {
+    UINT32 sizeClass = sizeClassOf(size);
+    UINTN capacity = (UINTN)1 << (HEAP_MIN_CLASS_SHIFT + sizeClass);
+    if (freeLists[sizeClass] != nullptr) {
+      void *ptr = freeLists[sizeClass];
+      freeLists[sizeClass] = *(void**)ptr;
+      return ptr;
+    }
+    UINTN blockSize = sizeof(BlockHeader) + capacity;
+    if (chunkTop == nullptr || chunkTop + blockSize > chunkEnd) {
+      // 残りは捨てずに小さいほうから空きリストへ入れておく
+      while (chunkTop != nullptr && chunkTop + sizeof(BlockHeader) + (1 << HEAP_MIN_CLASS_SHIFT) <= chunkEnd) {
+        UINT32 restClass = sizeClassOf(chunkEnd - chunkTop - sizeof(BlockHeader));
+        if (((UINTN)1 << (HEAP_MIN_CLASS_SHIFT + restClass)) > (UINTN)(chunkEnd - chunkTop - sizeof(BlockHeader))) --restClass;
+        BlockHeader *rest = (BlockHeader*)chunkTop;
+        rest->capacity = (UINTN)1 << (HEAP_MIN_CLASS_SHIFT + restClass);
+        rest->sizeClass = restClass;
+        rest->magic = HEAP_MAGIC;
+        *(void**)(rest + 1) = freeLists[restClass];
+        freeLists[restClass] = rest + 1;
+        chunkTop += sizeof(BlockHeader) + rest->capacity;
+      }
+      chunkTop = (UINT8*)allocatePages(HEAP_CHUNK_PAGES);
+      if (chunkTop == nullptr) return nullptr;
+      chunkEnd = chunkTop + EFI_PAGES_TO_SIZE(HEAP_CHUNK_PAGES);
+    }
+    BlockHeader *header = (BlockHeader*)chunkTop;
+    chunkTop += blockSize;
+    header->capacity = capacity;
+    header->sizeClass = sizeClass;
+    header->magic = HEAP_MAGIC;
+    return header + 1;
+  }
+
+  #define HEAP_LARGE_CACHE_SIZE 1024 * 1024 * 64
+
+  /** 解放されたページ単位のブロック 中身の先頭に次へのポインタを置く */
+  static void *largeFreeList;
+  static UINTN largeFreeBytes;
+
+  auto pagesOf(BlockHeader *header) {
+    return EFI_SIZE_TO_PAGES(sizeof(BlockHeader) + header->capacity);
+  }
+
+  void* allocateLarge(UINTN size) {
+    UINTN pages = EFI_SIZE_TO_PAGES(sizeof(BlockHeader) + size);
+    // 解放済みのものから大きすぎないものを探す
+    for (void **slot = &largeFreeList; *slot != nullptr; slot = (void**)*slot) {
+      BlockHeader *cached = headerOf(*slot);
+      if (pagesOf(cached) >= pages && pagesOf(cached) <= pages * 2) {
+        void *ptr = *slot;
+        *slot = *(void**)ptr;
+        largeFreeBytes -= cached->capacity;
+        return ptr;
+      }
+    }
+    BlockHeader *header = (BlockHeader*)allocatePages(pages);
+    if (header == nullptr) return nullptr;
+    header->capacity = EFI_PAGES_TO_SIZE(pages) - sizeof(BlockHeader);
+    header->sizeClass = HEAP_LARGE_CLASS;
+    header->magic = HEAP_MAGIC;
+    return header + 1;
+  }
+
+  /** ページ単位のブロックを直後のページを確保してその場で広げる */
+  bool growLargeInPlace(BlockHeader *header, UINTN size) {
+    UINTN pages = pagesOf(header);
+    UINTN newPages = EFI_SIZE_TO_PAGES(sizeof(BlockHeader) + size);
+    EFI_PHYSICAL_ADDRESS address = (EFI_PHYSICAL_ADDRESS)header + EFI_PAGES_TO_SIZE(pages);
+    ++firmwareAllocations;
+    if (EFI_SUCCESS != BootServices->AllocatePages(AllocateAddress, EfiLoaderData, newPages - pages, &address)) return false;
+    header->capacity = EFI_PAGES_TO_SIZE(newPages) - sizeof(BlockHeader);
+    return true;
+  }
+};
+
 void* malloc(UINTN size) {
-  void *ptr;
-  EFI_STATUS Status = libc::BootServices->AllocatePool(EfiLoaderData, size, &ptr);
-  return Status == EFI_SUCCESS ? ptr : nullptr;
+  ++libc::allocationCount;
+  if (size <= HEAP_MAX_CLASS_SIZE) return libc::allocateSmall(size);
+  return libc::allocateLarge(size);
 }
 
 void free(void *ptr) {
-  libc::BootServices->FreePool(ptr);
+  if (ptr == nullptr) return;
+  libc::BlockHeader *header = libc::headerOf(ptr);
+  if (header->magic != HEAP_MAGIC) return;
+  if (header->sizeClass == HEAP_LARGE_CLASS) {
+    if (libc::largeFreeBytes + header->capacity <= HEAP_LARGE_CACHE_SIZE) {
+      *(void**)ptr = libc::largeFreeList;
+      libc::largeFreeList = ptr;
+      libc::largeFreeBytes += header->capacity;
+      return;
+    }
+    header->magic = 0;
+    libc::BootServices->FreePages((EFI_PHYSICAL_ADDRESS)header, libc::pagesOf(header));
+  } else {
+    *(void**)ptr = libc::freeLists[header->sizeClass];
+    libc::freeLists[header->sizeClass] = ptr;
+  }
 }
 
-void* realloc_sized(void *ptr, UINTN old_size, UINTN new_size) {
-  if (!new_size) return nullptr;
-  void* new_ptr = malloc(new_size);
-  UINTN copy_size = old_size < new_size ? old_size : new_size;
-  memcpy(new_ptr, ptr, copy_size);
+/** 今のブロックに収まるか直後のページを広げられればその場で、無理なら移して大きさを変える */
+void* realloc(void *ptr, UINTN size) {
+  if (ptr == nullptr) return malloc(size);
+  if (!size) {
+    free(ptr);
+    return nullptr;
+  }
+  libc::BlockHeader *header = libc::headerOf(ptr);
+  if (size <= header->capacity) return ptr;
+  if (header->sizeClass == HEAP_LARGE_CLASS && libc::growLargeInPlace(header, size)) return ptr;
+  void* new_ptr = malloc(size);
+  if (new_ptr == nullptr) return nullptr;
+  memcpy(new_ptr, ptr, header->capacity);
+  free(ptr);
   return new_ptr;
 }
 
+void* realloc_sized(void *ptr, UINTN old_size __attribute__ ((unused)), UINTN new_size) {
+  return realloc(ptr, new_size);
+}
+
 auto llabs(long long n) {
   return n >= 0 ? n : -n;
 }
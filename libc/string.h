@@ -3,16 +3,54 @@
 #ifndef STRING_H
 #define STRING_H
 
+/** これより短ければrep命令の立ち上がりを待たずに1バイトずつ処理する */
+#define STRING_REP_THRESHOLD 64
+
 void* memset(void *buf, int val, UINTN size) {
   unsigned char *tmp = (unsigned char *)buf;
-  while (size--) *tmp++ = val;
+  if (size < STRING_REP_THRESHOLD) {
+    while (size--) *tmp++ = val;
+    return buf;
+  }
+  // 8バイト境界に揃えてから8バイトずつ書く
+  UINT64 pattern = (UINT8)val * 0x0101010101010101ULL;
+  UINTN head = -(UINTN)tmp & 7;
+  size -= head;
+  UINTN qwords = size >> 3;
+  UINTN rest = size & 7;
+  __asm__ volatile ("rep stosb" : "+D"(tmp), "+c"(head) : "a"(pattern) : "memory");
+  __asm__ volatile ("rep stosq" : "+D"(tmp), "+c"(qwords) : "a"(pattern) : "memory");
+  __asm__ volatile ("rep stosb" : "+D"(tmp), "+c"(rest) : "a"(pattern) : "memory");
+  return buf;
+}
+
+/** 32bitの値をcount個並べる */
+void* memset32(void *buf, UINT32 val, UINTN count) {
+  UINT32 *tmp = (UINT32 *)buf;
+  if (count < STRING_REP_THRESHOLD / 2) {
+    while (count--) *tmp++ = val;
+    return buf;
+  }
+  // 8バイト境界に揃えてから2個ずつ書く
+  if ((UINTN)tmp & 4) {
+    *tmp++ = val;
+    --count;
+  }
+  UINT64 pattern = ((UINT64)val << 32) | val;
+  UINTN qwords = count >> 1;
+  __asm__ volatile ("rep stosq" : "+D"(tmp), "+c"(qwords) : "a"(pattern) : "memory");
+  if (count & 1) *tmp = val;
   return buf;
 }
 
 void *memcpy(void *dest, const void *src, UINTN n) {
   unsigned char *d = (unsigned char *)dest;
   unsigned char const *s = (unsigned char const *)src;
-  while (n--) *d++ = *s++;
+  if (n < STRING_REP_THRESHOLD) {
+    while (n--) *d++ = *s++;
+    return dest;
+  }
+  __asm__ volatile ("rep movsb" : "+D"(d), "+S"(s), "+c"(n) : : "memory");
   return dest;
 }
 
@@ -43,6 +81,14 @@ CHAR16* strcat(CHAR16 *dest, const CHAR16 *src) {
   return dest;
 }
 
+INT32 strcmp(const CHAR16 *str1, const CHAR16 *str2) {
+  while (*str1 != L'\0' && *str1 == *str2) {
+    ++str1;
+    ++str2;
+  }
+  return (INT32)*str1 - (INT32)*str2;
+}
+
 UINTN strlen(CHAR16 *str) {
   UINTN len = 0;
   while(*(str + len) != L'\0') ++len;
@@ -2,6 +2,7 @@
 #include <Protocol/SimplePointer.h>
 #include <Protocol/SimpleFileSystem.h>
 #include <Protocol/GraphicsOutput.h>
+#include <Protocol/MpService.h>
 #include <Guid/FileInfo.h>
 #include <string.h>
 
@@ -13,21 +14,24 @@
 #define STBI_NO_LINEAR
 #define STBI_NO_HDR
 #define STBI_ONLY_PNG
-#define STBI_MALLOC(sz) malloc(sz)
-#define STBI_FREE(p) free(p)
-#define STBI_REALLOC_SIZED(p,oldsz,newsz) realloc_sized(p,oldsz,newsz)
+// APでデコードするときはそのAPの領域から取る
+void* stbiMalloc(UINTN size);
+void stbiFree(void *p);
+void* stbiRealloc(void *p, UINTN oldSize, UINTN newSize);
+#define STBI_MALLOC(sz) stbiMalloc(sz)
+#define STBI_FREE(p) stbiFree(p)
+#define STBI_REALLOC_SIZED(p,oldsz,newsz) stbiRealloc(p,oldsz,newsz)
 #include <stb_image.h>
 
 EFI_GUID gEfiSimplePointerProtocolGuid = EFI_SIMPLE_POINTER_PROTOCOL_GUID;
 EFI_GUID gEfiSimpleFileSystemProtocolGuid = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
 EFI_GUID gEfiGraphicsOutputProtocolGuid = EFI_GRAPHICS_OUTPUT_PROTOCOL_GUID;
+EFI_GUID gEfiMpServiceProtocolGuid = EFI_MP_SERVICES_PROTOCOL_GUID;
+EFI_GUID gEfiFileInfoGuid = EFI_FILE_INFO_ID;
 
 template <class T> void *memcpy(T *dest, const T *src, UINTN n)
 {
-  T *d = dest;
-  T const *s = src;
-  while (n--) *d++ = *s++;
-  return dest;
+  return memcpy((void*)dest, (const void*)src, sizeof(T) * n);
 }
 
 template <class T> void* memset(T *buf, T val, UINTN size) {
@@ -36,6 +40,11 @@ template <class T> void* memset(T *buf, T val, UINTN size) {
   return buf;
 }
 
+template <> void* memset(EFI_GRAPHICS_OUTPUT_BLT_PIXEL *buf, EFI_GRAPHICS_OUTPUT_BLT_PIXEL val, UINTN size) {
+  UINT32 pattern = val.Blue | (val.Green << 8) | (val.Red << 16) | ((UINT32)val.Reserved << 24);
+  return memset32(buf, pattern, size);
+}
+
 namespace EfiGame {
   static EFI_SYSTEM_TABLE *SystemTable;
 
@@ -65,6 +74,147 @@ namespace EfiGame {
     }
   };
 
+  /**
+   * rdtscで測るフレームプロファイラ
+   *
+   * Zoneを置いた区間の時間をフレームごとに集計し、直近PROFILER_FRAMESフレーム分を
+   * リングバッファに残す TSCの周波数は起動時にStallで測っておく
+   */
+  namespace Profiler {
+    #define PROFILER_FRAMES 256
+    #define PROFILER_CALIBRATE_US 10000
+
+    enum ZoneId {
+      ZoneUpdate,
+      ZoneFlush,
+      ZoneFillRect,
+      ZoneFillCircle,
+      ZoneDrawImage,
+      ZoneDrawStr,
+      ZoneLoadImage,
+      ZoneFileRead,
+      ZoneJobs,
+      ZoneCompose,
+      ZoneLayoutText,
+      ZoneCount,
+    };
+
+    static const char *zoneNames[ZoneCount] = {
+      "update", "flush", "fill_rect", "fill_circle", "draw_image", "draw_str", "load_image", "file_read", "jobs", "compose",
+      "layout_text",
+    };
+
+    struct _Frame {
+      /** フレーム開始時のTSC */
+      UINT64 start;
+      UINT64 cycles;
+      /** 区間ごとの合計 入れ子になった区間はどちらにも数える */
+      UINT64 zoneCycles[ZoneCount];
+      UINT32 zoneCalls[ZoneCount];
+      UINT32 bltCount;
+      /** 前のフレームとの間に取りこぼしたタイマーイベントの数 */
+      UINT32 missedTicks;
+    };
+
+    typedef struct _Frame Frame;
+
+    static Frame frames[PROFILER_FRAMES];
+    /** 記録し終えたフレーム数 */
+    static UINT64 frameCount;
+    static Frame current;
+    static UINT64 tscPerSecond;
+    /** タイマーイベント1回分のTSC */
+    static UINT64 tickCycles;
+    /** trueの間は区間を数えない オーバーレイ自身の描画を除くため */
+    static bool suspended;
+    /** 画面左上に計測結果を出すか */
+    static bool overlay;
+    /** 次のフレームの終わりにリングバッファをファイルへ書き出す */
+    static bool dumpRequested;
+
+    inline UINT64 now() {
+      return __builtin_ia32_rdtsc();
+    }
+
+    void calibrate() {
+      UINT64 start = now();
+      SystemTable->BootServices->Stall(PROFILER_CALIBRATE_US);
+      tscPerSecond = (now() - start) * (1000000 / PROFILER_CALIBRATE_US);
+    }
+
+    /** intervalは100ns単位 */
+    void setTickInterval(UINT64 interval) {
+      tickCycles = tscPerSecond * interval / 10000000;
+    }
+
+    auto toNanoseconds(UINT64 cycles) {
+      return tscPerSecond ? cycles * 1000 / (tscPerSecond / 1000000) : 0;
+    }
+
+    /** スコープを抜けるまでの時間をidの区間に足す */
+    struct _Zone {
+      ZoneId id;
+      UINT64 start;
+
+      _Zone(ZoneId id) : id(id), start(now()) {}
+
+      ~_Zone() {
+        if (suspended) return;
+        current.zoneCycles[id] += now() - start;
+        ++current.zoneCalls[id];
+      }
+    };
+
+    typedef struct _Zone Zone;
+
+    #define PROFILE_ZONE(id) Profiler::Zone _profileZone(Profiler::id)
+
+    void beginFrame() {
+      UINT64 start = now();
+      UINT64 previous = current.start;
+      current = Frame {};
+      current.start = start;
+      if (previous && tickCycles) {
+        UINT64 ticks = (start - previous + tickCycles / 2) / tickCycles;
+        current.missedTicks = ticks > 1 ? ticks - 1 : 0;
+      }
+    }
+
+    void endFrame() {
+      current.cycles = now() - current.start;
+      frames[frameCount % PROFILER_FRAMES] = current;
+      ++frameCount;
+    }
+
+    void countBlt() {
+      ++current.bltCount;
+    }
+
+    /** 記録されているフレーム数 */
+    auto recordedFrames() {
+      return frameCount < PROFILER_FRAMES ? (UINT32)frameCount : (UINT32)PROFILER_FRAMES;
+    }
+
+    /** 古い方からindex番目のフレーム */
+    Frame &recordedFrame(UINT32 index) {
+      return frames[(frameCount - recordedFrames() + index) % PROFILER_FRAMES];
+    }
+
+    /** 記録されているフレームの所要時間のpercentile% 点 */
+    UINT64 percentile(UINT32 percent) {
+      static UINT64 sorted[PROFILER_FRAMES];
+      UINT32 count = recordedFrames();
+      if (!count) return 0;
+      for (UINT32 i = 0; i < count; ++i) {
+        UINT64 cycles = recordedFrame(i).cycles;
+        UINT32 j = i;
+        for (; j > 0 && sorted[j - 1] > cycles; --j) sorted[j] = sorted[j - 1];
+        sorted[j] = cycles;
+      }
+      return sorted[(count - 1) * percent / 100];
+    }
+  };
+
   namespace Input {
     EFI_SIMPLE_POINTER_PROTOCOL *SimplePointerProtocol;
 
@@ -112,6 +262,14 @@ namespace EfiGame {
     auto readKeyStroke() {
       EFI_INPUT_KEY key;
       if (EFI_SUCCESS == SystemTable->ConIn->ReadKeyStroke(SystemTable->ConIn, &key)) {
+        // F11/F12はプロファイラが使うのでゲームには渡さない
+        if (key.ScanCode == SCAN_F11) {
+          Profiler::overlay = !Profiler::overlay;
+          return (CHAR16)-1;
+        } else if (key.ScanCode == SCAN_F12) {
+          Profiler::dumpRequested = true;
+          return (CHAR16)-1;
+        }
         if (triggerKeyEvent && onKeyPress != nullptr) onKeyPress(key.UnicodeChar);
         return key.UnicodeChar;
       } else {
@@ -218,385 +376,3346 @@ namespace EfiGame {
       SimpleFileSystemProtocol->OpenVolume(SimpleFileSystemProtocol, &Root);
     }
 
-    auto open(CHAR16* filename, UINT64 mode = EFI_FILE_MODE_READ) {
-      EFI_FILE_PROTOCOL *file;
-      return EFI_SUCCESS == Root->Open(Root, &file, filename, mode, 0) ? file : nullptr;
-    }
-
     auto read(EFI_FILE_PROTOCOL *file, void* buf, UINTN size) {
+      PROFILE_ZONE(ZoneFileRead);
       file->Read(file, &size, buf);
       return size;
     }
 
+    auto write(EFI_FILE_PROTOCOL *file, const void* buf, UINTN size) {
+      file->Write(file, &size, (void*)buf);
+      return size;
+    }
+
     auto close(EFI_FILE_PROTOCOL *file) {
       file->Close(file);
     }
 
     #define EFI_FILE_INFO_MAX 1024
+    #define READ_ALL_CHUNK_SIZE 1024 * 1024
 
-    auto readdir(EFI_FILE_PROTOCOL *file) {
-      EFI_FILE_INFO *child = (EFI_FILE_INFO*)malloc(EFI_FILE_INFO_MAX);
-      auto size = read(file, child, EFI_FILE_INFO_MAX);
-      return size ? child : nullptr;
+    /** GetInfoでファイルの大きさを調べる */
+    auto getSize(EFI_FILE_PROTOCOL *file, UINT64 *size) {
+      UINTN infoSize = EFI_FILE_INFO_MAX;
+      EFI_FILE_INFO *info = (EFI_FILE_INFO*)malloc(infoSize);
+      bool found = EFI_SUCCESS == file->GetInfo(file, &gEfiFileInfoGuid, &infoSize, info);
+      if (found) *size = info->FileSize;
+      free(info);
+      return found;
     }
-  };
 
-  namespace Graphics {
-    static EFI_GRAPHICS_OUTPUT_PROTOCOL *GraphicsOutputProtocol;
-    static UINT32 HorizontalResolution;
-    static UINT32 VerticalResolution;
-    static UINT32 TotalResolution;
+    struct _AssetPackHeader {
+      UINT32 magic;
+      UINT16 version;
+      UINT16 reserved;
+      UINT32 count;
+      /** 名前データの大きさ(CHAR16単位) */
+      UINT32 nameDataSize;
+    };
 
-    auto initGraphics() {
-      SystemTable->BootServices->LocateProtocol(&gEfiGraphicsOutputProtocolGuid, nullptr, (void**)&GraphicsOutputProtocol);
-      HorizontalResolution = GraphicsOutputProtocol->Mode->Info->HorizontalResolution;
-      VerticalResolution = GraphicsOutputProtocol->Mode->Info->VerticalResolution;
-      TotalResolution = HorizontalResolution * VerticalResolution;
-    }
+    typedef struct _AssetPackHeader AssetPackHeader;
 
-    auto getMaxResolutionMode(BOOLEAN horizontal = TRUE) {
-      // cf. http://segfo-ctflog.blogspot.jp/2015/06/uefios.html
-      EFI_STATUS status;
-      UINTN sizeOfInfo;
-      EFI_GRAPHICS_OUTPUT_MODE_INFORMATION *gopInfo;
-      UINT32 mode = 0;
-      for (UINT32 i = 0; i < GraphicsOutputProtocol->Mode->MaxMode; ++i) {
-        status = GraphicsOutputProtocol->QueryMode(GraphicsOutputProtocol, i, &sizeOfInfo, &gopInfo);
-        if (status != EFI_SUCCESS) break;
-        if (gopInfo->PixelFormat != PixelBltOnly &&
-          ((gopInfo->HorizontalResolution >= gopInfo->VerticalResolution) == horizontal)) {
-          mode = i;
+    struct _AssetPackEntry {
+      UINT32 hash;
+      /** 名前データ先頭からのオフセット(CHAR16単位) */
+      UINT32 name;
+      /** アセットファイル先頭からのオフセット */
+      UINT64 offset;
+      UINT64 size;
+    };
+
+    typedef struct _AssetPackEntry AssetPackEntry;
+
+    /** アセットファイル内の1ファイル EFI_FILE_PROTOCOLとして渡せるようにprotocolを先頭に置く */
+    struct _PackFile {
+      EFI_FILE_PROTOCOL protocol;
+      AssetPackEntry *entry;
+      UINT64 position;
+    };
+
+    typedef struct _PackFile PackFile;
+
+    /**
+     * make_asset_pack.pyでまとめたアセットファイル
+     *
+     * 起動時に1度だけ開いて索引を読み込み、閉じずに持っておく
+     * 中のファイルはPackFileとして開き、読み込みはすべてこのハンドルから行うので
+     * ファイルを開くたびにFATのディレクトリをたどらない
+     */
+    namespace AssetPack {
+      #define ASSET_PACK_MAGIC 0x4B504745 // "EGPK"
+      #define ASSET_PACK_VERSION 1
+
+      static EFI_FILE_PROTOCOL *file;
+      /** fileの今の読み込み位置 続けて読むときはSetPositionしない */
+      static UINT64 filePosition;
+      static UINT32 count;
+      /** hashの昇順 */
+      static AssetPackEntry *entries;
+      static CHAR16 *names;
+
+      /** 大文字小文字を区別せず、/も\として扱う */
+      CHAR16 normalize(CHAR16 c) {
+        if (c >= L'A' && c <= L'Z') return c - L'A' + L'a';
+        return c == L'/' ? L'\\' : c;
+      }
+
+      /** 正規化したパスのUTF-16LEのFNV-1a */
+      UINT32 hashPath(CHAR16 *path) {
+        UINT32 hash = 2166136261u;
+        for (; *path; ++path) {
+          CHAR16 c = normalize(*path);
+          hash = (hash ^ (c & 0xFF)) * 16777619u;
+          hash = (hash ^ (c >> 8)) * 16777619u;
         }
+        return hash;
+      }
+
+      bool samePath(CHAR16 *path, CHAR16 *name) {
+        for (; *path && normalize(*path) == *name; ++path, ++name);
+        return !*path && !*name;
+      }
+
+      AssetPackEntry* find(CHAR16 *path) {
+        if (file == nullptr) return nullptr;
+        while (*path == L'\\' || *path == L'/') ++path;
+        UINT32 hash = hashPath(path);
+        UINT32 low = 0, high = count;
+        while (low < high) {
+          UINT32 mid = (low + high) / 2;
+          if (entries[mid].hash < hash) {
+            low = mid + 1;
+          } else {
+            high = mid;
+          }
+        }
+        for (; low < count && entries[low].hash == hash; ++low) {
+          if (samePath(path, names + entries[low].name)) return entries + low;
+        }
+        return nullptr;
+      }
+
+      bool sameGuid(EFI_GUID *a, EFI_GUID *b) {
+        return a->Data1 == b->Data1 && a->Data2 == b->Data2 && a->Data3 == b->Data3 && *(UINT64*)a->Data4 == *(UINT64*)b->Data4;
+      }
+
+      EFI_STATUS EFIAPI openPackFile(EFI_FILE_PROTOCOL*, EFI_FILE_PROTOCOL**, CHAR16*, UINT64, UINT64) {
+        return EFI_UNSUPPORTED;
+      }
+
+      EFI_STATUS EFIAPI closePackFile(EFI_FILE_PROTOCOL *self) {
+        free(self);
+        return EFI_SUCCESS;
+      }
+
+      EFI_STATUS EFIAPI deletePackFile(EFI_FILE_PROTOCOL *self) {
+        free(self);
+        return EFI_WARN_DELETE_FAILURE;
+      }
+
+      /** 終端より先は0バイト読めたことにする */
+      EFI_STATUS EFIAPI readPackFile(EFI_FILE_PROTOCOL *self, UINTN *bufferSize, void *buffer) {
+        PackFile *packFile = (PackFile*)self;
+        UINT64 size = packFile->entry->size;
+        UINT64 position = packFile->position;
+        UINTN length = position >= size ? 0 : size - position < *bufferSize ? size - position : *bufferSize;
+        if (length) {
+          UINT64 offset = packFile->entry->offset + position;
+          EFI_STATUS status = EFI_SUCCESS;
+          if (offset != filePosition) status = file->SetPosition(file, offset);
+          if (status == EFI_SUCCESS) status = file->Read(file, &length, buffer);
+          if (status != EFI_SUCCESS) {
+            filePosition = ~0ULL;
+            *bufferSize = 0;
+            return status;
+          }
+          filePosition = offset + length;
+        }
+        packFile->position = position + length;
+        *bufferSize = length;
+        return EFI_SUCCESS;
+      }
+
+      EFI_STATUS EFIAPI writePackFile(EFI_FILE_PROTOCOL*, UINTN *bufferSize, void*) {
+        *bufferSize = 0;
+        return EFI_WRITE_PROTECTED;
+      }
+
+      EFI_STATUS EFIAPI getPackFilePosition(EFI_FILE_PROTOCOL *self, UINT64 *position) {
+        *position = ((PackFile*)self)->position;
+        return EFI_SUCCESS;
+      }
+
+      /** 0xFFFFFFFFFFFFFFFFは終端 */
+      EFI_STATUS EFIAPI setPackFilePosition(EFI_FILE_PROTOCOL *self, UINT64 position) {
+        PackFile *packFile = (PackFile*)self;
+        packFile->position = position == 0xFFFFFFFFFFFFFFFFULL ? packFile->entry->size : position;
+        return EFI_SUCCESS;
+      }
+
+      /** EFI_FILE_INFOだけ返す 名前はパスの最後の部分 */
+      EFI_STATUS EFIAPI getPackFileInfo(EFI_FILE_PROTOCOL *self, EFI_GUID *type, UINTN *bufferSize, void *buffer) {
+        if (!sameGuid(type, &gEfiFileInfoGuid)) return EFI_UNSUPPORTED;
+        AssetPackEntry *entry = ((PackFile*)self)->entry;
+        CHAR16 *name = names + entry->name;
+        for (CHAR16 *c = name; *c; ++c) if (*c == L'\\') name = c + 1;
+        UINTN length = 0;
+        while (name[length]) ++length;
+        UINTN needed = SIZE_OF_EFI_FILE_INFO + sizeof(CHAR16) * (length + 1);
+        if (*bufferSize < needed) {
+          *bufferSize = needed;
+          return EFI_BUFFER_TOO_SMALL;
+        }
+        EFI_FILE_INFO *info = (EFI_FILE_INFO*)buffer;
+        memset((void*)info, 0, SIZE_OF_EFI_FILE_INFO);
+        info->Size = needed;
+        info->FileSize = entry->size;
+        info->PhysicalSize = entry->size;
+        info->Attribute = EFI_FILE_READ_ONLY;
+        memcpy(info->FileName, name, length + 1);
+        *bufferSize = needed;
+        return EFI_SUCCESS;
+      }
+
+      EFI_STATUS EFIAPI setPackFileInfo(EFI_FILE_PROTOCOL*, EFI_GUID*, UINTN, void*) {
+        return EFI_WRITE_PROTECTED;
+      }
+
+      EFI_STATUS EFIAPI flushPackFile(EFI_FILE_PROTOCOL*) {
+        return EFI_SUCCESS;
+      }
+
+      /** pathがアセットファイルにあればPackFileとして開く */
+      EFI_FILE_PROTOCOL* open(CHAR16 *path) {
+        AssetPackEntry *entry = find(path);
+        if (entry == nullptr) return nullptr;
+        PackFile *packFile = (PackFile*)malloc(sizeof(PackFile));
+        memset((void*)packFile, 0, sizeof(PackFile));
+        EFI_FILE_PROTOCOL *protocol = &packFile->protocol;
+        protocol->Revision = EFI_FILE_PROTOCOL_REVISION;
+        protocol->Open = openPackFile;
+        protocol->Close = closePackFile;
+        protocol->Delete = deletePackFile;
+        protocol->Read = readPackFile;
+        protocol->Write = writePackFile;
+        protocol->GetPosition = getPackFilePosition;
+        protocol->SetPosition = setPackFilePosition;
+        protocol->GetInfo = getPackFileInfo;
+        protocol->SetInfo = setPackFileInfo;
+        protocol->Flush = flushPackFile;
+        packFile->entry = entry;
+        packFile->position = 0;
+        return protocol;
+      }
+
+      /** 無いときや壊れているときはfalseを返し、ファイルはすべてFATから開く */
+      bool load(CHAR16 *filename) {
+        EFI_FILE_PROTOCOL *pack;
+        if (EFI_SUCCESS != Root->Open(Root, &pack, filename, EFI_FILE_MODE_READ, 0)) return false;
+        AssetPackHeader header;
+        UINT64 packSize;
+        UINTN size = read(pack, &header, sizeof(header));
+        if (size != sizeof(header) || header.magic != ASSET_PACK_MAGIC || header.version != ASSET_PACK_VERSION ||
+          !getSize(pack, &packSize)) {
+          close(pack);
+          return false;
+        }
+        UINTN indexSize = sizeof(AssetPackEntry) * header.count;
+        UINTN bodySize = indexSize + sizeof(CHAR16) * header.nameDataSize;
+        if (sizeof(header) + bodySize > packSize) {
+          close(pack);
+          return false;
+        }
+        UINT8 *body = (UINT8*)malloc(bodySize);
+        if (body == nullptr) {
+          close(pack);
+          return false;
+        }
+        size = read(pack, body, bodySize);
+        bool valid = size == bodySize;
+        AssetPackEntry *packEntries = (AssetPackEntry*)body;
+        for (UINT32 i = 0; valid && i < header.count; ++i) {
+          valid = packEntries[i].name < header.nameDataSize && packEntries[i].offset <= packSize &&
+            packEntries[i].size <= packSize - packEntries[i].offset;
+        }
+        if (!valid || (header.nameDataSize && ((CHAR16*)(body + indexSize))[header.nameDataSize - 1])) {
+          free(body);
+          close(pack);
+          return false;
+        }
+        file = pack;
+        filePosition = sizeof(header) + bodySize;
+        count = header.count;
+        entries = packEntries;
+        names = (CHAR16*)(body + indexSize);
+        return true;
       }
-      return mode;
     }
 
-    auto setMode(UINT32 mode) {
-      GraphicsOutputProtocol->SetMode(GraphicsOutputProtocol, mode);
-      HorizontalResolution = GraphicsOutputProtocol->Mode->Info->HorizontalResolution;
-      VerticalResolution = GraphicsOutputProtocol->Mode->Info->VerticalResolution;
-      TotalResolution = HorizontalResolution * VerticalResolution;
+    /** 読み込みだけならアセットファイルにあるものはそこから開き、無ければFATから開く */
+    EFI_FILE_PROTOCOL* open(CHAR16* filename, UINT64 mode = EFI_FILE_MODE_READ) {
+      EFI_FILE_PROTOCOL *file;
+      if (mode == EFI_FILE_MODE_READ && (file = AssetPack::open(filename)) != nullptr) return file;
+      return EFI_SUCCESS == Root->Open(Root, &file, filename, mode, 0) ? file : nullptr;
     }
 
-    auto maximizeResolution(BOOLEAN hosizontal = TRUE) {
-      setMode(getMaxResolutionMode(hosizontal));
+    /** 今の位置からちょうどsizeバイトをREAD_ALL_CHUNK_SIZEずつ読む 足りなければfalse */
+    auto readFully(EFI_FILE_PROTOCOL *file, void *buf, UINTN size) {
+      UINT8 *dest = (UINT8*)buf;
+      UINTN done = 0;
+      while (done < size) {
+        UINTN chunk = size - done < READ_ALL_CHUNK_SIZE ? size - done : READ_ALL_CHUNK_SIZE;
+        UINTN length = read(file, dest + done, chunk);
+        if (!length) break;
+        done += length;
+      }
+      return done == size;
     }
 
-    typedef EFI_GRAPHICS_OUTPUT_BLT_PIXEL Pixel;
+    /**
+     * ファイルを先頭から全部読む
+     *
+     * GetInfoで調べたちょうどの大きさのバッファへREAD_ALL_CHUNK_SIZEずつ読み、呼び出し側でfreeする
+     * maxSizeより大きいときや読みきれなかったときはnullptrを返す
+     */
+    UINT8* readAll(EFI_FILE_PROTOCOL *file, UINTN *size, UINTN maxSize = MAX_FILE_BUF_SIZE) {
+      UINT64 fileSize;
+      if (!getSize(file, &fileSize) || fileSize > maxSize) return nullptr;
+      UINT8 *buf = (UINT8*)malloc(fileSize ? fileSize : 1);
+      if (!readFully(file, buf, fileSize)) {
+        free(buf);
+        return nullptr;
+      }
+      *size = fileSize;
+      return buf;
+    }
 
-    struct _Point {
-      INT32 x;
-      INT32 y;
-    };
+    UINT8* readAll(CHAR16 *filename, UINTN *size, UINTN maxSize = MAX_FILE_BUF_SIZE) {
+      auto file = open(filename);
+      if (file == nullptr) return nullptr;
+      UINT8 *buf = readAll(file, size, maxSize);
+      close(file);
+      return buf;
+    }
 
-    typedef struct _Point Point;
+    #define READER_CHUNK_SIZE 4096
 
-    struct _Rect {
-      UINT32 w;
-      UINT32 h;
+    /**
+     * 小さなバッファ2枚で少しずつ読み進めるリーダー
+     *
+     * 片方を読んでいる間はもう片方に続きが入っていて、
+     * 読み終わった方にその次を読み込む
+     */
+    struct _Reader {
+      EFI_FILE_PROTOCOL *file;
+      UINTN chunkSize;
+      UINT8 *chunks[2];
+      UINTN lengths[2];
+      /** 各バッファ先頭のファイル上の位置 */
+      UINT64 offsets[2];
+      UINT32 current;
+      /** current内の読み込み位置 */
+      UINTN pos;
     };
 
-    typedef struct _Rect Rect;
+    typedef struct _Reader Reader;
 
-    struct _Circle {
-      UINT32 r;
-    };
+    void fillChunk(Reader *reader, UINT32 index, UINT64 offset) {
+      reader->offsets[index] = offset;
+      reader->lengths[index] = read(reader->file, reader->chunks[index], reader->chunkSize);
+    }
 
-    typedef struct _Circle Circle;
+    /** offsetの位置から読み直す */
+    auto seekReader(Reader *reader, UINT64 offset) {
+      UINT32 current = reader->current;
+      if (offset >= reader->offsets[current] && offset < reader->offsets[current] + reader->lengths[current]) {
+        reader->pos = offset - reader->offsets[current];
+        return true;
+      }
+      if (reader->file == nullptr || EFI_SUCCESS != reader->file->SetPosition(reader->file, offset)) return false;
+      reader->current = 0;
+      reader->pos = 0;
+      fillChunk(reader, 0, offset);
+      fillChunk(reader, 1, offset + reader->lengths[0]);
+      return true;
+    }
 
-    void drawPoint(INT32 offset, const Pixel &pixel, Pixel *basePixel) {
-      if (offset < 0 || offset >= (INT32)TotalResolution) return;
-      Pixel *pointPixel = basePixel + offset;
-      pointPixel->Blue = pixel.Blue;
-      pointPixel->Green = pixel.Green;
-      pointPixel->Red = pixel.Red;
-      pointPixel->Reserved = pixel.Reserved;
+    /** fileがnullptrなら空のファイルとして扱う */
+    auto openReader(Reader *reader, EFI_FILE_PROTOCOL *file, UINTN chunkSize = READER_CHUNK_SIZE) {
+      reader->file = file;
+      reader->chunkSize = chunkSize;
+      reader->chunks[0] = (UINT8*)malloc(chunkSize * 2);
+      reader->chunks[1] = reader->chunks[0] + chunkSize;
+      reader->current = 0;
+      reader->pos = 0;
+      if (file == nullptr) {
+        reader->offsets[0] = reader->offsets[1] = 0;
+        reader->lengths[0] = reader->lengths[1] = 0;
+        return false;
+      }
+      fillChunk(reader, 0, 0);
+      fillChunk(reader, 1, reader->lengths[0]);
+      return true;
     }
 
-    void drawPoint(INT32 offset, const Pixel &pixel) {
-      drawPoint(offset, pixel, (Pixel *)GraphicsOutputProtocol->Mode->FrameBufferBase);
+    auto closeReader(Reader *reader) {
+      if (reader->file != nullptr) close(reader->file);
+      free(reader->chunks[0]);
+      reader->file = nullptr;
     }
 
-    void drawPoint(INT32 x, INT32 y, const Pixel &pixel) {
-      drawPoint(y * HorizontalResolution + x, pixel);
+    /** 次に読む位置 */
+    auto tellReader(Reader *reader) {
+      return reader->offsets[reader->current] + reader->pos;
     }
 
-    void drawPoint(const Point &point, const Pixel &pixel) {
-      drawPoint(point.x, point.y, pixel);
+    /** 読み終えたバッファを捨てて次へ進み、空いた方にその次を読む 終端ならfalse */
+    auto nextChunk(Reader *reader) {
+      UINT32 next = reader->current ^ 1;
+      if (!reader->lengths[next]) return false;
+      UINT32 done = reader->current;
+      reader->current = next;
+      reader->pos = 0;
+      fillChunk(reader, done, reader->offsets[next] + reader->lengths[next]);
+      return true;
     }
 
-    void fillRect(INT32 x, INT32 y, UINT32 w, UINT32 h, const Pixel &color) {
-      UINT32 py;
-      if (w > HorizontalResolution) w = HorizontalResolution;
-      Pixel pixels[w];
-      memset(pixels, color, w);
-      for (py = y; py < y + h; ++py) {
-        GraphicsOutputProtocol->Blt(GraphicsOutputProtocol, pixels, EfiBltBufferToVideo, 0, 0, x, py, w, 1, 0);
-      }
+    auto atEnd(Reader *reader) {
+      return reader->pos >= reader->lengths[reader->current] && !reader->lengths[reader->current ^ 1];
     }
 
-    void fillRect(INT32 x, INT32 y, const Rect &rect, const Pixel &color) {
-      fillRect(x, y, rect.w, rect.h, color);
+    /** 1バイト読む 終端なら-1を返す */
+    INT32 readByte(Reader *reader) {
+      if (reader->pos >= reader->lengths[reader->current] && !nextChunk(reader)) return -1;
+      return reader->chunks[reader->current][reader->pos++];
     }
 
-    void fillRect(const Point &point, const Rect &rect, const Pixel &color) {
-      fillRect(point.x, point.y, rect, color);
+    /** sizeバイトまで読む 読めたバイト数を返す */
+    UINTN readBytes(Reader *reader, void *buf, UINTN size) {
+      UINT8 *dest = (UINT8*)buf;
+      UINTN done = 0;
+      while (done < size) {
+        if (reader->pos >= reader->lengths[reader->current] && !nextChunk(reader)) break;
+        UINTN rest = reader->lengths[reader->current] - reader->pos;
+        UINTN length = size - done < rest ? size - done : rest;
+        memcpy(dest + done, reader->chunks[reader->current] + reader->pos, length);
+        reader->pos += length;
+        done += length;
+      }
+      return done;
     }
 
-    void fillCircle(INT32 x, INT32 y, UINT32 r, const Pixel &color) {
-      Pixel pixels[HorizontalResolution];
-      memset(pixels, color, HorizontalResolution);
+    /** UTF-16LEの1文字を読む 終端なら-1を返す */
+    INT32 readChar(Reader *reader) {
+      INT32 low = readByte(reader);
+      INT32 high = readByte(reader);
+      return high < 0 ? -1 : low | (high << 8);
+    }
 
-      UINT32 r2 = r * r;
-      INT32 dx, dy, mdy, rest, start_x, end_x, length;
-      dy = -r;
-      if (y + dy < 0) dy = -y;
-      mdy = r;
-      if (y + mdy > (INT32)VerticalResolution) mdy = VerticalResolution - y;
-      for (; dy < mdy; ++dy) {
-        rest = r2 - dy * dy;
-        dx = -r;
-        while (dx * dx > rest) ++dx;
-        start_x = x + dx;
-        end_x = x - dx;
-        if (!dx || end_x <= 0 || start_x >= (INT32)HorizontalResolution) continue;
-        if (start_x < 0) start_x = 0;
-        if (end_x > (INT32)HorizontalResolution) end_x = HorizontalResolution;
-        length = end_x - start_x;
-        GraphicsOutputProtocol->Blt(GraphicsOutputProtocol, pixels, EfiBltBufferToVideo, 0, 0, start_x, y + dy, length, 1, 0);
+    /**
+     * 1行読む(改行を含まない) 改行コードは\r\nでも\nでもよい
+     *
+     * 入りきらない分は読み捨てる 行の長さを返し、終端なら-1を返す
+     */
+    INT32 readLine(Reader *reader, CHAR16 *line, UINTN size) {
+      INT32 c, length = 0, stored = 0;
+      while ((c = readChar(reader)) >= 0) {
+        if (c == L'\n') break;
+        if (c == L'\r' || c == 0xFEFF) continue;
+        if (stored < (INT32)size - 1) line[stored++] = c;
+        ++length;
       }
+      line[stored] = L'\0';
+      return c < 0 && !length ? -1 : length;
     }
 
-    void fillCircle(INT32 x, INT32 y, const Circle &circle, const Pixel &color) {
-      fillCircle(x, y, circle.r, color);
+    auto readdir(EFI_FILE_PROTOCOL *file) {
+      EFI_FILE_INFO *child = (EFI_FILE_INFO*)malloc(EFI_FILE_INFO_MAX);
+      auto size = read(file, child, EFI_FILE_INFO_MAX);
+      return size ? child : nullptr;
     }
+  };
 
-    void fillCircle(const Point &point, const Circle &circle, const Pixel &color) {
-      fillCircle(point.x, point.y, circle, color);
-    }
+  /**
+   * タイマーの合間に少しずつ進める仕事の列
+   *
+   * ファイルの読み込みや画像のデコードのように時間のかかる処理を細かいstepに分けて積んでおくと、
+   * Mainがフレームの描画を終えてから次のタイマーまでの空き時間に1回ずつ順番に進める
+   * 終わった仕事はonCompleteで結果を渡す
+   */
+  namespace Jobs {
+    #define JOBS_MAX 64
+    /** タイマー1回分のうち仕事に使ってよい割合(%) */
+    #define JOBS_BUDGET_PERCENT 50
 
-    struct _Image {
-      Pixel *pixels;
-      UINT8 *alphas;
-      int x;
-      int y;
-      int composition;
-      int length;
+    struct _Job {
+      /** 1回分進める 終わったら結果をresultに入れてtrueを返す 失敗したときはresultをnullptrのままにする */
+      bool (*step)(struct _Job *job);
+      /** 終わったときに呼ぶ */
+      void (*onComplete)(void *result, void *context);
+      void *context;
+      /** stepが使う状態 終わるときにstepが解放する */
+      void *state;
+      void *result;
     };
 
-    typedef struct _Image Image;
+    typedef struct _Job Job;
 
-    auto getRectImage(UINT32 w, UINT32 h, const Pixel &color) {
-      auto length = w * h;
-      Image *image = (Image*)malloc(sizeof(Image));
-      image->pixels = (Pixel*)malloc(sizeof(Pixel) * length);
-      memset(image->pixels, color, length);
-      image->alphas = (UINT8*)malloc(sizeof(UINT8) * length);
-      memset(image->alphas, 255, length);
-      image->x = w;
-      image->y = h;
-      image->length = length;
-      image->composition = 4;
-      return image;
+    static Job queue[JOBS_MAX];
+    static UINT32 head;
+    static UINT32 count;
+
+    /** 仕事を積む 列がいっぱいならfalseを返す */
+    auto submit(bool (*step)(Job *job), void *state, void (*onComplete)(void *result, void *context) = nullptr, void *context = nullptr) {
+      if (count >= JOBS_MAX) return false;
+      Job &job = queue[(head + count) % JOBS_MAX];
+      job.step = step;
+      job.onComplete = onComplete;
+      job.context = context;
+      job.state = state;
+      job.result = nullptr;
+      ++count;
+      return true;
     }
 
-    auto getCircleImage(UINT32 r, const Pixel &color) {
-      auto R = r * 2;
-      auto length = R * R;
-      Image *image = (Image*)malloc(sizeof(Image));
-      image->pixels = (Pixel*)malloc(sizeof(Pixel) * length);
-      memset(image->pixels, color, length);
-      image->alphas = (UINT8*)malloc(sizeof(UINT8) * length);
-      memset(image->alphas, 0, length);
-      UINT32 r2 = r * r;
-      INT32 dx, dy, mdy, rest, yoffset;
-      mdy = r;
-      for (dy = -r; dy < mdy; ++dy) {
-        rest = r2 - dy * dy;
-        dx = -r;
+    /** 残っている仕事の数 */
+    auto pending() {
+      return count;
+    }
+
+    /**
+     * 先頭の仕事を1回分進める
+     *
+     * 終わっていればonCompleteを呼んで列から外し、まだなら列の後ろへ回す
+     * APの処理を待っている仕事があっても、他の仕事の読み込みは進む
+     */
+    auto runStep() {
+      if (!count) return false;
+      Job &job = queue[head];
+      if (!job.step(&job)) {
+        if (count > 1) {
+          queue[(head + count) % JOBS_MAX] = job;
+          head = (head + 1) % JOBS_MAX;
+        }
+        return true;
+      }
+      // onCompleteの中で次の仕事を積めるよう、先に列から外しておく
+      Job done = job;
+      head = (head + 1) % JOBS_MAX;
+      --count;
+      if (done.onComplete) done.onComplete(done.result, done.context);
+      return true;
+    }
+
+    /**
+     * deadline(TSC)まで仕事を進める
+     *
+     * 時間が残っていなくても1回は進めるので、描画が重いフレームが続いても止まらない
+     */
+    void run(UINT64 deadline) {
+      if (!runStep()) return;
+      while (count && Profiler::now() < deadline) runStep();
+    }
+
+    /** 残っている仕事をすべて終わらせる */
+    void finish() {
+      while (runStep());
+    }
+  };
+
+  /**
+   * EFI_MP_SERVICES_PROTOCOLで起こしたAPに仕事を配る
+   *
+   * 列はBSPだけが積んでAPが取り合う形で、ロックは使わない
+   * APはブートサービスを呼べないので、起動前にBSPが確保しておいた専用の領域だけを使う
+   * プロトコルが無いかAPが1つも起きなければavailable()がfalseになり、呼ぶ側はBSPで処理する
+   */
+  namespace Workers {
+    #define WORKERS_MAX 16
+    #define WORKER_QUEUE_SIZE 64
+    #define WORKER_ARENA_SIZE 1024 * 1024 * 16
+    #define WORKER_ARENA_ALIGN 16
+
+    struct _Worker {
+      UINTN processorNumber;
+      /** StartupThisAPを待たずに戻るためのイベント */
+      EFI_EVENT event;
+      /** このAPだけが使うメモリ 仕事が終わるたびに先頭へ戻す */
+      UINT8 *arena;
+      UINTN arenaUsed;
+      /** 最後に切り出したブロック reallocではその場で伸ばす */
+      UINT8 *last;
+      /** 終えた仕事の数 */
+      UINT64 completed;
+    };
+
+    typedef struct _Worker Worker;
+
+    struct _Task {
+      /** workerは仕事をしているAPのWorker BSPが直接呼ぶときはnullptr */
+      void (*run)(Worker *worker, void *arg);
+      void *arg;
+    };
+
+    typedef struct _Task Task;
+
+    static EFI_MP_SERVICES_PROTOCOL *MpServices;
+    static Worker workers[WORKERS_MAX];
+    static UINT32 workerCount;
+    static Task tasks[WORKER_QUEUE_SIZE];
+    /** 次に取り出す位置 APが取り合って進める */
+    static UINT64 head;
+    /** 次に積む位置 BSPだけが進める */
+    static UINT64 tail;
+
+    auto available() {
+      return workerCount > 0;
+    }
+
+    /**
+     * stb_imageを使っている間だけ立てる
+     *
+     * stb_imageの確保は呼んだ側を受け取らないので、BSPとAPで交代して使い、持っている側をstbiWorkerに置く
+     */
+    static UINT32 stbiLock;
+    /** stbiLockを持っているAPのWorker BSPが持っているときはnullptr */
+    static Worker *stbiWorker;
+
+    /** ptrを切り出したWorker どの領域にも無ければnullptr */
+    Worker* arenaOwner(void *ptr) {
+      for (UINT32 i = 0; i < workerCount; ++i) {
+        if ((UINT8*)ptr >= workers[i].arena && (UINT8*)ptr < workers[i].arena + WORKER_ARENA_SIZE) return &workers[i];
+      }
+      return nullptr;
+    }
+
+    /** stb_imageを使えればtrue workerはAPならそのWorker、BSPならnullptr */
+    auto tryLockStbi(Worker *worker) {
+      if (!workerCount) return true;
+      if (__atomic_exchange_n(&stbiLock, 1, __ATOMIC_ACQUIRE)) return false;
+      stbiWorker = worker;
+      return true;
+    }
+
+    void lockStbi(Worker *worker) {
+      while (!tryLockStbi(worker)) __builtin_ia32_pause();
+    }
+
+    void unlockStbi() {
+      if (!workerCount) return;
+      stbiWorker = nullptr;
+      __atomic_store_n(&stbiLock, 0, __ATOMIC_RELEASE);
+    }
+
+    void* arenaAlloc(Worker *worker, UINTN size) {
+      UINTN start = (worker->arenaUsed + WORKER_ARENA_ALIGN - 1) & ~(UINTN)(WORKER_ARENA_ALIGN - 1);
+      if (start + size > WORKER_ARENA_SIZE) return nullptr;
+      worker->last = worker->arena + start;
+      worker->arenaUsed = start + size;
+      return worker->last;
+    }
+
+    void* arenaRealloc(Worker *worker, void *ptr, UINTN oldSize, UINTN size) {
+      if (ptr == nullptr) return arenaAlloc(worker, size);
+      if (ptr == worker->last) {
+        UINTN start = worker->last - worker->arena;
+        if (start + size > WORKER_ARENA_SIZE) return nullptr;
+        worker->arenaUsed = start + size;
+        return ptr;
+      }
+      void *moved = arenaAlloc(worker, size);
+      if (moved != nullptr) memcpy(moved, ptr, oldSize < size ? oldSize : size);
+      return moved;
+    }
+
+    /** 最後のブロックなら戻す それ以外は仕事が終わるまで残す */
+    void arenaFree(Worker *worker, void *ptr) {
+      if (ptr == nullptr || ptr != worker->last) return;
+      worker->arenaUsed = worker->last - worker->arena;
+      worker->last = nullptr;
+    }
+
+    /** 仕事を積む BSPからだけ呼ぶ 列がいっぱいかAPが無ければfalseを返す */
+    auto submit(void (*run)(Worker *worker, void *arg), void *arg) {
+      if (!workerCount) return false;
+      if (tail - __atomic_load_n(&head, __ATOMIC_ACQUIRE) >= WORKER_QUEUE_SIZE) return false;
+      tasks[tail % WORKER_QUEUE_SIZE] = Task {run, arg};
+      __atomic_store_n(&tail, tail + 1, __ATOMIC_RELEASE);
+      return true;
+    }
+
+    /** 仕事を1つ取り出す 他のAPに先を越されたら読み直す */
+    auto take(Task *task) {
+      UINT64 h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+      while (h < __atomic_load_n(&tail, __ATOMIC_ACQUIRE)) {
+        // headがhのうちはBSPがこの場所に書くことはないので、先に写してからheadを進める
+        *task = tasks[h % WORKER_QUEUE_SIZE];
+        if (__atomic_compare_exchange_n(&head, &h, h + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return true;
+      }
+      return false;
+    }
+
+    /** APで動き続ける */
+    void EFIAPI workerMain(void *arg) {
+      Worker *worker = (Worker*)arg;
+      Task task;
+      while (TRUE) {
+        if (!take(&task)) {
+          __builtin_ia32_pause();
+          continue;
+        }
+        task.run(worker, task.arg);
+        worker->arenaUsed = 0;
+        worker->last = nullptr;
+        __atomic_add_fetch(&worker->completed, 1, __ATOMIC_RELEASE);
+      }
+    }
+
+    void initWorkers() {
+      if (EFI_SUCCESS != SystemTable->BootServices->LocateProtocol(&gEfiMpServiceProtocolGuid, nullptr, (void**)&MpServices)) return;
+      UINTN total, enabled, bsp;
+      if (EFI_SUCCESS != MpServices->GetNumberOfProcessors(MpServices, &total, &enabled)) return;
+      if (EFI_SUCCESS != MpServices->WhoAmI(MpServices, &bsp)) return;
+      for (UINTN i = 0; i < total && workerCount < WORKERS_MAX; ++i) {
+        EFI_PROCESSOR_INFORMATION info;
+        if (i == bsp || EFI_SUCCESS != MpServices->GetProcessorInfo(MpServices, i, &info)) continue;
+        if (!(info.StatusFlag & PROCESSOR_ENABLED_BIT)) continue;
+        Worker &worker = workers[workerCount];
+        worker.processorNumber = i;
+        worker.arenaUsed = 0;
+        worker.last = nullptr;
+        worker.completed = 0;
+        worker.arena = (UINT8*)libc::allocatePages(EFI_SIZE_TO_PAGES(WORKER_ARENA_SIZE));
+        if (worker.arena == nullptr) break;
+        if (EFI_SUCCESS != SystemTable->BootServices->CreateEvent(0, 0, NULL, NULL, &worker.event)) {
+          SystemTable->BootServices->FreePages((EFI_PHYSICAL_ADDRESS)worker.arena, EFI_SIZE_TO_PAGES(WORKER_ARENA_SIZE));
+          break;
+        }
+        if (EFI_SUCCESS != MpServices->StartupThisAP(MpServices, workerMain, i, worker.event, 0, &worker, nullptr)) {
+          SystemTable->BootServices->CloseEvent(worker.event);
+          SystemTable->BootServices->FreePages((EFI_PHYSICAL_ADDRESS)worker.arena, EFI_SIZE_TO_PAGES(WORKER_ARENA_SIZE));
+          continue;
+        }
+        ++workerCount;
+      }
+    }
+  };
+
+  namespace Graphics {
+    static EFI_GRAPHICS_OUTPUT_PROTOCOL *GraphicsOutputProtocol;
+    static UINT32 HorizontalResolution;
+    static UINT32 VerticalResolution;
+    static UINT32 TotalResolution;
+
+    typedef EFI_GRAPHICS_OUTPUT_BLT_PIXEL Pixel;
+
+    /**
+     * 画面と同じ大きさのメモリ上のバックバッファ
+     *
+     * 描画関数はすべてここに描き、書き換えた範囲を記録しておいて
+     * フレームの最後にまとめて画面へ転送する 1色で塗っただけの範囲は
+     * バックバッファを読まずにEfiBltVideoFillで送る
+     */
+    namespace Surface {
+      #define SURFACE_MAX_DIRTY_RECTS 32
+
+      struct _DirtyRect {
+        INT32 x0;
+        INT32 y0;
+        /** 右端(含まない) */
+        INT32 x1;
+        /** 下端(含まない) */
+        INT32 y1;
+      };
+
+      typedef struct _DirtyRect DirtyRect;
+
+      static Pixel *pixels;
+      /** 記録した順 転送もこの順に行う */
+      static DirtyRect dirty[SURFACE_MAX_DIRTY_RECTS];
+      /** 1色で塗っただけの範囲か その色 */
+      static bool filled[SURFACE_MAX_DIRTY_RECTS];
+      static Pixel fillColors[SURFACE_MAX_DIRTY_RECTS];
+      static UINT32 dirtyCount;
+
+      /** 解像度にあわせてバッファを確保し、今の画面の内容で初期化する */
+      void init() {
+        if (pixels) free(pixels);
+        pixels = (Pixel*)malloc(sizeof(Pixel) * TotalResolution);
+        GraphicsOutputProtocol->Blt(GraphicsOutputProtocol, pixels, EfiBltVideoToBltBuffer, 0, 0, 0, 0, HorizontalResolution, VerticalResolution, 0);
+        dirtyCount = 0;
+      }
+
+      auto area(const DirtyRect &rect) {
+        return (INT64)(rect.x1 - rect.x0) * (rect.y1 - rect.y0);
+      }
+
+      auto unite(const DirtyRect &a, const DirtyRect &b) {
+        DirtyRect rect {
+          a.x0 < b.x0 ? a.x0 : b.x0,
+          a.y0 < b.y0 ? a.y0 : b.y0,
+          a.x1 > b.x1 ? a.x1 : b.x1,
+          a.y1 > b.y1 ? a.y1 : b.y1,
+        };
+        return rect;
+      }
+
+      /** 重なるか接しているか */
+      auto touches(const DirtyRect &a, const DirtyRect &b) {
+        return a.x0 <= b.x1 && b.x0 <= a.x1 && a.y0 <= b.y1 && b.y0 <= a.y1;
+      }
+
+      /** aがbをすっかり覆うか */
+      auto contains(const DirtyRect &a, const DirtyRect &b) {
+        return a.x0 <= b.x0 && a.y0 <= b.y0 && b.x1 <= a.x1 && b.y1 <= a.y1;
+      }
+
+      /** i番目の範囲を外す 後ろの範囲の順番は変えない */
+      void removeDirty(UINT32 i) {
+        for (--dirtyCount; i < dirtyCount; ++i) {
+          dirty[i] = dirty[i + 1];
+          filled[i] = filled[i + 1];
+          fillColors[i] = fillColors[i + 1];
+        }
+      }
+
+      /**
+       * 書き換えた範囲を記録する 重なる範囲はひとつにまとめる
+       *
+       * 塗りつぶした範囲は、中身を写す範囲とまとめると塗りつぶしでなくなるので、
+       * すっかり覆うか覆われるときのほかは別に持つ 記録した順に転送するので、
+       * 塗りつぶしの後に描いた部分は後から写されて上に来る
+       */
+      void addDirty(INT32 x, INT32 y, INT32 w, INT32 h, bool fill, const Pixel &color) {
+        DirtyRect rect {x, y, x + w, y + h};
+        if (rect.x0 < 0) rect.x0 = 0;
+        if (rect.y0 < 0) rect.y0 = 0;
+        if (rect.x1 > (INT32)HorizontalResolution) rect.x1 = HorizontalResolution;
+        if (rect.y1 > (INT32)VerticalResolution) rect.y1 = VerticalResolution;
+        if (rect.x0 >= rect.x1 || rect.y0 >= rect.y1) return;
+        while (TRUE) {
+          UINT32 i;
+          for (i = 0; i < dirtyCount; ++i) {
+            if (!touches(dirty[i], rect)) continue;
+            // すっかり上書きした範囲は送らなくてよい
+            if (contains(rect, dirty[i])) break;
+            if (!fill && !filled[i]) break;
+          }
+          if (i == dirtyCount) {
+            if (dirtyCount < SURFACE_MAX_DIRTY_RECTS) break;
+            // いっぱいなら面積の増え方が一番少ないものとまとめる
+            INT64 minGrowth = -1;
+            for (UINT32 j = 0; j < dirtyCount; ++j) {
+              INT64 growth = area(unite(dirty[j], rect)) - area(dirty[j]);
+              if (minGrowth < 0 || growth < minGrowth) {
+                minGrowth = growth;
+                i = j;
+              }
+            }
+          }
+          if (!contains(rect, dirty[i])) fill = false;
+          rect = unite(dirty[i], rect);
+          removeDirty(i);
+        }
+        dirty[dirtyCount] = rect;
+        filled[dirtyCount] = fill;
+        fillColors[dirtyCount] = color;
+        ++dirtyCount;
+      }
+
+      void markDirty(INT32 x, INT32 y, INT32 w, INT32 h) {
+        Pixel none {0, 0, 0, 0};
+        addDirty(x, y, w, h, false, none);
+      }
+
+      /** colorだけで塗った範囲を記録する */
+      void markFilled(INT32 x, INT32 y, INT32 w, INT32 h, const Pixel &color) {
+        addDirty(x, y, w, h, true, color);
+      }
+
+      /** 塗りつぶしで送る範囲と重なるか 重なるところへ後から描いたならmarkDirtyし直す */
+      auto overlapsFill(INT32 x, INT32 y, INT32 w, INT32 h) {
+        for (UINT32 i = 0; i < dirtyCount; ++i) {
+          if (filled[i] && dirty[i].x0 < x + w && x < dirty[i].x1 && dirty[i].y0 < y + h && y < dirty[i].y1) return true;
+        }
+        return false;
+      }
+
+      void markAllDirty() {
+        dirtyCount = 0;
+        markDirty(0, 0, HorizontalResolution, VerticalResolution);
+      }
+
+      /** 記録した範囲を記録した順に画面へ転送する */
+      void flush() {
+        for (UINT32 i = 0; i < dirtyCount; ++i) {
+          DirtyRect &rect = dirty[i];
+          if (filled[i]) {
+            GraphicsOutputProtocol->Blt(GraphicsOutputProtocol, &fillColors[i], EfiBltVideoFill,
+              0, 0, rect.x0, rect.y0, rect.x1 - rect.x0, rect.y1 - rect.y0, 0);
+          } else {
+            GraphicsOutputProtocol->Blt(GraphicsOutputProtocol, pixels, EfiBltBufferToVideo,
+              rect.x0, rect.y0, rect.x0, rect.y0, rect.x1 - rect.x0, rect.y1 - rect.y0, sizeof(Pixel) * HorizontalResolution);
+          }
+          Profiler::countBlt();
+        }
+        dirtyCount = 0;
+      }
+    };
+
+    auto initGraphics() {
+      SystemTable->BootServices->LocateProtocol(&gEfiGraphicsOutputProtocolGuid, nullptr, (void**)&GraphicsOutputProtocol);
+      HorizontalResolution = GraphicsOutputProtocol->Mode->Info->HorizontalResolution;
+      VerticalResolution = GraphicsOutputProtocol->Mode->Info->VerticalResolution;
+      TotalResolution = HorizontalResolution * VerticalResolution;
+      Surface::init();
+    }
+
+    auto getMaxResolutionMode(BOOLEAN horizontal = TRUE) {
+      // cf. http://segfo-ctflog.blogspot.jp/2015/06/uefios.html
+      EFI_STATUS status;
+      UINTN sizeOfInfo;
+      EFI_GRAPHICS_OUTPUT_MODE_INFORMATION *gopInfo;
+      UINT32 mode = 0;
+      for (UINT32 i = 0; i < GraphicsOutputProtocol->Mode->MaxMode; ++i) {
+        status = GraphicsOutputProtocol->QueryMode(GraphicsOutputProtocol, i, &sizeOfInfo, &gopInfo);
+        if (status != EFI_SUCCESS) break;
+        if (gopInfo->PixelFormat != PixelBltOnly &&
+          ((gopInfo->HorizontalResolution >= gopInfo->VerticalResolution) == horizontal)) {
+          mode = i;
+        }
+      }
+      return mode;
+    }
+
+    auto setMode(UINT32 mode) {
+      GraphicsOutputProtocol->SetMode(GraphicsOutputProtocol, mode);
+      HorizontalResolution = GraphicsOutputProtocol->Mode->Info->HorizontalResolution;
+      VerticalResolution = GraphicsOutputProtocol->Mode->Info->VerticalResolution;
+      TotalResolution = HorizontalResolution * VerticalResolution;
+      Surface::init();
+    }
+
+    auto maximizeResolution(BOOLEAN hosizontal = TRUE) {
+      setMode(getMaxResolutionMode(hosizontal));
+    }
+
+    struct _Point {
+      INT32 x;
+      INT32 y;
+    };
+
+    typedef struct _Point Point;
+
+    struct _Rect {
+      UINT32 w;
+      UINT32 h;
+    };
+
+    typedef struct _Rect Rect;
+
+    struct _Circle {
+      UINT32 r;
+    };
+
+    typedef struct _Circle Circle;
+
+    void drawPoint(INT32 offset, const Pixel &pixel, Pixel *basePixel) {
+      if (offset < 0 || offset >= (INT32)TotalResolution) return;
+      Pixel *pointPixel = basePixel + offset;
+      pointPixel->Blue = pixel.Blue;
+      pointPixel->Green = pixel.Green;
+      pointPixel->Red = pixel.Red;
+      pointPixel->Reserved = pixel.Reserved;
+    }
+
+    void drawPoint(INT32 offset, const Pixel &pixel) {
+      drawPoint(offset, pixel, Surface::pixels);
+      Surface::markDirty(offset % HorizontalResolution, offset / HorizontalResolution, 1, 1);
+    }
+
+    void drawPoint(INT32 x, INT32 y, const Pixel &pixel) {
+      drawPoint(y * HorizontalResolution + x, pixel);
+    }
+
+    void drawPoint(const Point &point, const Pixel &pixel) {
+      drawPoint(point.x, point.y, pixel);
+    }
+
+    /**
+     * 矩形を画面内に切り詰める
+     *
+     * 切り詰めた分だけ描画元の開始位置sx, syを進める 描く範囲が無ければfalseを返す
+     */
+    bool clipRect(INT32 &x, INT32 &y, INT32 &w, INT32 &h, INT32 &sx, INT32 &sy) {
+      if (x < 0) {
+        sx -= x;
+        w += x;
+        x = 0;
+      }
+      if (y < 0) {
+        sy -= y;
+        h += y;
+        y = 0;
+      }
+      if (x + w > (INT32)HorizontalResolution) w = HorizontalResolution - x;
+      if (y + h > (INT32)VerticalResolution) h = VerticalResolution - y;
+      return w > 0 && h > 0;
+    }
+
+    /** 切り詰め済みの範囲を塗る */
+    void fillRows(INT32 x, INT32 y, INT32 w, INT32 h, const Pixel &color) {
+      Pixel *row = Surface::pixels + y * HorizontalResolution + x;
+      for (INT32 py = 0; py < h; ++py) {
+        memset(row, color, w);
+        row += HorizontalResolution;
+      }
+    }
+
+    void fillRect(INT32 x, INT32 y, UINT32 w, UINT32 h, const Pixel &color) {
+      PROFILE_ZONE(ZoneFillRect);
+      INT32 cw = w, ch = h, sx = 0, sy = 0;
+      if (!clipRect(x, y, cw, ch, sx, sy)) return;
+      fillRows(x, y, cw, ch, color);
+      Surface::markFilled(x, y, cw, ch, color);
+    }
+
+    void fillRect(INT32 x, INT32 y, const Rect &rect, const Pixel &color) {
+      fillRect(x, y, rect.w, rect.h, color);
+    }
+
+    void fillRect(const Point &point, const Rect &rect, const Pixel &color) {
+      fillRect(point.x, point.y, rect, color);
+    }
+
+    void fillCircle(INT32 x, INT32 y, UINT32 r, const Pixel &color) {
+      PROFILE_ZONE(ZoneFillCircle);
+      UINT32 r2 = r * r;
+      INT32 dx, dy, mdy, rest, start_x, end_x, length;
+      dy = -r;
+      if (y + dy < 0) dy = -y;
+      mdy = r;
+      if (y + mdy > (INT32)VerticalResolution) mdy = VerticalResolution - y;
+      for (; dy < mdy; ++dy) {
+        rest = r2 - dy * dy;
+        dx = -r;
         while (dx * dx > rest) ++dx;
-        yoffset = (r + dy) * R;
-        if (!dx) continue;
-        memset(image->alphas + yoffset + r + dx, 255, -2 * dx);
+        start_x = x + dx;
+        end_x = x - dx;
+        if (!dx || end_x <= 0 || start_x >= (INT32)HorizontalResolution) continue;
+        if (start_x < 0) start_x = 0;
+        if (end_x > (INT32)HorizontalResolution) end_x = HorizontalResolution;
+        length = end_x - start_x;
+        memset(Surface::pixels + (y + dy) * HorizontalResolution + start_x, color, length);
       }
-      image->x = R;
-      image->y = R;
-      image->length = length;
-      image->composition = 4;
-      return image;
+      Surface::markDirty(x - (INT32)r, y - (INT32)r, r * 2, r * 2);
+    }
+
+    void fillCircle(INT32 x, INT32 y, const Circle &circle, const Pixel &color) {
+      fillCircle(x, y, circle.r, color);
+    }
+
+    void fillCircle(const Point &point, const Circle &circle, const Pixel &color) {
+      fillCircle(point.x, point.y, circle, color);
     }
 
-    auto loadImageFromMemory(const UINT8 *buf, int len) {
-      Image *image = (Image*)malloc(sizeof(Image));
+    /**
+     * 乗算済みアルファのBGRA(Reservedがアルファ)を合成する
+     *
+     * 浮動小数は使わず、x / 255 は (x + 128 + ((x + 128) >> 8)) >> 8 で丸めて求める
+     */
+    namespace Blend {
+      typedef UINT32 __attribute__((may_alias)) PixelBits;
+      typedef char V16qi __attribute__((vector_size(16)));
+      typedef short V8hi __attribute__((vector_size(16)));
+      typedef int V4si __attribute__((vector_size(16), may_alias));
+      typedef UINT32 V4su __attribute__((vector_size(16)));
+      /** 4バイト境界にしか揃っていない画素列を読み書きする */
+      typedef int V4siu __attribute__((vector_size(16), may_alias, aligned(4)));
+
+      /** dst = src + dst * (255 - src.alpha) / 255 */
+      inline void blendPixel(Pixel *dst, const Pixel *src) {
+        UINT32 s = *(const PixelBits*)src;
+        UINT32 d = *(PixelBits*)dst;
+        UINT32 inv = 255 - (s >> 24);
+        UINT32 rb = (d & 0x00FF00FF) * inv + 0x00800080;
+        rb = ((rb + ((rb >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+        UINT32 ag = ((d >> 8) & 0x00FF00FF) * inv + 0x00800080;
+        ag = (ag + ((ag >> 8) & 0x00FF00FF)) & 0xFF00FF00;
+        *(PixelBits*)dst = s + rb + ag;
+      }
+
+      /** 1画素ずつ合成する 透明と不透明は読み書きを省く */
+      void blendScalar(Pixel *dst, const Pixel *src, UINTN n) {
+        for (; n; --n, ++dst, ++src) {
+          UINT8 alpha = src->Reserved;
+          if (alpha == 0) continue;
+          if (alpha == 255) {
+            *dst = *src;
+          } else {
+            blendPixel(dst, src);
+          }
+        }
+      }
+
+      /** 4画素ずつSSE2で合成する 4画素とも透明・不透明ならまとめて飛ばす・コピーする */
+      void blendSse2(Pixel *dst, const Pixel *src, UINTN n) {
+        const V4si zero = {0, 0, 0, 0};
+        const V4si opaque = {255, 255, 255, 255};
+        const V8hi bias = {128, 128, 128, 128, 128, 128, 128, 128};
+        for (; n >= 4; n -= 4, dst += 4, src += 4) {
+          V4si s = *(const V4siu*)src;
+          V4si alpha = (V4si)((V4su)s >> 24);
+          if (__builtin_ia32_pmovmskb128((V16qi)(alpha == zero)) == 0xFFFF) continue;
+          if (__builtin_ia32_pmovmskb128((V16qi)(alpha == opaque)) == 0xFFFF) {
+            *(V4siu*)dst = s;
+            continue;
+          }
+          V4si inv = opaque - alpha;
+          inv |= inv << 16;
+          V8hi invLo = (V8hi)__builtin_ia32_punpckldq128(inv, inv);
+          V8hi invHi = (V8hi)__builtin_ia32_punpckhdq128(inv, inv);
+          V16qi d = (V16qi)*(V4siu*)dst;
+          V8hi lo = (V8hi)__builtin_ia32_punpcklbw128(d, (V16qi)zero) * invLo + bias;
+          V8hi hi = (V8hi)__builtin_ia32_punpckhbw128(d, (V16qi)zero) * invHi + bias;
+          lo = __builtin_ia32_psrlwi128(lo + __builtin_ia32_psrlwi128(lo, 8), 8);
+          hi = __builtin_ia32_psrlwi128(hi + __builtin_ia32_psrlwi128(hi, 8), 8);
+          *(V4siu*)dst = (V4si)((V16qi)s + __builtin_ia32_packuswb128(lo, hi));
+        }
+        blendScalar(dst, src, n);
+      }
+
+      /** n画素の列をdstに重ねる */
+      inline void blend(Pixel *dst, const Pixel *src, UINTN n) {
+    #ifdef __SSE2__
+        blendSse2(dst, src, n);
+    #else
+        blendScalar(dst, src, n);
+    #endif
+      }
+
+      /** 色をアルファで乗算済みにする */
+      inline Pixel premultiply(const Pixel &color, UINT8 alpha) {
+        Pixel pixel;
+        pixel.Blue = (color.Blue * alpha + 127) / 255;
+        pixel.Green = (color.Green * alpha + 127) / 255;
+        pixel.Red = (color.Red * alpha + 127) / 255;
+        pixel.Reserved = alpha;
+        return pixel;
+      }
+    };
+
+    /** 透明なので飛ばす */
+    #define SPAN_SKIP 0
+    /** 不透明なのでそのまま写す */
+    #define SPAN_COPY 1
+    /** 半透明なので合成する */
+    #define SPAN_BLEND 2
+    #define SPAN_OP_SHIFT 30
+    #define SPAN_LENGTH_MASK ((1u << SPAN_OP_SHIFT) - 1)
+
+    struct _Image {
+      /** 乗算済みアルファのBGRA */
+      Pixel *pixels;
+      /** 行ごとの同じ扱いの画素の並び 上位2bitが種類(SPAN_*)、残りが画素数 */
+      UINT32 *spans;
+      /** 各行のspansの開始位置 y + 1個 */
+      UINT32 *spanRows;
+      int x;
+      int y;
+      int composition;
+      int length;
+      /** AssetCacheに入っていればそのEntry releaseで探さずに済むように */
+      void *cacheEntry;
+    };
+
+    typedef struct _Image Image;
+
+    auto spanOp(const Pixel &pixel) {
+      return pixel.Reserved == 0 ? SPAN_SKIP : pixel.Reserved == 255 ? SPAN_COPY : SPAN_BLEND;
+    }
+
+    /** アルファから飛ばす・写す・合成するの並びを作る */
+    void buildSpans(Image *image) {
+      UINT32 count = 0;
+      for (int dy = 0; dy < image->y; ++dy) {
+        Pixel *row = image->pixels + dy * image->x;
+        for (int dx = 0; dx < image->x; ++dx) {
+          if (dx == 0 || spanOp(row[dx]) != spanOp(row[dx - 1])) ++count;
+        }
+      }
+      image->spans = (UINT32*)malloc(sizeof(UINT32) * count);
+      image->spanRows = (UINT32*)malloc(sizeof(UINT32) * (image->y + 1));
+      UINT32 *span = image->spans;
+      for (int dy = 0; dy < image->y; ++dy) {
+        image->spanRows[dy] = span - image->spans;
+        Pixel *row = image->pixels + dy * image->x;
+        int start = 0;
+        for (int dx = 1; dx <= image->x; ++dx) {
+          if (dx < image->x && spanOp(row[dx]) == spanOp(row[start])) continue;
+          *span++ = (spanOp(row[start]) << SPAN_OP_SHIFT) | (dx - start);
+          start = dx;
+        }
+      }
+      image->spanRows[image->y] = span - image->spans;
+    }
+
+    auto getRectImage(UINT32 w, UINT32 h, const Pixel &color) {
+      auto length = w * h;
+      Image *image = (Image*)malloc(sizeof(Image));
+      image->cacheEntry = nullptr;
+      image->pixels = (Pixel*)malloc(sizeof(Pixel) * length);
+      memset(image->pixels, Blend::premultiply(color, 255), length);
+      image->x = w;
+      image->y = h;
+      image->length = length;
+      image->composition = 4;
+      buildSpans(image);
+      return image;
+    }
+
+    auto getCircleImage(UINT32 r, const Pixel &color) {
+      auto R = r * 2;
+      auto length = R * R;
+      Pixel transparent {0, 0, 0, 0};
+      Image *image = (Image*)malloc(sizeof(Image));
+      image->cacheEntry = nullptr;
+      image->pixels = (Pixel*)malloc(sizeof(Pixel) * length);
+      memset(image->pixels, transparent, length);
+      UINT32 r2 = r * r;
+      INT32 dx, dy, mdy, rest, yoffset;
+      mdy = r;
+      for (dy = -r; dy < mdy; ++dy) {
+        rest = r2 - dy * dy;
+        dx = -r;
+        while (dx * dx > rest) ++dx;
+        yoffset = (r + dy) * R;
+        if (!dx) continue;
+        memset(image->pixels + yoffset + r + dx, Blend::premultiply(color, 255), -2 * dx);
+      }
+      image->x = R;
+      image->y = R;
+      image->length = length;
+      image->composition = 4;
+      buildSpans(image);
+      return image;
+    }
+
+    /** stbi_loadのRGBAをlength画素分、乗算済みのBGRAにする */
+    void convertPixels(Pixel *pixel, const UINT8 *src_pixels, int length) {
+      int offset = 0;
+      for (int pos = 0; pos < length; ++pos) {
+        Pixel color {*(src_pixels + offset + 2), *(src_pixels + offset + 1), *(src_pixels + offset), 0};
+        *pixel = Blend::premultiply(color, *(src_pixels + offset + 3));
+        offset += 4;
+        ++pixel;
+      }
+    }
+
+    /** stbi_loadのRGBAからImageを作る src_pixelsは解放する */
+    Image* makeImage(UINT8 *src_pixels, int x, int y, int composition) {
+      if (src_pixels == nullptr) return nullptr;
+      Image *image = (Image*)malloc(sizeof(Image));
+      image->cacheEntry = nullptr;
+      image->x = x;
+      image->y = y;
+      image->composition = composition;
+      int length = image->length = x * y;
+      image->pixels = (Pixel*)malloc(sizeof(Pixel) * length);
+      convertPixels(image->pixels, src_pixels, length);
+      stbi_image_free(src_pixels);
+      buildSpans(image);
+      return image;
+    }
+
+    void freeImage(Image *image) {
+      if (image == nullptr) return;
+      free(image->pixels);
+      free(image->spans);
+      free(image->spanRows);
+      free(image);
+    }
+
+    #define LZ4_SHORT_COPY 32
+
+    /** 8バイトずつ写す 最大7バイト余計に読み書きするので、前後に余裕があるときだけ使う */
+    inline void wildCopy(UINT8 *dst, const UINT8 *src, UINTN length) {
+      for (UINTN i = 0; i < length; i += 8) *(UINT64*)(dst + i) = *(const UINT64*)(src + i);
+    }
+
+    /**
+     * LZ4のブロック形式を展開する
+     *
+     * dstSizeちょうどに展開できなければfalseを返す 壊れたデータでもsrcとdstの外には触らない
+     */
+    bool decompressLz4(const UINT8 *src, UINTN srcSize, UINT8 *dst, UINTN dstSize) {
+      const UINT8 *ip = src, *ipEnd = src + srcSize;
+      UINT8 *op = dst, *opEnd = dst + dstSize;
+      while (ip < ipEnd) {
+        UINT8 token = *ip++;
+        UINTN length = token >> 4;
+        if (length == 15) {
+          UINT8 extra;
+          do {
+            if (ip >= ipEnd) return false;
+            length += extra = *ip++;
+          } while (extra == 255);
+        }
+        if (length > (UINTN)(ipEnd - ip) || length > (UINTN)(opEnd - op)) return false;
+        // 短いものはmemcpyを呼ぶより速い
+        if (length <= LZ4_SHORT_COPY && (UINTN)(ipEnd - ip) >= length + 8 && (UINTN)(opEnd - op) >= length + 8) {
+          wildCopy(op, ip, length);
+        } else {
+          memcpy(op, ip, length);
+        }
+        op += length;
+        ip += length;
+        // 最後の並びはリテラルだけ
+        if (ip == ipEnd) break;
+        if (ipEnd - ip < 2) return false;
+        UINTN offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (!offset || offset > (UINTN)(op - dst)) return false;
+        length = token & 15;
+        if (length == 15) {
+          UINT8 extra;
+          do {
+            if (ip >= ipEnd) return false;
+            length += extra = *ip++;
+          } while (extra == 255);
+        }
+        length += 4;
+        if (length > (UINTN)(opEnd - op)) return false;
+        const UINT8 *match = op - offset;
+        if (offset >= 8 && length <= LZ4_SHORT_COPY && (UINTN)(opEnd - op) >= length + 8) {
+          wildCopy(op, match, length);
+          op += length;
+        } else if (offset >= length) {
+          memcpy(op, match, length);
+          op += length;
+        } else {
+          // 重なるときは同じ並びの繰り返しなので、周期の倍数で8バイト以上離れた所から写せるまでは1バイトずつ写す
+          UINTN step = offset * ((8 + offset - 1) / offset);
+          for (UINTN i = offset; i < step && length; ++i, --length) *op++ = *match++;
+          match = op - step;
+          for (; length >= 8; length -= 8, op += 8, match += 8) *(UINT64*)op = *(const UINT64*)match;
+          while (length--) *op++ = *match++;
+        }
+      }
+      return op == opEnd;
+    }
+
+    #define SPRITE_MAGIC 0x50534745 // "EGSP"
+    #define SPRITE_VERSION 1
+    #define SPRITE_RAW 0
+    #define SPRITE_LZ4 1
+    #define SPRITE_MAX_SIZE 16384
+
+    /** make_sprite.pyで変換した画像 この後にspanRows、spans、pixelsの順に続く */
+    struct _SpriteHeader {
+      UINT32 magic;
+      UINT16 version;
+      UINT8 compression;
+      UINT8 reserved;
+      UINT32 width;
+      UINT32 height;
+      UINT32 spanCount;
+      /** ファイル上のpixelsの大きさ SPRITE_RAWならwidth * height * 4 */
+      UINT32 pixelDataSize;
+    };
+
+    typedef struct _SpriteHeader SpriteHeader;
+
+    auto isSprite(const UINT8 *buf, UINTN size) {
+      return size >= sizeof(SpriteHeader) && ((SpriteHeader*)buf)->magic == SPRITE_MAGIC;
+    }
+
+    /**
+     * ヘッダーからImageの枠を作る 中身はまだ入れない
+     *
+     * sizeはヘッダーを含むスプライト全体の大きさ ヘッダーの数と合わなければ確保する前にnullptrを返す
+     */
+    Image* allocSprite(const SpriteHeader *header, UINT64 size) {
+      if (header->magic != SPRITE_MAGIC || header->version != SPRITE_VERSION || !header->width || !header->height ||
+        header->width > SPRITE_MAX_SIZE || header->height > SPRITE_MAX_SIZE) return nullptr;
+      UINT32 length = header->width * header->height;
+      if (header->compression == SPRITE_RAW ? header->pixelDataSize != sizeof(Pixel) * length : header->compression != SPRITE_LZ4) return nullptr;
+      if (size != sizeof(SpriteHeader) + sizeof(UINT32) * ((UINT64)header->height + 1 + header->spanCount) + header->pixelDataSize) return nullptr;
+      Image *image = (Image*)malloc(sizeof(Image));
+      if (image == nullptr) return nullptr;
+      image->cacheEntry = nullptr;
+      image->x = header->width;
+      image->y = header->height;
+      image->composition = 4;
+      image->length = length;
+      image->pixels = (Pixel*)malloc(sizeof(Pixel) * length);
+      image->spans = (UINT32*)malloc(sizeof(UINT32) * (header->spanCount ? header->spanCount : 1));
+      image->spanRows = (UINT32*)malloc(sizeof(UINT32) * (header->height + 1));
+      if (image->pixels == nullptr || image->spans == nullptr || image->spanRows == nullptr) {
+        freeImage(image);
+        return nullptr;
+      }
+      return image;
+    }
+
+    /** blitImageが範囲の外を読まないように、各行のspansがちょうど幅の分あるか確かめる */
+    bool validSpans(Image *image, UINT32 spanCount) {
+      if (image->spanRows[0] != 0 || image->spanRows[image->y] != spanCount) return false;
+      for (int dy = 0; dy < image->y; ++dy) {
+        if (image->spanRows[dy] > image->spanRows[dy + 1]) return false;
+        UINT32 width = 0;
+        for (UINT32 i = image->spanRows[dy]; i < image->spanRows[dy + 1]; ++i) width += image->spans[i] & SPAN_LENGTH_MASK;
+        if (width != (UINT32)image->x) return false;
+      }
+      return true;
+    }
+
+    /** pixelsを入れてspansを確かめる できなければimageを解放してnullptrを返す */
+    Image* fillSprite(Image *image, const SpriteHeader *header, const UINT8 *pixelData) {
+      bool valid = validSpans(image, header->spanCount);
+      if (valid && header->compression == SPRITE_RAW) {
+        memcpy(image->pixels, (const Pixel*)pixelData, image->length);
+      } else if (valid) {
+        valid = decompressLz4(pixelData, header->pixelDataSize, (UINT8*)image->pixels, sizeof(Pixel) * image->length);
+      }
+      if (valid) return image;
+      freeImage(image);
+      return nullptr;
+    }
+
+    /** デコードもspansの作成もいらないので、写すか展開するだけで済む */
+    Image* loadSpriteFromMemory(const UINT8 *buf, UINTN size) {
+      if (!isSprite(buf, size)) return nullptr;
+      SpriteHeader *header = (SpriteHeader*)buf;
+      Image *image = allocSprite(header, size);
+      if (image == nullptr) return nullptr;
+      UINTN spanRowsSize = sizeof(UINT32) * (image->y + 1);
+      UINTN spansSize = sizeof(UINT32) * header->spanCount;
+      const UINT8 *p = buf + sizeof(SpriteHeader);
+      memcpy(image->spanRows, (const UINT32*)p, image->y + 1);
+      memcpy(image->spans, (const UINT32*)(p + spanRowsSize), header->spanCount);
+      return fillSprite(image, header, p + spanRowsSize + spansSize);
+    }
+
+    /** ヘッダーを読んだ後のfileから続きを読む 無圧縮ならpixelsへ直接読み込む */
+    Image* loadSpriteFromFile(EFI_FILE_PROTOCOL *file, const SpriteHeader *header) {
+      UINT64 fileSize;
+      if (!FileSystem::getSize(file, &fileSize)) return nullptr;
+      Image *image = allocSprite(header, fileSize);
+      if (image == nullptr) return nullptr;
+      if (!FileSystem::readFully(file, image->spanRows, sizeof(UINT32) * (image->y + 1)) ||
+        !FileSystem::readFully(file, image->spans, sizeof(UINT32) * header->spanCount)) {
+        freeImage(image);
+        return nullptr;
+      }
+      if (header->compression == SPRITE_RAW) {
+        if (validSpans(image, header->spanCount) && FileSystem::readFully(file, image->pixels, header->pixelDataSize)) return image;
+        freeImage(image);
+        return nullptr;
+      }
+      UINT8 *pixelData = (UINT8*)malloc(header->pixelDataSize ? header->pixelDataSize : 1);
+      if (pixelData == nullptr || !FileSystem::readFully(file, pixelData, header->pixelDataSize)) {
+        free(pixelData);
+        freeImage(image);
+        return nullptr;
+      }
+      image = fillSprite(image, header, pixelData);
+      free(pixelData);
+      return image;
+    }
+
+    /** PNGなどに加えてmake_sprite.pyの形式も読める */
+    Image* loadImageFromMemory(const UINT8 *buf, int len) {
+      if (isSprite(buf, len)) return loadSpriteFromMemory(buf, len);
+      int x, y, composition;
+      Workers::lockStbi(nullptr);
+      UINT8* src_pixels = stbi_load_from_memory(buf, len, &x, &y, &composition, 4);
+      Workers::unlockStbi();
+      return makeImage(src_pixels, x, y, composition);
+    }
+
+    #define MAX_IMAGE_FILE_SIZE 1024 * 1024 * 20
+    #define IMAGE_STREAM_CHUNK_SIZE 1024 * 64
+
+    /** stbiのコールバックに渡すファイル limitより先は無いことにする */
+    struct _ImageStream {
+      FileSystem::Reader reader;
+      UINT64 limit;
+    };
+
+    typedef struct _ImageStream ImageStream;
+
+    int readImageStream(void *user, char *data, int size) {
+      ImageStream *stream = (ImageStream*)user;
+      UINT64 pos = FileSystem::tellReader(&stream->reader);
+      if (pos >= stream->limit) return 0;
+      if ((UINT64)size > stream->limit - pos) size = stream->limit - pos;
+      return FileSystem::readBytes(&stream->reader, data, size);
+    }
+
+    void skipImageStream(void *user, int n) {
+      ImageStream *stream = (ImageStream*)user;
+      FileSystem::seekReader(&stream->reader, FileSystem::tellReader(&stream->reader) + n);
+    }
+
+    int eofImageStream(void *user) {
+      ImageStream *stream = (ImageStream*)user;
+      return FileSystem::tellReader(&stream->reader) >= stream->limit || FileSystem::atEnd(&stream->reader);
+    }
+
+    /**
+     * 画像ファイルを読み込む
+     *
+     * make_sprite.pyの形式ならそのまま読み込む
+     * それ以外はファイル全体をメモリに置かず、デコーダーが求める分をIMAGE_STREAM_CHUNK_SIZEずつ読んで渡す
+     */
+    Image* loadImageFromFile(CHAR16 *filename, UINTN maxFileSize = MAX_IMAGE_FILE_SIZE) {
+      PROFILE_ZONE(ZoneLoadImage);
+      auto file = FileSystem::open(filename);
+      if (file == nullptr) return nullptr;
+      SpriteHeader header;
+      if (FileSystem::read(file, &header, sizeof(header)) == sizeof(header) && header.magic == SPRITE_MAGIC) {
+        Image *image = loadSpriteFromFile(file, &header);
+        FileSystem::close(file);
+        return image;
+      }
+      file->SetPosition(file, 0);
+      ImageStream stream;
+      stream.limit = maxFileSize;
+      FileSystem::openReader(&stream.reader, file, maxFileSize < IMAGE_STREAM_CHUNK_SIZE ? maxFileSize : IMAGE_STREAM_CHUNK_SIZE);
+      stbi_io_callbacks callbacks {readImageStream, skipImageStream, eofImageStream};
+      int x, y, composition;
+      Workers::lockStbi(nullptr);
+      UINT8* src_pixels = stbi_load_from_callbacks(&callbacks, &stream, &x, &y, &composition, 4);
+      Workers::unlockStbi();
+      FileSystem::closeReader(&stream.reader);
+      return makeImage(src_pixels, x, y, composition);
+    }
+
+    #define IMAGE_JOB_READ_SIZE 1024 * 256
+    #define IMAGE_JOB_CONVERT_ROWS 64
+
+    enum ImageJobPhase {
+      ImageJobOpen,
+      ImageJobRead,
+      ImageJobDecode,
+      /** APでのデコードを待つ */
+      ImageJobWait,
+      ImageJobConvert,
+      ImageJobSpans,
+    };
+
+    /** loadImageAsyncで読み込み中の画像 */
+    struct _ImageJob {
+      ImageJobPhase phase;
+      CHAR16 *path;
+      UINTN maxFileSize;
+      EFI_FILE_PROTOCOL *file;
+      /** ファイルの中身 GetInfoで調べた大きさで確保する */
+      UINT8 *buf;
+      UINTN fileSize;
+      /** 読み込んだバイト数 */
+      UINTN size;
+      /** stbi_loadのRGBA */
+      UINT8 *srcPixels;
+      Image *image;
+      /** 変換し終えた行数 */
+      int row;
+      /** APでのデコードの結果 ImageWorkerResult */
+      UINT32 workerResult;
+      /** APで失敗したのでBSPでデコードする */
+      bool decodeOnBsp;
+    };
+
+    typedef struct _ImageJob ImageJob;
+
+    enum ImageWorkerResult {
+      ImageWorkerPending,
+      ImageWorkerDone,
+      ImageWorkerFailed,
+    };
+
+    /**
+     * APでデコードして乗算済みのBGRAまで作る メモリはworkerの領域から取り、imageのpixelsへ書く
+     *
+     * stb_imageは交代で使うが、変換は他のAPのデコードと並べて進める
+     */
+    void decodeOnWorker(Workers::Worker *worker, void *arg) {
+      ImageJob *state = (ImageJob*)arg;
+      Image *image = state->image;
+      int x, y, composition;
+      Workers::lockStbi(worker);
+      UINT8 *src_pixels = stbi_load_from_memory(state->buf, state->size, &x, &y, &composition, 4);
+      Workers::unlockStbi();
+      UINT32 result = ImageWorkerFailed;
+      if (src_pixels != nullptr && x == image->x && y == image->y) {
+        convertPixels(image->pixels, src_pixels, image->length);
+        result = ImageWorkerDone;
+      }
+      if (src_pixels != nullptr) stbi_image_free(src_pixels);
+      __atomic_store_n(&state->workerResult, result, __ATOMIC_RELEASE);
+    }
+
+    /**
+     * APに回せればデコードを積む
+     *
+     * 大きさはヘッダーだけ読んで決め、出力先のpixelsはBSPで確保しておく
+     * 作業用のメモリがAPの領域に入りそうにないものはBSPでデコードする
+     */
+    bool submitDecode(ImageJob *state) {
+      int x, y, composition;
+      if (!Workers::available() || state->decodeOnBsp) return false;
+      // PNGのinfoはヘッダーを読むだけで確保しないので、stbiLockは取らない
+      if (!stbi_info_from_memory(state->buf, state->size, &x, &y, &composition)) return false;
+      if ((UINT64)x * y * 12 + state->size > WORKER_ARENA_SIZE) return false;
+      Image *image = (Image*)malloc(sizeof(Image));
+      image->cacheEntry = nullptr;
+      image->x = x;
+      image->y = y;
+      image->composition = composition;
+      image->length = x * y;
+      image->pixels = (Pixel*)malloc(sizeof(Pixel) * image->length);
+      image->spans = nullptr;
+      image->spanRows = nullptr;
+      state->image = image;
+      state->workerResult = ImageWorkerPending;
+      if (Workers::submit(decodeOnWorker, state)) return true;
+      freeImage(image);
+      state->image = nullptr;
+      return false;
+    }
+
+    void freeImageJob(ImageJob *state) {
+      if (state->file != nullptr) FileSystem::close(state->file);
+      if (state->srcPixels != nullptr) stbi_image_free(state->srcPixels);
+      freeImage(state->image);
+      free(state->buf);
+      free(state->path);
+      free(state);
+    }
+
+    /**
+     * loadImageAsyncの1回分
+     *
+     * ファイルはIMAGE_JOB_READ_SIZEずつ、変換はIMAGE_JOB_CONVERT_ROWS行ずつ進める
+     * PNGのデコードとspansの作成は分けられないので1回でやる make_sprite.pyの形式は読み込んだ後の1回で終わる
+     */
+    bool stepImageJob(Jobs::Job *job) {
+      PROFILE_ZONE(ZoneLoadImage);
+      ImageJob *state = (ImageJob*)job->state;
+      switch (state->phase) {
+        case ImageJobOpen: {
+          state->file = FileSystem::open(state->path);
+          if (state->file == nullptr) break;
+          UINT64 fileSize;
+          if (!FileSystem::getSize(state->file, &fileSize) || fileSize > state->maxFileSize) break;
+          state->fileSize = fileSize;
+          state->buf = (UINT8*)malloc(fileSize ? fileSize : 1);
+          state->phase = ImageJobRead;
+          return false;
+        }
+        case ImageJobRead: {
+          UINTN rest = state->fileSize - state->size;
+          UINTN chunk = rest < IMAGE_JOB_READ_SIZE ? rest : IMAGE_JOB_READ_SIZE;
+          UINTN size = chunk ? FileSystem::read(state->file, state->buf + state->size, chunk) : 0;
+          state->size += size;
+          if (size && state->size < state->fileSize) return false;
+          FileSystem::close(state->file);
+          state->file = nullptr;
+          state->phase = ImageJobDecode;
+          return false;
+        }
+        case ImageJobDecode: {
+          if (isSprite(state->buf, state->size)) {
+            // 変換済みなのでspansも作らずに終わる
+            job->result = loadSpriteFromMemory(state->buf, state->size);
+            break;
+          }
+          if (submitDecode(state)) {
+            state->phase = ImageJobWait;
+            return false;
+          }
+          // APがデコードしている間は次のステップでやり直す
+          if (!Workers::tryLockStbi(nullptr)) return false;
+          Image *image = (Image*)malloc(sizeof(Image));
+          image->cacheEntry = nullptr;
+          state->srcPixels = stbi_load_from_memory(state->buf, state->size, &image->x, &image->y, &image->composition, 4);
+          Workers::unlockStbi();
+          free(state->buf);
+          state->buf = nullptr;
+          if (state->srcPixels == nullptr) {
+            free(image);
+            break;
+          }
+          image->length = image->x * image->y;
+          image->pixels = (Pixel*)malloc(sizeof(Pixel) * image->length);
+          image->spans = nullptr;
+          image->spanRows = nullptr;
+          state->image = image;
+          state->row = 0;
+          state->phase = ImageJobConvert;
+          return false;
+        }
+        case ImageJobWait:
+          switch (__atomic_load_n(&state->workerResult, __ATOMIC_ACQUIRE)) {
+            case ImageWorkerPending:
+              return false;
+            case ImageWorkerFailed:
+              // APの領域が足りなかったときなど BSPでやり直す
+              freeImage(state->image);
+              state->image = nullptr;
+              state->decodeOnBsp = true;
+              state->phase = ImageJobDecode;
+              return false;
+          }
+          free(state->buf);
+          state->buf = nullptr;
+          state->phase = ImageJobSpans;
+          return false;
+        case ImageJobConvert: {
+          Image *image = state->image;
+          int rows = image->y - state->row < IMAGE_JOB_CONVERT_ROWS ? image->y - state->row : IMAGE_JOB_CONVERT_ROWS;
+          convertPixels(image->pixels + state->row * image->x, state->srcPixels + state->row * image->x * 4, rows * image->x);
+          state->row += rows;
+          if (state->row < image->y) return false;
+          stbi_image_free(state->srcPixels);
+          state->srcPixels = nullptr;
+          state->phase = ImageJobSpans;
+          return false;
+        }
+        case ImageJobSpans:
+          buildSpans(state->image);
+          job->result = state->image;
+          state->image = nullptr;
+          break;
+      }
+      freeImageJob(state);
+      return true;
+    }
+
+    /**
+     * 画像をJobsで少しずつ読み込む
+     *
+     * 読み込めたらonLoadedにImage*を、失敗したらnullptrを渡す 列がいっぱいならfalseを返す
+     */
+    auto loadImageAsync(const CHAR16 *filename, void (*onLoaded)(void *image, void *context), void *context = nullptr, UINTN maxFileSize = MAX_IMAGE_FILE_SIZE) {
+      ImageJob *state = (ImageJob*)malloc(sizeof(ImageJob));
+      state->phase = ImageJobOpen;
+      state->path = (CHAR16*)malloc(sizeof(CHAR16) * (strlen((CHAR16*)filename) + 1));
+      strcpy(state->path, filename);
+      state->maxFileSize = maxFileSize;
+      state->file = nullptr;
+      state->buf = nullptr;
+      state->fileSize = 0;
+      state->size = 0;
+      state->srcPixels = nullptr;
+      state->image = nullptr;
+      state->decodeOnBsp = false;
+      if (Jobs::submit(stepImageJob, state, onLoaded, context)) return true;
+      freeImageJob(state);
+      return false;
+    }
+
+    /** 切り詰め済みの範囲へ画像のsx, syからを写す */
+    void blitImage(Image *image, INT32 x, INT32 y, INT32 w, INT32 h, INT32 sx, INT32 sy, bool transparent) {
+      for (INT32 dy = 0; dy < h; ++dy) {
+        Pixel *image_row = image->pixels + (sy + dy) * image->x;
+        Pixel *base_row = Surface::pixels + (y + dy) * HorizontalResolution + x;
+        if (!transparent) {
+          memcpy(base_row, image_row + sx, w);
+          continue;
+        }
+        UINT32 *span = image->spans + image->spanRows[sy + dy];
+        UINT32 *end = image->spans + image->spanRows[sy + dy + 1];
+        INT32 pos = 0;
+        for (; span < end && pos < sx + w; ++span) {
+          INT32 length = *span & SPAN_LENGTH_MASK;
+          INT32 start = pos > sx ? pos : sx;
+          INT32 stop = pos + length < sx + w ? pos + length : sx + w;
+          pos += length;
+          if (start >= stop) continue;
+          switch (*span >> SPAN_OP_SHIFT) {
+            case SPAN_COPY: memcpy(base_row + start - sx, image_row + start, stop - start); break;
+            case SPAN_BLEND: Blend::blend(base_row + start - sx, image_row + start, stop - start); break;
+          }
+        }
+      }
+    }
+
+    auto drawImage(Image *image, INT32 x, INT32 y, bool transparent = TRUE) {
+      PROFILE_ZONE(ZoneDrawImage);
+      if (image == nullptr) return false;
+      INT32 w = image->x, h = image->y, sx = 0, sy = 0;
+      if (!clipRect(x, y, w, h, sx, sy)) return true;
+      blitImage(image, x, y, w, h, sx, sy, transparent);
+      Surface::markDirty(x, y, w, h);
+      return true;
+    }
+
+    /**
+     * デコード済みの画像をファイル名で共有するキャッシュ
+     *
+     * acquireで参照を得てreleaseで返す 参照されていない画像は残しておき、
+     * 上限バイト数を超えたら古いものから捨てる
+     */
+    namespace AssetCache {
+      #define ASSET_CACHE_BUCKETS 64
+      #define ASSET_CACHE_DEFAULT_BUDGET 1024 * 1024 * 32
+
+      struct _Entry {
+        CHAR16 *path;
+        Image *image;
+        UINTN bytes;
+        UINT32 refCount;
+        /** 最後に使った順番 */
+        UINT64 lastUse;
+        struct _Entry *next;
+      };
+
+      typedef struct _Entry Entry;
+
+      static Entry *buckets[ASSET_CACHE_BUCKETS];
+      static UINTN usedBytes;
+      static UINTN budget = ASSET_CACHE_DEFAULT_BUDGET;
+      static UINT64 useCount;
+
+      /** FATやアセットファイルと同じく、大文字小文字を区別せず/も\として扱う */
+      auto hash(const CHAR16 *path) {
+        UINT32 h = 2166136261u;
+        while (*path) h = (h ^ FileSystem::AssetPack::normalize(*path++)) * 16777619u;
+        return h % ASSET_CACHE_BUCKETS;
+      }
+
+      auto samePath(const CHAR16 *a, const CHAR16 *b) {
+        using FileSystem::AssetPack::normalize;
+        while (*a && normalize(*a) == normalize(*b)) {
+          ++a;
+          ++b;
+        }
+        return normalize(*a) == normalize(*b);
+      }
+
+      auto imageBytes(Image *image) {
+        return sizeof(Image) + sizeof(Pixel) * image->length + sizeof(UINT32) * (image->spanRows[image->y] + image->y + 1);
+      }
+
+      Entry* find(const CHAR16 *path) {
+        Entry *entry = buckets[hash(path)];
+        while (entry != nullptr && !samePath(entry->path, path)) entry = entry->next;
+        return entry;
+      }
+
+      /** 参照されていないものを古い順に捨ててlimitバイト以下にする */
+      void shrink(UINTN limit) {
+        while (usedBytes > limit) {
+          Entry **oldest = nullptr;
+          for (UINT32 i = 0; i < ASSET_CACHE_BUCKETS; ++i) {
+            for (Entry **slot = &buckets[i]; *slot != nullptr; slot = &(*slot)->next) {
+              if (!(*slot)->refCount && (oldest == nullptr || (*slot)->lastUse < (*oldest)->lastUse)) oldest = slot;
+            }
+          }
+          if (oldest == nullptr) return;
+          Entry *entry = *oldest;
+          *oldest = entry->next;
+          usedBytes -= entry->bytes;
+          freeImage(entry->image);
+          free(entry->path);
+          free(entry);
+        }
+      }
+
+      /** キャッシュの上限バイト数を設定する */
+      void setBudget(UINTN bytes) {
+        budget = bytes;
+        shrink(budget);
+      }
+
+      /** 読み込んだ画像をpathの名前で登録する */
+      Entry* insert(CHAR16 *path, Image *image) {
+        Entry *entry = (Entry*)malloc(sizeof(Entry));
+        UINTN length = strlen(path) + 1;
+        entry->path = (CHAR16*)malloc(sizeof(CHAR16) * length);
+        strcpy(entry->path, path);
+        entry->image = image;
+        image->cacheEntry = entry;
+        entry->bytes = imageBytes(image);
+        entry->refCount = 0;
+        entry->lastUse = ++useCount;
+        shrink(budget > entry->bytes ? budget - entry->bytes : 0);
+        UINT32 h = hash(path);
+        entry->next = buckets[h];
+        buckets[h] = entry;
+        usedBytes += entry->bytes;
+        return entry;
+      }
+
+      Entry* load(CHAR16 *path) {
+        auto image = loadImageFromFile(path);
+        if (image == nullptr) return nullptr;
+        return insert(path, image);
+      }
+
+      /** 画像の参照を得る 読み込んでいなければ読み込む */
+      Image* acquire(CHAR16 *path) {
+        Entry *entry = find(path);
+        if (entry == nullptr) entry = load(path);
+        if (entry == nullptr) return nullptr;
+        ++entry->refCount;
+        entry->lastUse = ++useCount;
+        return entry->image;
+      }
+
+      /** acquireで得た参照を返す */
+      void release(Image *image) {
+        if (image == nullptr) return;
+        Entry *entry = (Entry*)image->cacheEntry;
+        if (entry == nullptr || !entry->refCount) return;
+        --entry->refCount;
+        shrink(budget);
+      }
+
+      /**
+       * 画像をまとめて先読みする
+       *
+       * 上限バイト数に達したらそこで止める 読み込めた数を返す
+       */
+      UINTN preload(CHAR16 **paths, UINTN count) {
+        UINTN loaded = 0;
+        for (UINTN i = 0; i < count; ++i) {
+          Entry *entry = find(paths[i]);
+          if (entry == nullptr) {
+            if (usedBytes >= budget) break;
+            entry = load(paths[i]);
+            if (entry == nullptr) continue;
+          }
+          entry->lastUse = ++useCount;
+          ++loaded;
+        }
+        return loaded;
+      }
+
+      /** preloadAsyncで読み込み中の1枚 */
+      struct _Preload {
+        CHAR16 *path;
+        void (*onLoaded)(void *image, void *context);
+        void *context;
+      };
+
+      typedef struct _Preload Preload;
+
+      void preloaded(void *result, void *context) {
+        Preload *preload = (Preload*)context;
+        Image *image = (Image*)result;
+        if (image != nullptr) {
+          Entry *entry = find(preload->path);
+          if (entry != nullptr) {
+            // 読み込んでいる間にacquireで読み込まれていた
+            freeImage(image);
+          } else if (usedBytes >= budget) {
+            freeImage(image);
+            image = nullptr;
+          } else {
+            entry = insert(preload->path, image);
+          }
+          if (entry != nullptr) image = entry->image;
+        }
+        if (preload->onLoaded) preload->onLoaded(image, preload->context);
+        free(preload->path);
+        free(preload);
+      }
+
+      /**
+       * 画像をJobsで少しずつ先読みする
+       *
+       * まだ無いものだけを積み、1枚終わるごとにonLoadedを呼ぶ 積んだ数を返す
+       * 上限バイト数に達していればそれ以上は積まない
+       */
+      UINTN preloadAsync(CHAR16 **paths, UINTN count, void (*onLoaded)(void *image, void *context) = nullptr, void *context = nullptr) {
+        UINTN submitted = 0;
+        for (UINTN i = 0; i < count; ++i) {
+          Entry *entry = find(paths[i]);
+          if (entry != nullptr) {
+            entry->lastUse = ++useCount;
+            continue;
+          }
+          if (usedBytes >= budget) break;
+          Preload *preload = (Preload*)malloc(sizeof(Preload));
+          preload->path = (CHAR16*)malloc(sizeof(CHAR16) * (strlen(paths[i]) + 1));
+          strcpy(preload->path, paths[i]);
+          preload->onLoaded = onLoaded;
+          preload->context = context;
+          if (!loadImageAsync(preload->path, preloaded, preload)) {
+            free(preload->path);
+            free(preload);
+            break;
+          }
+          ++submitted;
+        }
+        return submitted;
+      }
+    };
+
+    #define FONT_FILE_MAX_SIZE 1024
+    auto getFontImageName(CHAR16 c, CHAR16 *path) {
+      CHAR16 code[10];
+      itoa(c, code, 10);
+      strcpy(path, (EFI_STRING)L"fonts\\");
+      strcat(path, code);
+      strcat(path, (EFI_STRING)L".png");
+      return path;
+    }
+
+    auto getFontImage(CHAR16 c) {
+      CHAR16 path[50];
+      getFontImageName(c, path);
+      return Graphics::loadImageFromFile(path, FONT_FILE_MAX_SIZE);
+    }
+
+    struct _FontPackHeader {
+      UINT32 magic;
+      UINT16 version;
+      UINT8 bpp;
+      UINT8 reserved;
+      UINT32 count;
+      UINT32 dataSize;
+    };
+
+    typedef struct _FontPackHeader FontPackHeader;
+
+    struct _FontPackGlyph {
+      UINT32 code;
+      UINT16 w;
+      UINT16 h;
+      /** データ部先頭からのオフセット */
+      UINT32 offset;
+    };
+
+    typedef struct _FontPackGlyph FontPackGlyph;
+
+    /**
+     * make_font_pack.pyでまとめたフォントファイル
+     *
+     * 起動時に1度だけ開いて全部読み込み、グリフは二分探索で引く
+     */
+    namespace FontPack {
+      #define FONT_PACK_MAGIC 0x4E464745 // "EGFN"
+      #define FONT_PACK_VERSION 1
+
+      static UINT8 bpp;
+      static UINT32 count;
+      /** codeの昇順 */
+      static FontPackGlyph *index;
+      static UINT8 *data;
+      /** 一番大きいグリフのw * h */
+      static UINT32 maxGlyphBytes;
+
+      bool load(CHAR16 *filename) {
+        UINTN size;
+        UINT8 *buf = FileSystem::readAll(filename, &size);
+        if (buf == nullptr) return false;
+        FontPackHeader *header = (FontPackHeader*)buf;
+        UINTN indexSize = size >= sizeof(FontPackHeader) ? sizeof(FontPackGlyph) * header->count : 0;
+        if (size < sizeof(FontPackHeader) || header->magic != FONT_PACK_MAGIC || header->version != FONT_PACK_VERSION ||
+          (header->bpp != 1 && header->bpp != 8) || size != sizeof(FontPackHeader) + indexSize + header->dataSize) {
+          free(buf);
+          return false;
+        }
+        bpp = header->bpp;
+        count = header->count;
+        index = (FontPackGlyph*)(buf + sizeof(FontPackHeader));
+        data = buf + sizeof(FontPackHeader) + indexSize;
+        maxGlyphBytes = 0;
+        for (UINT32 i = 0; i < count; ++i) {
+          if (maxGlyphBytes < (UINT32)index[i].w * index[i].h) maxGlyphBytes = (UINT32)index[i].w * index[i].h;
+        }
+        return true;
+      }
+
+      FontPackGlyph* find(CHAR16 c) {
+        UINT32 low = 0, high = count;
+        while (low < high) {
+          UINT32 mid = (low + high) / 2;
+          if (index[mid].code < c) {
+            low = mid + 1;
+          } else {
+            high = mid;
+          }
+        }
+        return low < count && index[low].code == c ? &index[low] : nullptr;
+      }
+
+      /** グリフのカバレッジを8bitアルファに展開する */
+      void expand(FontPackGlyph *entry, UINT8 *alphas) {
+        const UINT8 *src = data + entry->offset;
+        if (bpp == 8) {
+          memcpy(alphas, src, entry->w * entry->h);
+          return;
+        }
+        UINT32 stride = (entry->w + 7) / 8;
+        for (UINT32 dy = 0; dy < entry->h; ++dy) {
+          const UINT8 *row = src + dy * stride;
+          for (UINT32 dx = 0; dx < entry->w; ++dx) {
+            *alphas++ = (row[dx / 8] & (0x80 >> (dx % 8))) ? 255 : 0;
+          }
+        }
+      }
+    };
+
+    #define FONT_PACK_FILE_NAME L"font.pack"
+
+    /** フォントファイルがあれば読み込む 無ければfonts\<code>.pngを1文字ずつ読む */
+    auto initFont() {
+      return FontPack::load((EFI_STRING)FONT_PACK_FILE_NAME);
+    }
+
+    struct _Glyph {
+      CHAR16 code;
+      UINT16 w;
+      UINT16 h;
+      /** アトラスの中のこのグリフのセル 先頭からw * hバイトの8bitアルファ */
+      UINT8 *alphas;
+      struct _Glyph *hashNext;
+      struct _Glyph *lruPrev;
+      struct _Glyph *lruNext;
+    };
+
+    typedef struct _Glyph Glyph;
+
+    /**
+     * グリフのキャッシュ
+     *
+     * 8bitアルファのアトラス(ひとつながりのバッファ)を一番大きいグリフの大きさのセルに区切り、
+     * 初回使用時に空いたセルへアルファを詰める 空きが無ければ最近使われていないグリフのセルを使い回す
+     * セルの数はバイト数の上限から決まる 大きさをそろえたセルなので、使い回しても隙間ができない
+     */
+    namespace GlyphCache {
+      #define GLYPH_CACHE_BUCKETS 256
+      #define GLYPH_CACHE_DEFAULT_BUDGET 1024 * 1024
+      /** font.packが無いときのセルの大きさ これより大きいグリフが来たらセルを広げて作り直す */
+      #define GLYPH_CACHE_DEFAULT_CELL_BYTES 32 * 32
+      /** 大きい確保は画面バッファと同じくページ境界から始まるので、書き込み先と4Kエイリアスしないようアトラスの先頭を半ページずらす */
+      #define GLYPH_ATLAS_SKEW 2048
+
+      static Glyph *buckets[GLYPH_CACHE_BUCKETS];
+      /** 最近使ったもの */
+      static Glyph *lruHead;
+      /** 最も使っていないもの */
+      static Glyph *lruTail;
+      /** 使っていないセル hashNextでつなぐ */
+      static Glyph *freeList;
+      static UINT8 *atlas;
+      static Glyph *cells;
+      static UINT32 cellBytes;
+      static UINT32 cellCount;
+      static UINTN budget = GLYPH_CACHE_DEFAULT_BUDGET;
+      /** セルを使い回す前や作り直す前に呼ぶ 描かずにためているグリフを先に描かせる(Compositor::compose) */
+      static void (*beforeEvict)();
+      /** フォントに無い文字 セルを使わずに1文字1bitで覚え、毎回ファイルを開かないようにする */
+      static UINT8 missing[0x10000 / 8];
+
+      void unlink(Glyph *glyph) {
+        if (glyph->lruPrev) glyph->lruPrev->lruNext = glyph->lruNext; else lruHead = glyph->lruNext;
+        if (glyph->lruNext) glyph->lruNext->lruPrev = glyph->lruPrev; else lruTail = glyph->lruPrev;
+        glyph->lruPrev = glyph->lruNext = nullptr;
+      }
+
+      void pushFront(Glyph *glyph) {
+        glyph->lruPrev = nullptr;
+        glyph->lruNext = lruHead;
+        if (lruHead) lruHead->lruPrev = glyph;
+        lruHead = glyph;
+        if (!lruTail) lruTail = glyph;
+      }
+
+      /** すべてのセルを空ける */
+      void clear() {
+        memset((void*)buckets, 0, sizeof(buckets));
+        lruHead = lruTail = nullptr;
+        freeList = nullptr;
+        for (UINT32 i = cellCount; i > 0; --i) {
+          cells[i - 1].hashNext = freeList;
+          freeList = &cells[i - 1];
+        }
+      }
+
+      /**
+       * セルの大きさと上限からアトラスを作り直す 入っていたグリフはすべて捨てる
+       *
+       * 確保できなければセルの数を半分にしてやり直す 1つも取れなければセルは0になり、getはnullptrを返す
+       */
+      void rebuild(UINT32 bytes) {
+        if (atlas != nullptr && beforeEvict) beforeEvict();
+        free(atlas);
+        free(cells);
+        cellBytes = bytes;
+        cellCount = budget / (cellBytes + sizeof(Glyph));
+        if (!cellCount) cellCount = 1;
+        for (; cellCount > 0; cellCount /= 2) {
+          atlas = (UINT8*)malloc(GLYPH_ATLAS_SKEW + cellBytes * cellCount);
+          cells = (Glyph*)malloc(sizeof(Glyph) * cellCount);
+          if (atlas != nullptr && cells != nullptr) break;
+          free(atlas);
+          free(cells);
+        }
+        if (!cellCount) {
+          atlas = nullptr;
+          cells = nullptr;
+        }
+        for (UINT32 i = 0; i < cellCount; ++i) cells[i].alphas = atlas + GLYPH_ATLAS_SKEW + cellBytes * i;
+        clear();
+      }
+
+      /** キャッシュの上限バイト数を設定する */
+      void setBudget(UINTN bytes) {
+        budget = bytes;
+        if (atlas != nullptr) rebuild(cellBytes);
+      }
+
+      /** 最も使っていないグリフを捨ててセルを空ける */
+      void evict() {
+        if (beforeEvict) beforeEvict();
+        Glyph *glyph = lruTail;
+        unlink(glyph);
+        Glyph **slot = &buckets[glyph->code % GLYPH_CACHE_BUCKETS];
+        while (*slot != glyph) slot = &(*slot)->hashNext;
+        *slot = glyph->hashNext;
+        glyph->hashNext = freeList;
+        freeList = glyph;
+      }
+
+      /** w * hバイトが入る空いたセルを得る 大きすぎればセルを広げる 確保できなければnullptr */
+      Glyph* allocCell(CHAR16 c, UINT32 w, UINT32 h) {
+        if (atlas == nullptr || w * h > cellBytes) {
+          UINT32 bytes = FontPack::count ? FontPack::maxGlyphBytes : GLYPH_CACHE_DEFAULT_CELL_BYTES;
+          rebuild(w * h > bytes ? w * h : bytes);
+          if (atlas == nullptr) return nullptr;
+        }
+        if (freeList == nullptr) evict();
+        Glyph *glyph = freeList;
+        freeList = glyph->hashNext;
+        glyph->code = c;
+        glyph->w = w;
+        glyph->h = h;
+        Glyph **slot = &buckets[c % GLYPH_CACHE_BUCKETS];
+        glyph->hashNext = *slot;
+        *slot = glyph;
+        pushFront(glyph);
+        return glyph;
+      }
+
+      /** 無い文字や大きさ0の文字はmissingに記録してnullptrを返す */
+      Glyph* load(CHAR16 c) {
+        if (FontPack::count) {
+          auto entry = FontPack::find(c);
+          if (entry == nullptr || !entry->w || !entry->h) {
+            missing[c / 8] |= 1 << (c % 8);
+            return nullptr;
+          }
+          Glyph *glyph = allocCell(c, entry->w, entry->h);
+          if (glyph != nullptr) FontPack::expand(entry, glyph->alphas);
+          return glyph;
+        }
+        auto image = getFontImage(c);
+        if (image == nullptr || !image->x || !image->y) {
+          freeImage(image);
+          missing[c / 8] |= 1 << (c % 8);
+          return nullptr;
+        }
+        Glyph *glyph = allocCell(c, image->x, image->y);
+        if (glyph != nullptr) {
+          for (int i = 0; i < image->length; ++i) glyph->alphas[i] = image->pixels[i].Reserved;
+        }
+        freeImage(image);
+        return glyph;
+      }
+
+      /** グリフを得る 無い文字ならnullptrを返す */
+      Glyph* get(CHAR16 c) {
+        if (missing[c / 8] & (1 << (c % 8))) return nullptr;
+        Glyph *glyph = buckets[c % GLYPH_CACHE_BUCKETS];
+        while (glyph != nullptr && glyph->code != c) glyph = glyph->hashNext;
+        if (glyph == nullptr) return load(c);
+        if (glyph != lruHead) {
+          unlink(glyph);
+          pushFront(glyph);
+        }
+        return glyph;
+      }
+    };
+
+    /** 切り詰め済みの範囲へグリフのsx, syからを描く */
+    void blitGlyph(Glyph *glyph, const Pixel &color, INT32 x, INT32 y, INT32 w, INT32 h, INT32 sx, INT32 sy, bool transparent) {
+      INT32 dx, dy, alpha;
+      for (dy = 0; dy < h; ++dy) {
+        const UINT8 *alphas = glyph->alphas + (sy + dy) * glyph->w + sx;
+        Pixel *base_pixel = Surface::pixels + (y + dy) * HorizontalResolution + x;
+        if (!transparent) {
+          memset(base_pixel, color, w);
+          continue;
+        }
+        for (dx = 0; dx < w; ++dx, ++base_pixel) {
+          alpha = alphas[dx];
+          if (alpha == 0) continue;
+          if (alpha == 255) {
+            *base_pixel = color;
+          } else {
+            Pixel pixel = Blend::premultiply(color, alpha);
+            Blend::blendPixel(base_pixel, &pixel);
+          }
+        }
+      }
+    }
+
+    auto drawGlyph(Glyph *glyph, const Pixel &color, INT32 x, INT32 y, bool transparent = TRUE) {
+      if (glyph == nullptr) return false;
+      INT32 w = glyph->w, h = glyph->h, sx = 0, sy = 0;
+      if (!clipRect(x, y, w, h, sx, sy)) return true;
+      blitGlyph(glyph, color, x, y, w, h, sx, sy, transparent);
+      Surface::markDirty(x, y, w, h);
+      return true;
+    }
+
+    auto drawChar(CHAR16 c, INT32 x, INT32 y, bool transparent = TRUE) {
+      Pixel black {0, 0, 0, 0};
+      return drawGlyph(GlyphCache::get(c), black, x, y, transparent);
+    }
+
+    struct _DrawStrInfo {
+      INT32 dx;
+      INT32 dy;
+      INT32 w;
+      INT32 h;
+      INT32 lines;
+    };
+
+    typedef struct _DrawStrInfo DrawStrInfo;
+
+    struct _LayoutGlyph {
+      CHAR16 code;
+      /** 文字列の左上からの位置 */
+      INT32 dx;
+      INT32 dy;
+      INT32 w;
+      INT32 h;
+    };
+
+    typedef struct _LayoutGlyph LayoutGlyph;
+
+    struct _LayoutLine {
+      /** 行の最初のグリフの番号 */
+      UINT32 start;
+      UINT32 count;
+      INT32 dy;
+      INT32 w;
+      INT32 h;
+    };
+
+    typedef struct _LayoutLine LayoutLine;
+
+    /** 並べ終えた文字列 描くときはグリフの位置をそのまま使う */
+    struct _TextLayout {
+      /** 並べた文字列の写し LayoutCacheのキー */
+      CHAR16 *str;
+      UINT32 hash;
+      INT32 width;
+      LayoutGlyph *glyphs;
+      UINT32 glyphCount;
+      LayoutLine *lines;
+      UINT32 lineCount;
+      /** 全体を囲む範囲と最後のグリフの後ろの位置 */
+      DrawStrInfo info;
+      /** LayoutCacheで最後に使った順番 */
+      UINT64 lastUsed;
+    };
+
+    typedef struct _TextLayout TextLayout;
+
+    /** 行頭に来てはいけない文字 */
+    static const CHAR16 *noLineStartChars = (const CHAR16*)L"、。，．・：；？！ー）」』】〕〉》｝］ぁぃぅぇぉっゃゅょゎァィゥェォッャュョヮヵヶ々ゝゞヽヾ～…‥,.:;!?)]}";
+    /** 行末に来てはいけない文字 */
+    static const CHAR16 *noLineEndChars = (const CHAR16*)L"（「『【〔〈《｛［([{";
+    /** 行頭に来るときは幅からはみ出させて前の行に残す(ぶら下げ) */
+    static const CHAR16 *hangingChars = (const CHAR16*)L"、。，．,.";
+
+    auto containsChar(const CHAR16 *chars, CHAR16 c) {
+      for (; *chars; ++chars) {
+        if (*chars == c) return true;
+      }
+      return false;
+    }
+
+    /** glyphs[index]の前で改行できるか index == countなら次に置くnextの前 */
+    auto canBreakBefore(const LayoutGlyph *glyphs, UINT32 index, UINT32 count, CHAR16 next) {
+      CHAR16 c = index == count ? next : glyphs[index].code;
+      return !containsChar(noLineStartChars, c) && !containsChar(noLineEndChars, glyphs[index - 1].code);
+    }
+
+    /** [start, end)のグリフを1行にまとめる */
+    void closeLine(TextLayout *layout, UINT32 start, UINT32 end, INT32 dy) {
+      LayoutLine &line = layout->lines[layout->lineCount++];
+      line.start = start;
+      line.count = end - start;
+      line.dy = dy;
+      line.w = 0;
+      line.h = 0;
+      for (UINT32 i = start; i < end; ++i) {
+        const LayoutGlyph &glyph = layout->glyphs[i];
+        if (line.w < glyph.dx + glyph.w) line.w = glyph.dx + glyph.w;
+        if (line.h < glyph.h) line.h = glyph.h;
+      }
+    }
+
+    /**
+     * 文字列を並べる widthが0でなければその幅で折り返す
+     *
+     * 折り返すときは禁則を守る 行頭禁則の文字と行末禁則の文字を挟まない所まで戻って前の行から追い出し、
+     * 句読点はぶら下げる 戻れる所が無ければ幅で切る
+     * \rは行頭へ戻り、\nは改行する 空の行の高さは0
+     */
+    void layoutText(TextLayout *layout, CHAR16 *str, INT32 width) {
+      PROFILE_ZONE(ZoneLayoutText);
+      UINTN length = strlen(str);
+      layout->width = width;
+      layout->glyphs = (LayoutGlyph*)malloc(sizeof(LayoutGlyph) * (length ? length : 1));
+      layout->glyphCount = 0;
+      layout->lines = (LayoutLine*)malloc(sizeof(LayoutLine) * (length + 1));
+      layout->lineCount = 0;
+      LayoutGlyph *glyphs = layout->glyphs;
+      UINT32 count = 0, lineStart = 0;
+      INT32 dx = 0, dy = 0;
+      for (UINTN i = 0; i < length; ++i) {
+        CHAR16 c = str[i];
+        if (c == L'\r') {
+          dx = 0;
+          continue;
+        } else if (c == L'\n') {
+          closeLine(layout, lineStart, count, dy);
+          dy += layout->lines[layout->lineCount - 1].h;
+          lineStart = count;
+          dx = 0;
+          continue;
+        }
+        auto glyph = GlyphCache::get(c);
+        if (glyph == nullptr) continue;
+        if (width && count > lineStart && width < dx + glyph->w && !containsChar(hangingChars, c)) {
+          UINT32 at = count;
+          while (at > lineStart + 1 && !canBreakBefore(glyphs, at, count, c)) --at;
+          if (!canBreakBefore(glyphs, at, count, c)) at = count;
+          closeLine(layout, lineStart, at, dy);
+          dy += layout->lines[layout->lineCount - 1].h;
+          lineStart = at;
+          // 追い出したグリフを次の行の頭へ移す
+          dx = 0;
+          for (UINT32 j = at; j < count; ++j) {
+            glyphs[j].dx = dx;
+            glyphs[j].dy = dy;
+            dx += glyphs[j].w;
+          }
+        }
+        glyphs[count++] = LayoutGlyph {c, dx, dy, glyph->w, glyph->h};
+        dx += glyph->w;
+      }
+      closeLine(layout, lineStart, count, dy);
+      layout->glyphCount = count;
+      DrawStrInfo &info = layout->info;
+      info.dx = dx;
+      info.dy = dy;
+      info.w = 0;
+      for (UINT32 i = 0; i < layout->lineCount; ++i) {
+        if (info.w < layout->lines[i].w) info.w = layout->lines[i].w;
+      }
+      info.h = dy + layout->lines[layout->lineCount - 1].h;
+      info.lines = layout->lineCount;
+    }
+
+    /**
+     * 並べた文字列のキャッシュ
+     *
+     * 文字列と幅が同じなら前に並べた結果を返すので、同じ文章を描き直すときや
+     * 先に並べておいた文章を出すときはグリフの大きさを調べ直さない
+     * 返したTextLayoutは次にgetを呼ぶまで使える
+     */
+    namespace LayoutCache {
+      #define LAYOUT_CACHE_SIZE 16
+
+      static TextLayout entries[LAYOUT_CACHE_SIZE];
+      static UINT64 clock;
+
+      UINT32 hashStr(const CHAR16 *str) {
+        UINT32 hash = 2166136261u;
+        for (; *str; ++str) hash = (hash ^ *str) * 16777619u;
+        return hash;
+      }
+
+      void release(TextLayout *layout) {
+        if (layout->str == nullptr) return;
+        free(layout->str);
+        free(layout->glyphs);
+        free(layout->lines);
+        layout->str = nullptr;
+      }
+
+      /** フォントを替えたときなど、グリフの大きさが変わったら捨てる */
+      void clear() {
+        for (UINT32 i = 0; i < LAYOUT_CACHE_SIZE; ++i) release(entries + i);
+      }
+
+      TextLayout* get(CHAR16 *str, INT32 width = 0) {
+        UINT32 hash = hashStr(str);
+        TextLayout *victim = entries;
+        for (UINT32 i = 0; i < LAYOUT_CACHE_SIZE; ++i) {
+          TextLayout *layout = entries + i;
+          if (layout->str != nullptr && layout->hash == hash && layout->width == width && !strcmp(layout->str, str)) {
+            layout->lastUsed = ++clock;
+            return layout;
+          }
+          // 空いている所、無ければ一番長く使っていないものを使う
+          if (victim->str != nullptr && (layout->str == nullptr || layout->lastUsed < victim->lastUsed)) victim = layout;
+        }
+        release(victim);
+        layoutText(victim, str, width);
+        victim->str = (CHAR16*)malloc(sizeof(CHAR16) * (strlen(str) + 1));
+        strcpy(victim->str, str);
+        victim->hash = hash;
+        victim->lastUsed = ++clock;
+        return victim;
+      }
+    };
+
+    /** 並べた文字列を描く 描き直す範囲は全体を囲む1つの矩形にまとめる */
+    void drawLayout(const TextLayout *layout, const Pixel &color, INT32 x, INT32 y, bool transparent = TRUE) {
+      for (UINT32 i = 0; i < layout->glyphCount; ++i) {
+        const LayoutGlyph &item = layout->glyphs[i];
+        Glyph *glyph = GlyphCache::get(item.code);
+        if (glyph == nullptr) continue;
+        INT32 gx = x + item.dx, gy = y + item.dy, w = glyph->w, h = glyph->h, sx = 0, sy = 0;
+        if (!clipRect(gx, gy, w, h, sx, sy)) continue;
+        blitGlyph(glyph, color, gx, gy, w, h, sx, sy, transparent);
+      }
+      INT32 w = layout->info.w, h = layout->info.h, sx = 0, sy = 0;
+      if (clipRect(x, y, w, h, sx, sy)) Surface::markDirty(x, y, w, h);
+    }
+
+    auto drawStr(CHAR16 *str, Pixel color, INT32 x, INT32 y, INT32 width = 0, bool transparent = TRUE, DrawStrInfo *info = nullptr) {
+      PROFILE_ZONE(ZoneDrawStr);
+      TextLayout *layout = LayoutCache::get(str, width);
+      drawLayout(layout, color, x, y, transparent);
+      if (info != nullptr) *info = layout->info;
+      return info;
+    }
+
+    /**
+     * 画面をタイルに分けて描く合成器
+     *
+     * fillRectとdrawImageをためておき、composeでタイルごとに関係する命令を振り分けてから
+     * タイルの行をBSPとAP(Workers)で取り合って描く APが無ければBSPだけで描く
+     * タイル全体を不透明に覆う命令があれば、そのタイルではそれより前の命令を描かない
+     * setClipで描く範囲を絞れる
+     */
+    namespace Compositor {
+      #define COMPOSITOR_TILE_WIDTH 256
+      #define COMPOSITOR_TILE_HEIGHT 32
+      #define COMPOSITOR_MAX_COMMANDS 256
+
+      enum CommandType {
+        CommandFill,
+        CommandImage,
+        CommandGlyph,
+      };
+
+      struct _Command {
+        CommandType type;
+        /** 画面内に切り詰めた描画先 */
+        INT32 x;
+        INT32 y;
+        INT32 w;
+        INT32 h;
+        /** 描画元の開始位置 */
+        INT32 sx;
+        INT32 sy;
+        Pixel color;
+        Image *image;
+        bool transparent;
+        Glyph *glyph;
+      };
+
+      typedef struct _Command Command;
+
+      static Command commands[COMPOSITOR_MAX_COMMANDS];
+      static UINT32 commandCount;
+      static UINT32 tilesX;
+      static UINT32 tilesY;
+      /** タイルごとに描く命令の番号 1タイルにCOMPOSITOR_MAX_COMMANDS個ずつ */
+      static UINT16 *bins;
+      static UINT16 *binCounts;
+      /** 上位32bitがタイルの行数、下位32bitが次に描く行 描く側はこれを1ずつ進めて行を取る */
+      static UINT64 work;
+      /** 描き終えたタイルの行数 */
+      static UINT32 doneRows;
+      /** 積んだがまだAPが取りかかっていないrasterizeRowsの数 */
+      static UINT32 queuedRasterizers;
+      /** 描く範囲 右端と下端は含まない clipEnabledがfalseなら画面全体 */
+      static INT32 clipX0;
+      static INT32 clipY0;
+      static INT32 clipX1;
+      static INT32 clipY1;
+      static bool clipEnabled;
+
+      void compose();
+
+      void record(const Command &command) {
+        if (commandCount == COMPOSITOR_MAX_COMMANDS) compose();
+        commands[commandCount++] = command;
+      }
+
+      void setClip(INT32 x, INT32 y, INT32 w, INT32 h) {
+        clipX0 = x;
+        clipY0 = y;
+        clipX1 = x + w;
+        clipY1 = y + h;
+        clipEnabled = true;
+      }
+
+      void resetClip() {
+        clipEnabled = false;
+      }
+
+      /** 画面と描く範囲に切り詰める 切り詰めた分だけsx, syを進める */
+      auto clip(INT32 &x, INT32 &y, INT32 &w, INT32 &h, INT32 &sx, INT32 &sy) {
+        if (!clipRect(x, y, w, h, sx, sy)) return false;
+        if (!clipEnabled) return true;
+        if (x < clipX0) {
+          sx += clipX0 - x;
+          w -= clipX0 - x;
+          x = clipX0;
+        }
+        if (y < clipY0) {
+          sy += clipY0 - y;
+          h -= clipY0 - y;
+          y = clipY0;
+        }
+        if (x + w > clipX1) w = clipX1 - x;
+        if (y + h > clipY1) h = clipY1 - y;
+        return w > 0 && h > 0;
+      }
+
+      void fillRect(INT32 x, INT32 y, UINT32 w, UINT32 h, const Pixel &color) {
+        INT32 cw = w, ch = h, sx = 0, sy = 0;
+        if (!clip(x, y, cw, ch, sx, sy)) return;
+        record(Command {CommandFill, x, y, cw, ch, 0, 0, color, nullptr, false, nullptr});
+      }
+
+      void drawImage(Image *image, INT32 x, INT32 y, bool transparent = TRUE) {
+        if (image == nullptr) return;
+        INT32 w = image->x, h = image->y, sx = 0, sy = 0;
+        if (!clip(x, y, w, h, sx, sy)) return;
+        Pixel none {0, 0, 0, 0};
+        record(Command {CommandImage, x, y, w, h, sx, sy, none, image, transparent, nullptr});
+      }
+
+      /** グリフはセルを指したままためる セルが使い回される前にGlyphCacheがcomposeを呼ぶ */
+      void drawGlyph(Glyph *glyph, const Pixel &color, INT32 x, INT32 y) {
+        if (glyph == nullptr) return;
+        INT32 w = glyph->w, h = glyph->h, sx = 0, sy = 0;
+        if (!clip(x, y, w, h, sx, sy)) return;
+        record(Command {CommandGlyph, x, y, w, h, sx, sy, color, nullptr, true, glyph});
+      }
+
+      /** 解像度にあわせて振り分け先を用意する */
+      void ensureBins() {
+        UINT32 x = (HorizontalResolution + COMPOSITOR_TILE_WIDTH - 1) / COMPOSITOR_TILE_WIDTH;
+        UINT32 y = (VerticalResolution + COMPOSITOR_TILE_HEIGHT - 1) / COMPOSITOR_TILE_HEIGHT;
+        if (bins != nullptr && x == tilesX && y == tilesY) return;
+        free(bins);
+        free(binCounts);
+        tilesX = x;
+        tilesY = y;
+        bins = (UINT16*)malloc(sizeof(UINT16) * tilesX * tilesY * COMPOSITOR_MAX_COMMANDS);
+        binCounts = (UINT16*)malloc(sizeof(UINT16) * tilesX * tilesY);
+      }
+
+      /** 命令がタイル全体を不透明に覆うか */
+      auto covers(const Command &command, INT32 x0, INT32 y0, INT32 x1, INT32 y1) {
+        if (command.transparent) return false;
+        return command.x <= x0 && command.y <= y0 && command.x + command.w >= x1 && command.y + command.h >= y1;
+      }
+
+      void rasterizeTile(UINT32 tile) {
+        INT32 x0 = tile % tilesX * COMPOSITOR_TILE_WIDTH;
+        INT32 y0 = tile / tilesX * COMPOSITOR_TILE_HEIGHT;
+        INT32 x1 = x0 + COMPOSITOR_TILE_WIDTH < (INT32)HorizontalResolution ? x0 + COMPOSITOR_TILE_WIDTH : HorizontalResolution;
+        INT32 y1 = y0 + COMPOSITOR_TILE_HEIGHT < (INT32)VerticalResolution ? y0 + COMPOSITOR_TILE_HEIGHT : VerticalResolution;
+        UINT16 *bin = bins + tile * COMPOSITOR_MAX_COMMANDS;
+        for (UINT32 i = 0; i < binCounts[tile]; ++i) {
+          const Command &command = commands[bin[i]];
+          INT32 x = command.x > x0 ? command.x : x0;
+          INT32 y = command.y > y0 ? command.y : y0;
+          INT32 w = (command.x + command.w < x1 ? command.x + command.w : x1) - x;
+          INT32 h = (command.y + command.h < y1 ? command.y + command.h : y1) - y;
+          switch (command.type) {
+            case CommandFill:
+              fillRows(x, y, w, h, command.color);
+              break;
+            case CommandImage:
+              blitImage(command.image, x, y, w, h, command.sx + x - command.x, command.sy + y - command.y, command.transparent);
+              break;
+            case CommandGlyph:
+              blitGlyph(command.glyph, command.color, x, y, w, h, command.sx + x - command.x, command.sy + y - command.y, true);
+              break;
+          }
+        }
+      }
+
+      /** BSPでもAPでも、タイルの行が残っている間描き続ける */
+      void rasterizeRows(Workers::Worker *worker, void *) {
+        if (worker != nullptr) __atomic_sub_fetch(&queuedRasterizers, 1, __ATOMIC_RELAXED);
+        while (TRUE) {
+          UINT64 claimed = __atomic_fetch_add(&work, 1, __ATOMIC_ACQ_REL);
+          UINT32 row = (UINT32)claimed;
+          if (row >= claimed >> 32) return;
+          for (UINT32 tx = 0; tx < tilesX; ++tx) rasterizeTile(row * tilesX + tx);
+          __atomic_add_fetch(&doneRows, 1, __ATOMIC_RELEASE);
+        }
+      }
+
+      /**
+       * ためた命令を描いて書き換えた範囲を記録する
+       *
+       * APに渡した分が前のフレームの後で動き出しても、workの行が尽きていればすぐ戻る
+       * APがデコードで埋まっていても列を溢れさせないよう、取りかかられていない分と合わせてworkerCountまでしか積まない
+       */
+      void compose() {
+        if (!commandCount) return;
+        PROFILE_ZONE(ZoneCompose);
+        ensureBins();
+        memset(binCounts, 0, sizeof(UINT16) * tilesX * tilesY);
+        for (UINT32 i = 0; i < commandCount; ++i) {
+          const Command &command = commands[i];
+          UINT32 tx0 = command.x / COMPOSITOR_TILE_WIDTH, tx1 = (command.x + command.w - 1) / COMPOSITOR_TILE_WIDTH;
+          UINT32 ty0 = command.y / COMPOSITOR_TILE_HEIGHT, ty1 = (command.y + command.h - 1) / COMPOSITOR_TILE_HEIGHT;
+          for (UINT32 ty = ty0; ty <= ty1; ++ty) {
+            for (UINT32 tx = tx0; tx <= tx1; ++tx) {
+              UINT32 tile = ty * tilesX + tx;
+              INT32 x0 = tx * COMPOSITOR_TILE_WIDTH, y0 = ty * COMPOSITOR_TILE_HEIGHT;
+              INT32 x1 = x0 + COMPOSITOR_TILE_WIDTH < (INT32)HorizontalResolution ? x0 + COMPOSITOR_TILE_WIDTH : HorizontalResolution;
+              INT32 y1 = y0 + COMPOSITOR_TILE_HEIGHT < (INT32)VerticalResolution ? y0 + COMPOSITOR_TILE_HEIGHT : VerticalResolution;
+              if (covers(command, x0, y0, x1, y1)) binCounts[tile] = 0;
+              bins[tile * COMPOSITOR_MAX_COMMANDS + binCounts[tile]++] = i;
+            }
+          }
+          Surface::markDirty(command.x, command.y, command.w, command.h);
+        }
+        doneRows = 0;
+        __atomic_store_n(&work, (UINT64)tilesY << 32, __ATOMIC_RELEASE);
+        UINT32 helpers = Workers::workerCount < tilesY - 1 ? Workers::workerCount : tilesY - 1;
+        while (__atomic_load_n(&queuedRasterizers, __ATOMIC_RELAXED) < helpers) {
+          __atomic_add_fetch(&queuedRasterizers, 1, __ATOMIC_RELAXED);
+          if (Workers::submit(rasterizeRows, nullptr)) continue;
+          __atomic_sub_fetch(&queuedRasterizers, 1, __ATOMIC_RELAXED);
+          break;
+        }
+        rasterizeRows(nullptr, nullptr);
+        while (__atomic_load_n(&doneRows, __ATOMIC_ACQUIRE) < tilesY) __builtin_ia32_pause();
+        commandCount = 0;
+      }
+    };
+
+    /**
+     * 画面に残しておく描画内容の一覧
+     *
+     * 画像・矩形・文字列のノードをzの順に持ち、変わったノードの前と後の範囲だけを
+     * renderで描き直す 描き直す範囲に重なるノードは下から順にCompositorで重ねる
+     * 文字列はグリフごとに前と比べ、変わった文字の範囲だけを描き直す
+     * 文字送りでは先頭から見せるグリフの数だけを増やし、増えたグリフの範囲だけを描く
+     */
+    namespace DisplayList {
+      #define DISPLAY_LIST_MAX_NODES 64
+      #define DISPLAY_LIST_MAX_DAMAGE 32
+      #define TEXT_NODE_MAX_GLYPHS 256
+
+      enum NodeType {
+        NodeImage,
+        NodeRect,
+        NodeText,
+      };
+
+      struct _TextGlyph {
+        CHAR16 code;
+        /** 画面上の位置 */
+        INT32 x;
+        INT32 y;
+        INT32 w;
+        INT32 h;
+      };
+
+      typedef struct _TextGlyph TextGlyph;
+
+      struct _Node {
+        NodeType type;
+        INT32 z;
+        bool used;
+        bool visible;
+        /** 画面上の範囲 文字列ならグリフ全体を囲む範囲 */
+        INT32 x;
+        INT32 y;
+        INT32 w;
+        INT32 h;
+        Image *image;
+        bool transparent;
+        Pixel color;
+        /** 文字列のグリフ TEXT_NODE_MAX_GLYPHS個分を初めてsetTextしたときに確保する */
+        TextGlyph *glyphs;
+        UINT32 glyphCount;
+        /** 先頭から何個のグリフを見せるか TEXT_NODE_MAX_GLYPHSならすべて */
+        UINT32 revealed;
+      };
+
+      typedef struct _Node Node;
+
+      static Node nodes[DISPLAY_LIST_MAX_NODES];
+      /** zの小さい順 同じzなら足した順 */
+      static Node *order[DISPLAY_LIST_MAX_NODES];
+      static UINT32 nodeCount;
+      static Surface::DirtyRect damage[DISPLAY_LIST_MAX_DAMAGE];
+      static UINT32 damageCount;
+      static TextGlyph layout[TEXT_NODE_MAX_GLYPHS];
+
+      auto samePixel(const Pixel &a, const Pixel &b) {
+        return a.Blue == b.Blue && a.Green == b.Green && a.Red == b.Red && a.Reserved == b.Reserved;
+      }
+
+      /** 重なるか 接しているだけならまとめずに済むのでfalse */
+      auto overlaps(const Surface::DirtyRect &a, const Surface::DirtyRect &b) {
+        return a.x0 < b.x1 && b.x0 < a.x1 && a.y0 < b.y1 && b.y0 < a.y1;
+      }
+
+      /** 描き直す範囲を足す 重なる範囲はひとつにまとめる */
+      void addDamage(INT32 x, INT32 y, INT32 w, INT32 h) {
+        Surface::DirtyRect rect {x, y, x + w, y + h};
+        if (rect.x0 < 0) rect.x0 = 0;
+        if (rect.y0 < 0) rect.y0 = 0;
+        if (rect.x1 > (INT32)HorizontalResolution) rect.x1 = HorizontalResolution;
+        if (rect.y1 > (INT32)VerticalResolution) rect.y1 = VerticalResolution;
+        if (rect.x0 >= rect.x1 || rect.y0 >= rect.y1) return;
+        while (TRUE) {
+          UINT32 i;
+          for (i = 0; i < damageCount; ++i) {
+            if (overlaps(damage[i], rect)) break;
+          }
+          if (i == damageCount) {
+            if (damageCount < DISPLAY_LIST_MAX_DAMAGE) break;
+            INT64 minGrowth = -1;
+            for (UINT32 j = 0; j < damageCount; ++j) {
+              INT64 growth = Surface::area(Surface::unite(damage[j], rect)) - Surface::area(damage[j]);
+              if (minGrowth < 0 || growth < minGrowth) {
+                minGrowth = growth;
+                i = j;
+              }
+            }
+          }
+          rect = Surface::unite(damage[i], rect);
+          damage[i] = damage[--damageCount];
+        }
+        damage[damageCount++] = rect;
+      }
+
+      /** 見せているグリフの数 */
+      auto shownGlyphs(const Node *node) {
+        return node->revealed < node->glyphCount ? node->revealed : node->glyphCount;
+      }
+
+      /** ノードが今覆っている範囲を描き直す 文字列は見せているグリフごと */
+      void damageNode(Node *node) {
+        if (!node->visible) return;
+        if (node->type != NodeText) {
+          addDamage(node->x, node->y, node->w, node->h);
+          return;
+        }
+        for (UINT32 i = 0; i < shownGlyphs(node); ++i) {
+          const TextGlyph &glyph = node->glyphs[i];
+          addDamage(glyph.x, glyph.y, glyph.w, glyph.h);
+        }
+      }
+
+      /** 空のノードを足す 見えるようにするにはset*で中身を入れる */
+      Node* add(NodeType type, INT32 z) {
+        if (nodeCount == DISPLAY_LIST_MAX_NODES) return nullptr;
+        Node *node = nodes;
+        while (node->used) ++node;
+        TextGlyph *glyphs = node->glyphs;
+        *node = Node {};
+        node->type = type;
+        node->z = z;
+        node->used = true;
+        node->visible = true;
+        node->transparent = true;
+        node->glyphs = glyphs;
+        node->revealed = TEXT_NODE_MAX_GLYPHS;
+        UINT32 i = nodeCount;
+        while (i > 0 && order[i - 1]->z > z) {
+          order[i] = order[i - 1];
+          --i;
+        }
+        order[i] = node;
+        ++nodeCount;
+        return node;
+      }
+
+      void remove(Node *node) {
+        damageNode(node);
+        UINT32 i = 0;
+        while (order[i] != node) ++i;
+        for (--nodeCount; i < nodeCount; ++i) order[i] = order[i + 1];
+        node->used = false;
+      }
+
+      /** すべてのノードを捨てる 画面はそのまま */
+      void clear() {
+        for (UINT32 i = 0; i < nodeCount; ++i) order[i]->used = false;
+        nodeCount = 0;
+        damageCount = 0;
+      }
+
+      void setVisible(Node *node, bool visible) {
+        if (node->visible == visible) return;
+        if (visible) {
+          node->visible = visible;
+          damageNode(node);
+        } else {
+          damageNode(node);
+          node->visible = visible;
+        }
+      }
+
+      /** imageがnullptrなら何も描かない */
+      void setImage(Node *node, Image *image, INT32 x, INT32 y, bool transparent = TRUE) {
+        if (node->image == image && node->x == x && node->y == y && node->transparent == transparent) return;
+        damageNode(node);
+        node->image = image;
+        node->x = x;
+        node->y = y;
+        node->w = image != nullptr ? image->x : 0;
+        node->h = image != nullptr ? image->y : 0;
+        node->transparent = transparent;
+        damageNode(node);
+      }
+
+      void setRect(Node *node, INT32 x, INT32 y, INT32 w, INT32 h, const Pixel &color) {
+        if (node->x == x && node->y == y && node->w == w && node->h == h && samePixel(node->color, color)) return;
+        damageNode(node);
+        node->x = x;
+        node->y = y;
+        node->w = w;
+        node->h = h;
+        node->color = color;
+        node->transparent = false;
+        damageNode(node);
+      }
+
+      /**
+       * 文字列を並べ直す widthが0でなければその幅で折り返す
+       *
+       * 並べ方はLayoutCacheから取る 同じ位置に同じ文字が並んでいるグリフは描き直さない
+       * 見せるグリフの数はそのままなので、文字送りするなら先にrevealTextで0にしておく
+       */
+      void setText(Node *node, CHAR16 *str, const Pixel &color, INT32 x, INT32 y, INT32 width = 0) {
+        TextLayout *text = LayoutCache::get(str, width);
+        UINT32 count = text->glyphCount < TEXT_NODE_MAX_GLYPHS ? text->glyphCount : TEXT_NODE_MAX_GLYPHS;
+        for (UINT32 i = 0; i < count; ++i) {
+          const LayoutGlyph &glyph = text->glyphs[i];
+          layout[i] = TextGlyph {glyph.code, x + glyph.dx, y + glyph.dy, glyph.w, glyph.h};
+        }
+        if (node->glyphs == nullptr) node->glyphs = (TextGlyph*)malloc(sizeof(TextGlyph) * TEXT_NODE_MAX_GLYPHS);
+        if (!samePixel(node->color, color)) {
+          damageNode(node);
+          node->glyphCount = 0;
+        }
+        if (node->visible) {
+          // 前と後で同じ番号のグリフを比べ、違えば両方の範囲を描き直す
+          UINT32 shownOld = shownGlyphs(node);
+          UINT32 shownNew = node->revealed < count ? node->revealed : count;
+          UINT32 n = shownNew > shownOld ? shownNew : shownOld;
+          for (UINT32 i = 0; i < n; ++i) {
+            bool hasOld = i < shownOld, hasNew = i < shownNew;
+            if (hasOld && hasNew) {
+              const TextGlyph &a = node->glyphs[i], &b = layout[i];
+              if (a.code == b.code && a.x == b.x && a.y == b.y) continue;
+            }
+            if (hasOld) addDamage(node->glyphs[i].x, node->glyphs[i].y, node->glyphs[i].w, node->glyphs[i].h);
+            if (hasNew) addDamage(layout[i].x, layout[i].y, layout[i].w, layout[i].h);
+          }
+        }
+        memcpy(node->glyphs, layout, count);
+        node->glyphCount = count;
+        node->color = color;
+        INT32 x0 = x, y0 = y, x1 = x, y1 = y;
+        for (UINT32 i = 0; i < count; ++i) {
+          const TextGlyph &glyph = layout[i];
+          if (i == 0 || glyph.x < x0) x0 = glyph.x;
+          if (i == 0 || glyph.y < y0) y0 = glyph.y;
+          if (i == 0 || glyph.x + glyph.w > x1) x1 = glyph.x + glyph.w;
+          if (i == 0 || glyph.y + glyph.h > y1) y1 = glyph.y + glyph.h;
+        }
+        node->x = x0;
+        node->y = y0;
+        node->w = x1 - x0;
+        node->h = y1 - y0;
+      }
+
+      /**
+       * 文字列ノードの先頭count個のグリフだけを見せる
+       *
+       * 前と比べて出した(消した)グリフの範囲だけを描き直すので、文字送りの1回は
+       * 増えた文字の数だけの手間で済む TEXT_NODE_MAX_GLYPHSならすべて見せる
+       */
+      void revealText(Node *node, UINT32 count) {
+        if (count > TEXT_NODE_MAX_GLYPHS) count = TEXT_NODE_MAX_GLYPHS;
+        UINT32 before = shownGlyphs(node);
+        node->revealed = count;
+        UINT32 after = shownGlyphs(node);
+        if (!node->visible) return;
+        UINT32 from = before < after ? before : after;
+        UINT32 to = before < after ? after : before;
+        for (UINT32 i = from; i < to; ++i) {
+          const TextGlyph &glyph = node->glyphs[i];
+          addDamage(glyph.x, glyph.y, glyph.w, glyph.h);
+        }
+      }
+
+      /** ノードを範囲に切り詰めてCompositorにためる */
+      void recordNode(const Node *node, const Surface::DirtyRect &rect) {
+        switch (node->type) {
+          case NodeImage:
+            Compositor::drawImage(node->image, node->x, node->y, node->transparent);
+            break;
+          case NodeRect:
+            Compositor::fillRect(node->x, node->y, node->w, node->h, node->color);
+            break;
+          case NodeText:
+            for (UINT32 i = 0; i < shownGlyphs(node); ++i) {
+              const TextGlyph &glyph = node->glyphs[i];
+              if (glyph.x >= rect.x1 || glyph.x + glyph.w <= rect.x0 || glyph.y >= rect.y1 || glyph.y + glyph.h <= rect.y0) continue;
+              Compositor::drawGlyph(GlyphCache::get(glyph.code), node->color, glyph.x, glyph.y);
+            }
+            break;
+        }
+      }
 
-      UINT8* src_pixels = stbi_load_from_memory(buf, len, &image->x, &image->y, &image->composition, 4);
-      int length = image->length = image->x * image->y;
-      image->pixels = (Pixel*)malloc(sizeof(Pixel) * length);
-      image->alphas = (UINT8*)malloc(sizeof(UINT8) * length);
-      Pixel *pixel = image->pixels;
-      UINT8 *alpha = image->alphas;
-      int offset;
-      for (int pos = 0; pos < length; ++pos) {
-        pixel->Red = *(src_pixels + offset);
-        pixel->Green = *(src_pixels + offset + 1);
-        pixel->Blue = *(src_pixels + offset + 2);
-        pixel->Reserved = 0;
-        *alpha = *(src_pixels + offset + 3);
-        offset += 4;
-        ++pixel;
-        ++alpha;
+      /** 描き直す範囲ごとに、重なるノードを下から重ねて描く */
+      void render() {
+        for (UINT32 i = 0; i < damageCount; ++i) {
+          const Surface::DirtyRect &rect = damage[i];
+          Compositor::setClip(rect.x0, rect.y0, rect.x1 - rect.x0, rect.y1 - rect.y0);
+          for (UINT32 j = 0; j < nodeCount; ++j) {
+            const Node *node = order[j];
+            if (!node->visible || !node->w || !node->h) continue;
+            if (node->type == NodeImage && node->image == nullptr) continue;
+            if (node->x >= rect.x1 || node->x + node->w <= rect.x0 || node->y >= rect.y1 || node->y + node->h <= rect.y0) continue;
+            recordNode(node, rect);
+          }
+        }
+        Compositor::resetClip();
+        Compositor::compose();
+        damageCount = 0;
       }
-      stbi_image_free(src_pixels);
-      return image;
-    }
+    };
 
-    #define MAX_IMAGE_FILE_SIZE 1024 * 1024 * 20
+    /**
+     * 一番上に重ねるマウスカーソル
+     *
+     * バックバッファには描いたままにせず、転送の直前に下の内容を退避してから描き、
+     * 転送が終わったらrestoreで戻す 画面から読み戻すことはない
+     * 位置はフレームごとにInput::mouseから取るので、何度動いても描くのは1回
+     */
+    namespace Cursor {
+      static Image *image;
+      /** 退避した下の内容 カーソル画像と同じ大きさ */
+      static Pixel *saveUnder;
+      /** 今のフレームで描いた範囲 wが0なら描いていない */
+      static INT32 drawnX;
+      static INT32 drawnY;
+      static INT32 drawnW;
+      static INT32 drawnH;
+      /** 前のフレームで描いた範囲 */
+      static INT32 lastX;
+      static INT32 lastY;
+      static INT32 lastW;
+      static INT32 lastH;
 
-    Image* loadImageFromFile(CHAR16 *filename, UINTN maxFileSize = MAX_IMAGE_FILE_SIZE) {
-      auto file = FileSystem::open(filename);
-      if (file == nullptr) return nullptr;
-      UINT8 *buf = (UINT8*)malloc(sizeof(UINT8) * maxFileSize);
-      auto size = FileSystem::read(file, buf, maxFileSize);
-      FileSystem::close(file);
-      auto image = loadImageFromMemory(buf, size);
-      free(buf);
-      return image;
-    }
+      /** nullptrなら出さない */
+      void setImage(Image *cursor) {
+        image = cursor;
+        free(saveUnder);
+        saveUnder = image != nullptr ? (Pixel*)malloc(sizeof(Pixel) * image->x * image->y) : nullptr;
+      }
 
-    auto drawImage(Image *image, INT32 x, INT32 y, bool transparent = TRUE) {
-      if (image == nullptr) return false;
-      Pixel* base = (Pixel *)GraphicsOutputProtocol->Mode->FrameBufferBase;
-      Pixel* pixels, *image_pixel, *base_pixel;
-      if (transparent) {
-        pixels = (Pixel*)malloc(sizeof(Pixel) * image->length);
-        memcpy(pixels, image->pixels, image->length);
-        INT32 dx, dy, image_offset, image_yoffset, base_offset, base_yoffset, alpha;
-        double alpha1;
-        for (dy = 0; dy < image->y; ++dy) {
-          image_yoffset = dy * image->x;
-          base_yoffset = (y + dy) * HorizontalResolution;
-          for (dx = 0; dx < image->x; ++dx) {
-            image_offset = image_yoffset + dx;
-            alpha = image->alphas[image_offset];
-            if (alpha != 255) {
-              base_offset = base_yoffset + x + dx;
-              if (alpha == 0) {
-                pixels[image_offset] = base[base_offset];
-              } else {
-                alpha1 = alpha / 255.0;
-                image_pixel = &pixels[image_offset];
-                base_pixel = &base[base_offset];
-                image_pixel->Red = (image_pixel->Red * alpha1) + base_pixel->Red * (1.0 - alpha1);
-                image_pixel->Green = (image_pixel->Green * alpha1) + base_pixel->Green * (1.0 - alpha1);
-                image_pixel->Blue = (image_pixel->Blue * alpha1) + base_pixel->Blue * (1.0 - alpha1);
-              }
-            }
-          }
+      /** マウスを追従していれば下を退避して描き、動いたなら前の位置と一緒に転送する範囲へ入れる */
+      void draw() {
+        INT32 x = Input::mouse.x, y = Input::mouse.y, w = 0, h = 0, sx = 0, sy = 0;
+        if (image != nullptr && Input::mouse.tracking) {
+          w = image->x;
+          h = image->y;
+          if (!clipRect(x, y, w, h, sx, sy)) w = h = 0;
         }
-      } else {
-        pixels = image->pixels;
+        if (x != lastX || y != lastY || w != lastW || h != lastH) {
+          if (lastW) Surface::markDirty(lastX, lastY, lastW, lastH);
+          if (w) Surface::markDirty(x, y, w, h);
+        } else if (w && Surface::overlapsFill(x, y, w, h)) {
+          // 塗りつぶしはバックバッファを読まないので、動いていなくても描き直したカーソルを送る
+          Surface::markDirty(x, y, w, h);
+        }
+        lastX = x;
+        lastY = y;
+        lastW = w;
+        lastH = h;
+        drawnW = w;
+        if (!w) return;
+        drawnX = x;
+        drawnY = y;
+        drawnH = h;
+        for (INT32 dy = 0; dy < h; ++dy) {
+          memcpy(saveUnder + dy * w, Surface::pixels + (y + dy) * HorizontalResolution + x, w);
+        }
+        blitImage(image, x, y, w, h, sx, sy, true);
       }
-      GraphicsOutputProtocol->Blt(GraphicsOutputProtocol, pixels, EfiBltBufferToVideo, 0, 0, x, y, image->x, image->y, 0);
-      if (transparent) free(pixels);
-      return true;
+
+      void restore() {
+        for (INT32 dy = 0; dy < drawnH && drawnW; ++dy) {
+          memcpy(Surface::pixels + (drawnY + dy) * HorizontalResolution + drawnX, saveUnder + dy * drawnW, drawnW);
+        }
+        drawnW = 0;
+      }
+    };
+  };
+
+  namespace Profiler {
+    #define PROFILER_OVERLAY_WIDTH 320
+    #define PROFILER_OVERLAY_HEIGHT 48
+    #define PROFILER_OVERLAY_PAD 4
+    #define PROFILER_DUMP_FILE L"profile.csv"
+    #define PROFILER_DUMP_LINE 512
+
+    /** オーバーレイの下にあった内容 */
+    static Graphics::Pixel overlayBackup[PROFILER_OVERLAY_WIDTH * PROFILER_OVERLAY_HEIGHT];
+    /** 画面に出しているオーバーレイの大きさ 出していなければ0 */
+    static INT32 overlayWidth;
+    static INT32 overlayHeight;
+
+    void appendMilliseconds(CHAR16 *str, UINT64 cycles) {
+      CHAR16 num[30];
+      UINT64 us = toNanoseconds(cycles) / 1000;
+      itoa(us / 1000, num, 10);
+      strcat(str, num);
+      strcat(str, (CHAR16*)L".");
+      itoa(us % 1000 / 100, num, 10);
+      strcat(str, num);
+      strcat(str, (CHAR16*)L"ms");
     }
-/*
-    void initFont() {
-      auto fonts = FileSystem::open((EFI_STRING)L"fonts");
-      CHAR16 path[50];
-      while(TRUE) {
-        auto info = FileSystem::readdir(fonts);
-        if (info == nullptr) break;
-        strcpy(path, (EFI_STRING)L"fonts\\");
-        strcat(path, info->FileName);
-        Console::writeLine(path);
+
+    void appendCount(CHAR16 *str, UINT64 count) {
+      CHAR16 num[30];
+      itoa(count, num, 10);
+      strcat(str, num);
+    }
+
+    /**
+     * 直前のフレームの所要時間、p99、Blt回数を左上に描く
+     *
+     * 転送の直前に呼び、転送が終わったらrestoreOverlayで下の内容を戻す
+     */
+    void drawOverlay() {
+      if (!overlay) {
+        // 消した直後は元の内容を転送し直す
+        if (overlayWidth) Graphics::Surface::markDirty(0, 0, overlayWidth, overlayHeight);
+        overlayWidth = overlayHeight = 0;
+        return;
       }
+      if (!frameCount) return;
+      overlayWidth = PROFILER_OVERLAY_WIDTH < Graphics::HorizontalResolution ? PROFILER_OVERLAY_WIDTH : Graphics::HorizontalResolution;
+      overlayHeight = PROFILER_OVERLAY_HEIGHT < Graphics::VerticalResolution ? PROFILER_OVERLAY_HEIGHT : Graphics::VerticalResolution;
+      for (INT32 y = 0; y < overlayHeight; ++y) {
+        memcpy(overlayBackup + y * overlayWidth, Graphics::Surface::pixels + y * Graphics::HorizontalResolution, overlayWidth);
+      }
+
+      Frame &last = recordedFrame(recordedFrames() - 1);
+      UINT64 missed = 0;
+      for (UINT32 i = 0; i < recordedFrames(); ++i) missed += recordedFrame(i).missedTicks;
+      CHAR16 line1[64], line2[64];
+      line1[0] = line2[0] = L'\0';
+      strcat(line1, (CHAR16*)L"frame ");
+      appendMilliseconds(line1, last.cycles);
+      strcat(line1, (CHAR16*)L" p99 ");
+      appendMilliseconds(line1, percentile(99));
+      strcat(line1, (CHAR16*)L" blt ");
+      appendCount(line1, last.bltCount);
+      strcat(line2, (CHAR16*)L"upd ");
+      appendMilliseconds(line2, last.zoneCycles[ZoneUpdate]);
+      strcat(line2, (CHAR16*)L" load ");
+      appendMilliseconds(line2, last.zoneCycles[ZoneLoadImage]);
+      strcat(line2, (CHAR16*)L" miss ");
+      appendCount(line2, missed);
+
+      Graphics::Pixel black {0, 0, 0, 0};
+      Graphics::Pixel white {255, 255, 255, 0};
+      suspended = true;
+      Graphics::fillRect(0, 0, overlayWidth, overlayHeight, black);
+      Graphics::drawStr(line1, white, PROFILER_OVERLAY_PAD, PROFILER_OVERLAY_PAD);
+      Graphics::drawStr(line2, white, PROFILER_OVERLAY_PAD, PROFILER_OVERLAY_HEIGHT / 2);
+      suspended = false;
     }
-*/
 
-    #define FONT_FILE_MAX_SIZE 1024
-    #define FONT_MAX_PIXEL_SIZE 1024
-    auto getFontImageName(CHAR16 c, CHAR16 *path) {
-      CHAR16 code[10];
-      itoa(c, code, 10);
-      strcpy(path, (EFI_STRING)L"fonts\\");
-      strcat(path, code);
-      strcat(path, (EFI_STRING)L".png");
-      return path;
+    void restoreOverlay() {
+      for (INT32 y = 0; y < overlayHeight; ++y) {
+        memcpy(Graphics::Surface::pixels + y * Graphics::HorizontalResolution, overlayBackup + y * overlayWidth, overlayWidth);
+      }
     }
 
-    auto getFontImage(CHAR16 c) {
-      CHAR16 path[50];
-      getFontImageName(c, path);
-      return Graphics::loadImageFromFile(path, FONT_FILE_MAX_SIZE);
+    void appendText(CHAR8 *line, UINTN &pos, const char *text) {
+      while (*text && pos < PROFILER_DUMP_LINE - 1) line[pos++] = *text++;
     }
 
-    auto drawChar(CHAR16 c, INT32 x, INT32 y, bool transparent = TRUE) {
-      auto image = getFontImage(c);
-      return drawImage(image, x, y, transparent);
+    void appendNumber(CHAR8 *line, UINTN &pos, UINT64 val) {
+      CHAR8 digits[20];
+      UINT32 count = 0;
+      do {
+        digits[count++] = '0' + val % 10;
+        val /= 10;
+      } while (val);
+      while (count && pos < PROFILER_DUMP_LINE - 1) line[pos++] = digits[--count];
     }
 
-    struct _DrawStrInfo {
-      INT32 dx;
-      INT32 dy;
-      INT32 w;
-      INT32 h;
-      INT32 lines;
-    };
+    /**
+     * リングバッファをCSVで書き出す 時間はナノ秒、start_nsは最も古いフレームからの経過時間
+     *
+     * 同じ名前のファイルがあれば消して作り直す
+     */
+    bool dump(CHAR16 *filename = (CHAR16*)PROFILER_DUMP_FILE) {
+      auto file = FileSystem::open(filename, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE);
+      if (file != nullptr) file->Delete(file);
+      file = FileSystem::open(filename, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE);
+      if (file == nullptr) return false;
 
-    typedef struct _DrawStrInfo DrawStrInfo;
+      CHAR8 line[PROFILER_DUMP_LINE];
+      UINTN pos = 0;
+      appendText(line, pos, "frame,start_ns,frame_ns,missed_ticks,blt");
+      for (UINT32 zone = 0; zone < ZoneCount; ++zone) {
+        appendText(line, pos, ",");
+        appendText(line, pos, zoneNames[zone]);
+        appendText(line, pos, "_ns,");
+        appendText(line, pos, zoneNames[zone]);
+        appendText(line, pos, "_calls");
+      }
+      appendText(line, pos, "\n");
+      FileSystem::write(file, line, pos);
 
-    auto drawStr(CHAR16 *str, Pixel color, INT32 x, INT32 y, INT32 width = 0, bool transparent = TRUE, DrawStrInfo *info = nullptr) {
-      UINTN length = strlen(str);
-      INT32 dx = 0, dy = 0, w = 0, h = 0, lines = 1;
-      INT32 line_height = 0;
-      Pixel pixels[FONT_MAX_PIXEL_SIZE];
-      memset(pixels, color, FONT_MAX_PIXEL_SIZE);
-      for (INT32 i = 0; i < length; ++i) {
-        if (str[i] == L'\r') {
-          dx = 0;
-          continue;
-        } else if (str[i] == L'\n') {
-          ++lines;
-          dy += line_height;
-          line_height = 0;
-        }
-        auto image = getFontImage(str[i]);
-        if (image == nullptr) continue;
-        if (width && width < dx + image->x) {
-          ++lines;
-          dx = 0;
-          dy += line_height;
-          line_height = 0;
-        }
-        image->pixels = pixels; // color
-        drawImage(image, x + dx, y + dy, transparent);
-        dx += image->x;
-        if (line_height < image->y) line_height = image->y;
-        if (w < dx) w = dx;
-      }
-      h = dy + line_height;
-      if (info != nullptr) {
-        info->dx = dx;
-        info->dy = dy;
-        info->w = w;
-        info->h = h;
-        info->lines = lines;
+      UINT32 count = recordedFrames();
+      UINT64 origin = count ? recordedFrame(0).start : 0;
+      for (UINT32 i = 0; i < count; ++i) {
+        Frame &frame = recordedFrame(i);
+        pos = 0;
+        appendNumber(line, pos, frameCount - count + i);
+        appendText(line, pos, ",");
+        appendNumber(line, pos, toNanoseconds(frame.start - origin));
+        appendText(line, pos, ",");
+        appendNumber(line, pos, toNanoseconds(frame.cycles));
+        appendText(line, pos, ",");
+        appendNumber(line, pos, frame.missedTicks);
+        appendText(line, pos, ",");
+        appendNumber(line, pos, frame.bltCount);
+        for (UINT32 zone = 0; zone < ZoneCount; ++zone) {
+          appendText(line, pos, ",");
+          appendNumber(line, pos, toNanoseconds(frame.zoneCycles[zone]));
+          appendText(line, pos, ",");
+          appendNumber(line, pos, frame.zoneCalls[zone]);
+        }
+        appendText(line, pos, "\n");
+        FileSystem::write(file, line, pos);
       }
-      return info;
+      FileSystem::close(file);
+      return true;
     }
   };
 
+  /**
+   * 固定刻みのメインループ
+   *
+   * タイマーイベントごとに実際に経った時間をTSCで測り、その分だけonUpdateを
+   * stepTimeずつ呼んでからonRenderを1回呼ぶ 重いフレームの後は取りこぼした分を
+   * 追いかけるので、tickで数えるアニメーションの速さはフレームの重さによらない
+   * 画面を送った後、次のタイマーまでの残りでJobsを進める
+   */
   namespace Main {
+    /** 1フレームで追いかける更新の上限 これを超えた遅れは捨てる */
+    #define MAIN_MAX_CATCH_UP_STEPS 5
+
+    /** 固定の時間刻みで呼ぶ */
     static void (*onUpdate)();
+    /** フレームに1回、更新の後に呼ぶ */
+    static void (*onRender)();
+    /** onUpdate 1回分の時間(100ns単位) */
+    static UINT64 stepTime = 333'300;
+    /** onUpdateを呼んだ回数 stepTimeを掛けるとゲーム内の経過時間になる */
+    static UINT64 stepCount;
+    /** まだ更新に回していない時間(100ns単位) 早く鳴ったタイマーで先に進めた分は負になる */
+    static INT64 pendingTime;
+    static UINT64 lastFrameTsc;
 
     void _onKeyPress() {
       Input::readKeyStroke();
     }
 
+    /** このフレームで呼ぶ更新の回数 */
+    UINT32 stepsForFrame() {
+      UINT64 now = Profiler::now();
+      pendingTime += lastFrameTsc ? Profiler::toNanoseconds(now - lastFrameTsc) / 100 : stepTime;
+      lastFrameTsc = now;
+      if (pendingTime < (INT64)stepTime) {
+        // タイマーが鳴った以上は1回進め、足りない分は次のフレームから差し引く
+        // タイマーがTSCより速いときやTSCを測れていないときに借りが膨らまないよう、借りは1回分まで
+        pendingTime -= stepTime;
+        if (pendingTime < -(INT64)stepTime) pendingTime = -(INT64)stepTime;
+        return 1;
+      }
+      UINT64 steps = pendingTime / stepTime;
+      if (steps > MAIN_MAX_CATCH_UP_STEPS) {
+        pendingTime = 0;
+        return MAIN_MAX_CATCH_UP_STEPS;
+      }
+      pendingTime -= steps * stepTime;
+      return steps;
+    }
+
     void _onTick() {
+      Profiler::beginFrame();
       Input::getPointerState();
-      if (onUpdate) onUpdate();
+      UINT32 steps = stepsForFrame();
+      if (onUpdate) {
+        PROFILE_ZONE(ZoneUpdate);
+        for (UINT32 i = 0; i < steps; ++i) {
+          onUpdate();
+          ++stepCount;
+        }
+      } else {
+        stepCount += steps;
+      }
+      if (onRender) onRender();
+      Profiler::drawOverlay();
+      Graphics::Cursor::draw();
+      {
+        PROFILE_ZONE(ZoneFlush);
+        Graphics::Surface::flush();
+      }
+      Graphics::Cursor::restore();
+      Profiler::restoreOverlay();
+      {
+        PROFILE_ZONE(ZoneJobs);
+        Jobs::run(Profiler::current.start + Profiler::tickCycles * JOBS_BUDGET_PERCENT / 100);
+      }
+      Profiler::endFrame();
+      if (Profiler::dumpRequested) {
+        Profiler::dumpRequested = false;
+        Profiler::dump();
+      }
     }
 
     void start(UINT64 tick_interval = 333'300) {
@@ -604,6 +3723,10 @@ namespace EfiGame {
       EFI_EVENT timerEvent;
       SystemTable->BootServices->CreateEvent(EVT_TIMER, 0, NULL, NULL, &timerEvent);
       SystemTable->BootServices->SetTimer(timerEvent, TimerPeriodic, tick_interval);
+      Profiler::setTickInterval(tick_interval);
+      stepTime = tick_interval;
+      pendingTime = 0;
+      lastFrameTsc = 0;
       events[0] = SystemTable->ConIn->WaitForKey;
       events[1] = timerEvent;
       UINTN eventIndex;
@@ -620,15 +3743,20 @@ namespace EfiGame {
   void initGame(EFI_SYSTEM_TABLE *SystemTable) {
     libc::init(SystemTable);
     EfiGame::SystemTable = SystemTable;
+    Profiler::calibrate();
     Input::initInput();
     Graphics::initGraphics();
     FileSystem::initFileSystem();
+    FileSystem::AssetPack::load((EFI_STRING)L"assets.pack");
+    Workers::initWorkers();
+    Graphics::initFont();
+    Graphics::GlyphCache::beforeEvict = Graphics::Compositor::compose;
   }
 };
 
 using namespace EfiGame;
 
-void* operator new(UINTN size) {
+void* operator new(decltype(sizeof(0)) size) {
 	return malloc(size);
 }
 
@@ -636,6 +3764,31 @@ void operator delete(void* p) {
   free(p);
 }
 
+void operator delete(void* p, decltype(sizeof(0))) {
+  free(p);
+}
+
+// 確保はstbiLockを持っている側の領域から取る 解放と伸長はアドレスで行き先が決まる
+void* stbiMalloc(UINTN size) {
+  Workers::Worker *worker = Workers::stbiWorker;
+  return worker != nullptr ? Workers::arenaAlloc(worker, size) : malloc(size);
+}
+
+void stbiFree(void *p) {
+  Workers::Worker *worker = Workers::arenaOwner(p);
+  if (worker != nullptr) {
+    Workers::arenaFree(worker, p);
+  } else {
+    free(p);
+  }
+}
+
+void* stbiRealloc(void *p, UINTN oldSize, UINTN newSize) {
+  if (p == nullptr) return stbiMalloc(newSize);
+  Workers::Worker *worker = Workers::arenaOwner(p);
+  return worker != nullptr ? Workers::arenaRealloc(worker, p, oldSize, newSize) : realloc_sized(p, oldSize, newSize);
+}
+
 extern "C" void __cxa_pure_virtual() { }
 
 #define sceneId(Class) Class ## Id
@@ -668,18 +3821,13 @@ public:
     if (tick == 5) {
       auto *image = Graphics::loadImageFromFile((EFI_STRING)L"Uefi_logo_s_bg.png");
       Graphics::drawImage(image, (Graphics::HorizontalResolution - image->x) / 2, (Graphics::VerticalResolution - image->y) / 2, false);
-      free(image);
+      Graphics::freeImage(image);
       // Graphics::drawImage(image, 0, 0, false);
     }
     if (tick == 80) changeScene(OpeningScene);
   }
 };
 
-static INT32 prevX = -1;
-static INT32 prevY = -1;
-static Graphics::Image* backupPx;
-static Graphics::Image* cursorImage;
-
 class OpeningScene : public Scene {
 public:
   void update() {
@@ -689,7 +3837,7 @@ public:
       Graphics::fillRect(0, 0, Graphics::HorizontalResolution, Graphics::VerticalResolution, white);
       auto *image = Graphics::loadImageFromFile((EFI_STRING)L"title_logo.png");
       Graphics::drawImage(image, (Graphics::HorizontalResolution - image->x) / 2, (Graphics::VerticalResolution - image->y) / 2 - 50);
-      free(image);
+      Graphics::freeImage(image);
     }
     if (tick % 30 == 1) {
       Graphics::Pixel black {0, 0, 0, 0};
@@ -704,7 +3852,6 @@ public:
   static void setEventHandlers() {
     Input::onMouseLeftClick = &onMouseLeftClick;
     Input::setTrackMouseScreenCoordinate(true, Graphics::HorizontalResolution / 2, Graphics::VerticalResolution / 2);
-    Input::onMouseMove = &onMouseMove;
     Input::onKeyPress = &onKeyPress;
   }
 
@@ -713,29 +3860,6 @@ public:
     Input::onKeyPress = nullptr;
   }
 
-  static void backupCursorPixel() {
-    Graphics::Pixel *base = (Graphics::Pixel *)Graphics::GraphicsOutputProtocol->Mode->FrameBufferBase;
-    for (INT32 dy = 0; dy < backupPx->y; ++dy) {
-      INT32 base_yoffset = Graphics::HorizontalResolution * (Input::mouse.y + dy);
-      INT32 px_yoffset = backupPx->x * dy;
-      for (INT32 dx = 0; dx < backupPx->x; ++dx) {
-        auto px_index = px_yoffset + dx;
-        auto base_index = base_yoffset + Input::mouse.x + dx;
-        backupPx->pixels[px_index] = base[base_index];
-      }
-    }
-  }
-
-  static void onMouseMove(INT32 rx, INT32 ry) {
-    // if (!backupPx) backupPx = Graphics::loadImageFromFile((EFI_STRING)L"cursor.png");
-    // if (!cursorImage) cursorImage = Graphics::loadImageFromFile((EFI_STRING)L"cursor.png");
-    if (prevX >= 0) Graphics::drawImage(backupPx, prevX, prevY);
-    backupCursorPixel();
-    Graphics::drawImage(cursorImage, Input::mouse.x, Input::mouse.y);
-    prevX = Input::mouse.x;
-    prevY = Input::mouse.y;
-  }
-
   static void onMouseLeftClick() {
     changeToNextScene();
   }
@@ -750,9 +3874,55 @@ public:
   }
 };
 
+#define SCENARIO_MAGIC 0x43534745 // "EGSC"
+#define SCENARIO_VERSION 1
+
+/** make_scenario.pyが出力する命令 */
+enum ScenarioOpCode {
+  ScenarioOpEnd,
+  ScenarioOpWait,
+  ScenarioOpBg,
+  ScenarioOpChara,
+  ScenarioOpName,
+  ScenarioOpText,
+  ScenarioOpSpeed,
+  ScenarioOpJump,
+};
+
+struct _ScenarioHeader {
+  UINT32 magic;
+  UINT16 version;
+  UINT16 reserved;
+  UINT32 opCount;
+  UINT32 stringCount;
+  UINT32 assetCount;
+  /** CHAR16単位 */
+  UINT32 stringDataSize;
+};
+
+typedef struct _ScenarioHeader ScenarioHeader;
+
+struct _ScenarioOp {
+  UINT8 code;
+  /** Charaなら0:左 1:右 */
+  UINT8 a;
+  /** Charaならキャラ番号 */
+  UINT8 b;
+  UINT8 reserved;
+  /** Bg, Charaならアセット番号 Name, Textなら文字列番号 Speedなら1秒に出す文字数 Jumpなら飛び先の命令番号 */
+  UINT32 operand;
+};
+
+typedef struct _ScenarioOp ScenarioOp;
+
 static BOOLEAN novelToNext;
 class NovelScene : public Scene {
-  #define MAX_SCENARIO_SIZE 4096
+  #define MAX_SCENARIO_LINE 256
+  #define MAX_CHAPTERS 64
+  #define MAX_CHAPTER_NAME 32
+  /** 1回のnextで飛べる回数 クリック待ちの無いループで止まらないように */
+  #define MAX_SCENARIO_JUMPS 256
+  #define PRELOAD_SCAN_LIMIT 1024 * 256
   #define WIDTH 800
   #define HEIGHT 600
   #define MSGBOX_PAD 20
@@ -761,35 +3931,88 @@ class NovelScene : public Scene {
   #define NAMEBOX_WIDTH 160
   #define NAMEBOX_HEIGHT 40
   #define TEXT_PAD 10
+  #define TEXT_WIDTH (WIDTH - (MSGBOX_PAD + MSGBOX_BORDER + TEXT_PAD) * 2)
   #define CHARA_PAD 100
   #define CHARA0_TOP 0
   #define CHARA1_TOP 250
+  #define PROGRESS_WIDTH 400
+  #define PROGRESS_HEIGHT 8
+  /** 文字送りの速さの初期値(1秒に出す文字数) */
+  #define TEXT_SPEED 40
 public:
   CHAR16 bg_filename[50];
   Graphics::Image* bg_image;
   Graphics::Image* chara[2];
-  CHAR16 *scenario;
-  CHAR16 *scenarioPos;
+  /** scenario.txtを少しずつ読むリーダー */
+  FileSystem::Reader scenarioReader;
+  /** 読み込み中に見つけた章(*label)の名前とファイル上の位置 */
+  CHAR16 chapterNames[MAX_CHAPTERS][MAX_CHAPTER_NAME];
+  UINT64 chapterOffsets[MAX_CHAPTERS];
+  UINT32 chapterCount;
   CHAR16 name[12];
   CHAR16 text[128];
+  /** 表示中の名前 nameかコンパイル済みシナリオの文字列を指す */
+  CHAR16 *currentName;
+  /** 表示中の本文 textかコンパイル済みシナリオの文字列を指す */
+  CHAR16 *currentText;
+  /** コンパイル済みシナリオ 無ければnullptrでscenario.txtを読む */
+  ScenarioOp *ops;
+  UINT32 *stringOffsets;
+  UINT32 *assetStrings;
+  CHAR16 *stringData;
+  UINT32 opCount;
+  UINT32 stringCount;
+  UINT32 assetCount;
+  UINT32 pc;
   CHAR16 leftChara;
   CHAR16 rightChara;
+  /** 文字送りの途中か */
   BOOLEAN textanim;
+  /** 1秒に出す文字数 0なら一度に出す シナリオの~で変える */
+  UINT32 textSpeed;
+  /** 今の本文を出し始めたtick */
+  UINT64 textStartTick;
   INT32 x0;
   INT32 y0;
+  /** Jobsで先読みしている画像の数と、そのうち終わった数 */
+  UINT32 loadingAssets;
+  UINT32 loadedAssets;
+  /** 画面の各部分 nextで中身を入れ替え、変わった範囲だけを描き直す */
+  Graphics::DisplayList::Node *baseNode;
+  Graphics::DisplayList::Node *bgNode;
+  Graphics::DisplayList::Node *leftCharaNode;
+  Graphics::DisplayList::Node *rightCharaNode;
+  Graphics::DisplayList::Node *nameBoxNode;
+  Graphics::DisplayList::Node *msgBoxNodes[5];
+  Graphics::DisplayList::Node *nameNode;
+  Graphics::DisplayList::Node *textNode;
 
   void update() {
     if (tick > 3 && novelToNext) {
-      next();
+      if (textanim) {
+        // 文字送りの途中なら残りを一度に出し、次へは進まない
+        novelToNext = false;
+        finishText();
+      } else {
+        next();
+      }
     } else if (tick == 0) {
       Console::writeLine((EFI_STRING)L"LOADING...");
       init();
-      Console::writeLine((EFI_STRING)L"DONE.");
     } else if (tick == 1) {
+      if (loadedAssets < loadingAssets) {
+        // 先読みが終わるまでここで待つ
+        drawProgress();
+        --tick;
+        return;
+      }
+      Console::writeLine((EFI_STRING)L"DONE.");
       Graphics::Pixel black {0, 0, 0, 0};
       Graphics::fillRect(0, 0, Graphics::HorizontalResolution, Graphics::VerticalResolution, black);
     } else if (tick == 2) {
       next();
+    } else if (textanim) {
+      animateText();
     }
   }
 
@@ -801,91 +4024,268 @@ public:
     rightChara = L'-';
     novelToNext = false;
     textanim = false;
-    x0 = (Graphics::HorizontalResolution - WIDTH) / 2;
-    y0 = (Graphics::VerticalResolution - HEIGHT) / 2;
-    EFI_FILE_PROTOCOL *file;
-    file = FileSystem::open((EFI_STRING)L"scenario.txt");
-    FileSystem::read(file, scenario, sizeof(CHAR16) * MAX_SCENARIO_SIZE);
-    FileSystem::close(file);
-    scenarioPos = scenario;
+    textSpeed = TEXT_SPEED;
+    textStartTick = 0;
+    x0 = ((INT32)Graphics::HorizontalResolution - WIDTH) / 2;
+    y0 = ((INT32)Graphics::VerticalResolution - HEIGHT) / 2;
+    currentName = name;
+    currentText = text;
+    bg_image = nullptr;
+    chara[0] = nullptr;
+    chara[1] = nullptr;
+    if (!loadCompiledScenario((EFI_STRING)L"scenario.bin")) {
+      ops = nullptr;
+      chapterCount = 0;
+      FileSystem::openReader(&scenarioReader, FileSystem::open((EFI_STRING)L"scenario.txt"));
+    }
+    preloadAssets();
+    initNodes();
     setEventHandlers();
   }
 
-  void updateBg() {
-    drawBg();
-    drawLeftChara();
-    drawRightChara();
-    drawNameBox();
-    drawName();
-    drawMsgBox();
-    drawText();
+  /** 背景の下の黒、背景、立ち絵、枠、文字の順に重ねる */
+  void initNodes() {
+    using namespace Graphics::DisplayList;
+    clear();
+    baseNode = add(NodeRect, 0);
+    bgNode = add(NodeImage, 1);
+    leftCharaNode = add(NodeImage, 2);
+    rightCharaNode = add(NodeImage, 2);
+    nameBoxNode = add(NodeRect, 3);
+    for (UINT32 i = 0; i < 5; ++i) msgBoxNodes[i] = add(NodeRect, 3);
+    nameNode = add(NodeText, 4);
+    textNode = add(NodeText, 4);
+    Graphics::Pixel black {0, 0, 0, 0};
+    Graphics::Pixel pink {220, 120, 255, 0};
+    Graphics::Pixel white {255, 255, 255, 0};
+    setRect(baseNode, x0, y0, WIDTH, HEIGHT, black);
+    setRect(nameBoxNode, x0 + MSGBOX_PAD, y0 + MSGBOX_TOP - NAMEBOX_HEIGHT, NAMEBOX_WIDTH, NAMEBOX_HEIGHT, pink);
+    // まんなか
+    setRect(msgBoxNodes[0], x0 + MSGBOX_PAD + MSGBOX_BORDER, y0 + MSGBOX_TOP + MSGBOX_BORDER, WIDTH - (MSGBOX_PAD + MSGBOX_BORDER) * 2, HEIGHT - MSGBOX_TOP - MSGBOX_PAD - MSGBOX_BORDER * 2, pink);
+    // |
+    setRect(msgBoxNodes[1], x0 + MSGBOX_PAD, y0 + MSGBOX_TOP, MSGBOX_BORDER, HEIGHT - MSGBOX_TOP - MSGBOX_PAD, white);
+    //  ^
+    setRect(msgBoxNodes[2], x0 + MSGBOX_PAD, y0 + MSGBOX_TOP, WIDTH - MSGBOX_PAD * 2, MSGBOX_BORDER, white);
+    //  _
+    setRect(msgBoxNodes[3], x0 + MSGBOX_PAD, y0 + HEIGHT - MSGBOX_PAD - MSGBOX_BORDER, WIDTH - MSGBOX_PAD * 2, MSGBOX_BORDER, white);
+    //   |
+    setRect(msgBoxNodes[4], x0 + WIDTH - MSGBOX_PAD - MSGBOX_BORDER, y0 + MSGBOX_TOP, MSGBOX_BORDER, HEIGHT - MSGBOX_TOP - MSGBOX_PAD, white);
+    updateName();
+    updateText();
   }
 
-  void updateChara() {
-    updateBg();
+  /**
+   * make_scenario.pyで変換したシナリオを読み込む
+   *
+   * 大きさが合わないときや番号が範囲外のときはfalseを返し、scenario.txtを読む
+   */
+  bool loadCompiledScenario(CHAR16 *filename) {
+    auto file = FileSystem::open(filename);
+    if (file == nullptr) return false;
+    ScenarioHeader header;
+    UINT64 fileSize;
+    auto size = FileSystem::read(file, &header, sizeof(header));
+    if (size != sizeof(header) || header.magic != SCENARIO_MAGIC || header.version != SCENARIO_VERSION || !header.opCount ||
+      !header.stringDataSize || !FileSystem::getSize(file, &fileSize)) {
+      FileSystem::close(file);
+      return false;
+    }
+    UINT64 bodySize = sizeof(ScenarioOp) * (UINT64)header.opCount + sizeof(UINT32) * ((UINT64)header.stringCount + header.assetCount) +
+      sizeof(CHAR16) * (UINT64)header.stringDataSize;
+    if (sizeof(header) + bodySize > fileSize) {
+      FileSystem::close(file);
+      return false;
+    }
+    UINT8 *body = (UINT8*)malloc(bodySize);
+    if (body == nullptr) {
+      FileSystem::close(file);
+      return false;
+    }
+    size = FileSystem::read(file, body, bodySize);
+    FileSystem::close(file);
+    if (size != bodySize) {
+      free(body);
+      return false;
+    }
+    ops = (ScenarioOp*)body;
+    stringOffsets = (UINT32*)(ops + header.opCount);
+    assetStrings = stringOffsets + header.stringCount;
+    stringData = (CHAR16*)(assetStrings + header.assetCount);
+    opCount = header.opCount;
+    stringCount = header.stringCount;
+    assetCount = header.assetCount;
+    if (!validCompiledScenario(header.stringDataSize)) {
+      free(body);
+      ops = nullptr;
+      return false;
+    }
+    pc = 0;
+    return true;
   }
 
-  void updateName() {
-    drawNameBox();
-    drawName();
+  /** 文字列と命令の番号がすべて範囲内で、最後の命令がEndか pcはEndで止まるので命令の外へは出ない */
+  bool validCompiledScenario(UINT32 stringDataSize) {
+    if (stringData[stringDataSize - 1] != L'\0') return false;
+    for (UINT32 i = 0; i < stringCount; ++i) {
+      if (stringOffsets[i] >= stringDataSize) return false;
+    }
+    for (UINT32 i = 0; i < assetCount; ++i) {
+      if (assetStrings[i] >= stringCount) return false;
+    }
+    for (UINT32 i = 0; i < opCount; ++i) {
+      ScenarioOp &op = ops[i];
+      switch (op.code) {
+        case ScenarioOpEnd:
+        case ScenarioOpWait:
+        case ScenarioOpSpeed:
+          break;
+        case ScenarioOpBg:
+          if (op.operand >= assetCount || strlen(getAssetPath(op.operand)) >= sizeof(bg_filename) / sizeof(CHAR16)) return false;
+          break;
+        case ScenarioOpChara:
+          if (op.operand >= assetCount) return false;
+          break;
+        case ScenarioOpName:
+        case ScenarioOpText:
+          if (op.operand >= stringCount) return false;
+          break;
+        case ScenarioOpJump:
+          if (op.operand >= opCount) return false;
+          break;
+        default:
+          return false;
+      }
+    }
+    return ops[opCount - 1].code == ScenarioOpEnd;
   }
 
-  void updateText() {
-    drawMsgBox();
-    drawText();
+  CHAR16* getString(UINT32 id) {
+    return stringData + stringOffsets[id];
   }
 
-  void drawBg() {
-    // なぜだか分からないがnullになっているのでロード
-    if (!bg_image && strlen(bg_filename)) bg_image = Graphics::loadImageFromFile(bg_filename);
-    if (bg_image) Graphics::drawImage(bg_image, x0, y0, false);
+  CHAR16* getAssetPath(UINT32 id) {
+    return getString(assetStrings[id]);
   }
 
-  void drawLeftChara() {
-    if (leftChara == L'0') {
-      Graphics::drawImage(chara[0], x0 + CHARA_PAD, y0 + CHARA0_TOP);
-    } else if (leftChara == L'1') {
-      Graphics::drawImage(chara[1], x0 + CHARA_PAD, y0 + CHARA1_TOP);
+  /** シナリオに出てくる背景と立ち絵をJobsで先読みする */
+  void preloadAssets() {
+    #define MAX_PRELOAD_ASSETS 64
+    loadingAssets = 0;
+    loadedAssets = 0;
+    if (ops) {
+      // アセットの一覧は全部分かっているので、数によらずすべて積む
+      CHAR16 **assetPaths = (CHAR16**)malloc(sizeof(CHAR16*) * (assetCount ? assetCount : 1));
+      for (UINT32 i = 0; i < assetCount; ++i) assetPaths[i] = getAssetPath(i);
+      loadingAssets = Graphics::AssetCache::preloadAsync(assetPaths, assetCount, onAssetLoaded, this);
+      free(assetPaths);
+      return;
+    }
+    CHAR16 *paths[MAX_PRELOAD_ASSETS];
+    UINTN count = 0;
+    // 先頭から少しだけ読んで先読みし、章も覚えておく
+    CHAR16 line[MAX_SCENARIO_LINE];
+    INT32 length;
+    while (count < MAX_PRELOAD_ASSETS && FileSystem::tellReader(&scenarioReader) < PRELOAD_SCAN_LIMIT) {
+      UINT64 offset = FileSystem::tellReader(&scenarioReader);
+      if ((length = FileSystem::readLine(&scenarioReader, line, MAX_SCENARIO_LINE)) < 0) break;
+      CHAR16 *path = nullptr;
+      if (line[0] == L'#') {
+        path = line + 1;
+      } else if (line[0] == L':' && length > 4) {
+        path = line + 4;
+      } else if (line[0] == L'*') {
+        addChapter(line + 1, offset);
+      }
+      if (path != nullptr && *path) {
+        paths[count] = (CHAR16*)malloc(sizeof(CHAR16) * (strlen(path) + 1));
+        strcpy(paths[count], path);
+        ++count;
+      }
     }
+    FileSystem::seekReader(&scenarioReader, 0);
+    loadingAssets = Graphics::AssetCache::preloadAsync(paths, count, onAssetLoaded, this);
+    for (UINTN i = 0; i < count; ++i) free(paths[i]);
   }
 
-  void drawRightChara() {
-    if (rightChara == L'0') {
-      Graphics::drawImage(chara[0], x0 + WIDTH - CHARA_PAD - chara[0]->x, y0 + CHARA0_TOP);
-    } else if (rightChara == L'1') {
-      Graphics::drawImage(chara[1], x0 + WIDTH - CHARA_PAD - chara[1]->x, y0 + CHARA1_TOP);
-    }
+  void updateBg() {
+    // なぜだか分からないがnullになっているのでロード
+    if (!bg_image && strlen(bg_filename)) bg_image = Graphics::AssetCache::acquire(bg_filename);
+    Graphics::DisplayList::setImage(bgNode, bg_image, x0, y0, false);
   }
 
-  void drawNameBox() {
-    if (!strlen(name)) return;
-    Graphics::Pixel pink {220, 120, 255, 0};
-    Graphics::fillRect(x0 + MSGBOX_PAD, y0 + MSGBOX_TOP - NAMEBOX_HEIGHT, NAMEBOX_WIDTH, NAMEBOX_HEIGHT, pink);
+  void updateChara() {
+    Graphics::Image *left = charaImage(leftChara);
+    Graphics::Image *right = charaImage(rightChara);
+    Graphics::DisplayList::setImage(leftCharaNode, left, x0 + CHARA_PAD, y0 + charaTop(leftChara));
+    Graphics::DisplayList::setImage(rightCharaNode, right, x0 + WIDTH - CHARA_PAD - (right ? right->x : 0), y0 + charaTop(rightChara));
+  }
+
+  Graphics::Image* charaImage(CHAR16 id) {
+    if (id == L'0') return chara[0];
+    if (id == L'1') return chara[1];
+    return nullptr;
+  }
+
+  INT32 charaTop(CHAR16 id) {
+    return id == L'1' ? CHARA1_TOP : CHARA0_TOP;
   }
 
-  void drawName() {
+  void updateName() {
     Graphics::Pixel white {220, 255, 255, 0};
-    Graphics::drawStr(name, white, x0 + MSGBOX_PAD + TEXT_PAD, y0 + MSGBOX_TOP - NAMEBOX_HEIGHT + TEXT_PAD);
+    Graphics::DisplayList::setVisible(nameBoxNode, strlen(currentName) > 0);
+    Graphics::DisplayList::setText(nameNode, currentName, white, x0 + MSGBOX_PAD + TEXT_PAD, y0 + MSGBOX_TOP - NAMEBOX_HEIGHT + TEXT_PAD);
   }
 
-  void drawMsgBox() {
-    Graphics::Pixel pink {220, 120, 255, 0};
+  /** 本文を入れ替える textSpeedが0でなければ1文字目だけを見せ、残りはanimateTextで少しずつ出す */
+  void updateText() {
     Graphics::Pixel white {255, 255, 255, 0};
-    // まんなか
-    Graphics::fillRect(x0 + MSGBOX_PAD + MSGBOX_BORDER, y0 + MSGBOX_TOP + MSGBOX_BORDER, WIDTH - (MSGBOX_PAD + MSGBOX_BORDER) * 2, HEIGHT - MSGBOX_TOP - MSGBOX_PAD - MSGBOX_BORDER * 2, pink);
-    // |
-    Graphics::fillRect(x0 + MSGBOX_PAD, y0 + MSGBOX_TOP, MSGBOX_BORDER, HEIGHT - MSGBOX_TOP - MSGBOX_PAD, white);
-    //  ^
-    Graphics::fillRect(x0 + MSGBOX_PAD, y0 + MSGBOX_TOP, WIDTH - MSGBOX_PAD * 2, MSGBOX_BORDER, white);
-    //  _
-    Graphics::fillRect(x0 + MSGBOX_PAD, y0 + HEIGHT - MSGBOX_PAD - MSGBOX_BORDER, WIDTH - MSGBOX_PAD * 2, MSGBOX_BORDER, white);
-    //   |
-    Graphics::fillRect(x0 + WIDTH - MSGBOX_PAD - MSGBOX_BORDER, y0 + MSGBOX_TOP, MSGBOX_BORDER, HEIGHT - MSGBOX_TOP - MSGBOX_PAD, white);
+    textanim = textSpeed > 0;
+    textStartTick = tick;
+    Graphics::DisplayList::revealText(textNode, textanim ? 1 : TEXT_NODE_MAX_GLYPHS);
+    Graphics::DisplayList::setText(textNode, currentText, white, x0 + MSGBOX_PAD + MSGBOX_BORDER + TEXT_PAD, y0 + MSGBOX_TOP + MSGBOX_BORDER + TEXT_PAD, TEXT_WIDTH);
   }
 
-  void drawText() {
-    Graphics::Pixel white {255, 255, 255, 0};
-    Graphics::drawStr(text, white, x0 + MSGBOX_PAD + MSGBOX_BORDER + TEXT_PAD, y0 + MSGBOX_TOP + MSGBOX_BORDER + TEXT_PAD, WIDTH - (MSGBOX_PAD + MSGBOX_BORDER + TEXT_PAD) * 2);
+  /**
+   * 経った時間の分だけ本文を出す 最初の1文字はすぐに出す
+   *
+   * 増えたグリフの範囲だけを描き直すので、1回の手間は本文の長さによらない
+   */
+  void animateText() {
+    UINT64 count = (tick - textStartTick) * Main::stepTime * textSpeed / 10'000'000 + 1;
+    if (count >= textNode->glyphCount) {
+      finishText();
+      return;
+    }
+    if (count == Graphics::DisplayList::shownGlyphs(textNode)) return;
+    Graphics::DisplayList::revealText(textNode, count);
+    Graphics::DisplayList::render();
+  }
+
+  /** 文字送りをやめて本文をすべて出す */
+  void finishText() {
+    textanim = false;
+    Graphics::DisplayList::revealText(textNode, TEXT_NODE_MAX_GLYPHS);
+    Graphics::DisplayList::render();
+  }
+
+  /**
+   * 次に出す本文をJobsの空き時間に並べておく
+   *
+   * クリックされたときにはLayoutCacheに入っているので、グリフの大きさを調べずに出せる
+   * 先が読めるコンパイル済みシナリオのときだけ
+   */
+  void prelayoutNextText() {
+    if (!ops) return;
+    for (UINT32 i = pc; ops[i].code != ScenarioOpEnd; ++i) {
+      if (ops[i].code != ScenarioOpText) continue;
+      Jobs::submit(stepPrelayout, getString(ops[i].operand));
+      return;
+    }
+  }
+
+  static bool stepPrelayout(Jobs::Job *job) {
+    Graphics::LayoutCache::get((CHAR16*)job->state, TEXT_WIDTH);
+    return true;
   }
 
   void next() {
@@ -894,51 +4294,89 @@ public:
     bool charaChanged = false;
     bool nameChanged = false;
     bool textChanged = false;
-    CHAR16 debug[10];
-    debug[9] = '\0';
+    if (ops) {
+      runCompiled(bgChanged, charaChanged, nameChanged, textChanged);
+    } else {
+      parseText(bgChanged, charaChanged, nameChanged, textChanged);
+    }
+    if (bgChanged) updateBg();
+    if (charaChanged) updateChara();
+    if (nameChanged) updateName();
+    if (textChanged) updateText();
+    Graphics::DisplayList::render();
+    prelayoutNextText();
+  }
+
+  /** コンパイル済みシナリオを次のクリック待ちまで実行する */
+  void runCompiled(bool &bgChanged, bool &charaChanged, bool &nameChanged, bool &textChanged) {
+    UINT32 jumps = 0;
+    while (TRUE) {
+      ScenarioOp &op = ops[pc];
+      if (op.code == ScenarioOpEnd) break;
+      ++pc;
+      if (op.code == ScenarioOpWait) break;
+      switch (op.code) {
+        case ScenarioOpBg:
+          bgChanged = true;
+          strcpy(bg_filename, getAssetPath(op.operand));
+          Graphics::AssetCache::release(bg_image);
+          bg_image = Graphics::AssetCache::acquire(bg_filename);
+          break;
+        case ScenarioOpChara:
+          charaChanged = true;
+          if (op.a == 0) {
+            leftChara = L'0' + op.b;
+          } else {
+            rightChara = L'0' + op.b;
+          }
+          if (op.b < 2) {
+            Graphics::AssetCache::release(chara[op.b]);
+            chara[op.b] = Graphics::AssetCache::acquire(getAssetPath(op.operand));
+          }
+          break;
+        case ScenarioOpName:
+          nameChanged = true;
+          currentName = getString(op.operand);
+          break;
+        case ScenarioOpText:
+          textChanged = true;
+          currentText = getString(op.operand);
+          break;
+        case ScenarioOpSpeed:
+          textSpeed = op.operand;
+          break;
+        case ScenarioOpJump:
+          if (++jumps > MAX_SCENARIO_JUMPS) {
+            showLoopError(textChanged);
+            return;
+          }
+          pc = op.operand;
+          break;
+      }
+    }
+  }
+
+  /** scenario.txtを次のクリック待ちまで読み進める */
+  void parseText(bool &bgChanged, bool &charaChanged, bool &nameChanged, bool &textChanged) {
+    CHAR16 line[MAX_SCENARIO_LINE];
     INT32 text_index = 0;
+    UINT32 jumps = 0;
     while(TRUE) {
-      if (*scenarioPos == L'-') {
-        // Console::write((EFI_STRING)L"-");
-        while (*scenarioPos++ != L'\n');
+      UINT64 offset = FileSystem::tellReader(&scenarioReader);
+      INT32 length = FileSystem::readLine(&scenarioReader, line, MAX_SCENARIO_LINE);
+      if (length < 0 || line[0] == L'-') {
         break;
-      } else if (*scenarioPos == L'#') {
-        // Console::write((EFI_STRING)L"#");
+      } else if (length == 0) {
+        continue;
+      } else if (line[0] == L'#') {
         bgChanged = true;
-        ++scenarioPos;
-        INT32 i = 0;
-        while (TRUE) {
-          if (*scenarioPos == L'\r') {
-            bg_filename[i] = L'\0';
-            break;
-          }
-          bg_filename[i] = *scenarioPos;
-          ++scenarioPos;
-          ++i;
-        }
-        scenarioPos += 2;
-        bg_image = Graphics::loadImageFromFile(bg_filename);
-      } else if (*scenarioPos == L':') {
-        // Console::write((EFI_STRING)L":");
+        copyString(bg_filename, line + 1, sizeof(bg_filename) / sizeof(CHAR16));
+        Graphics::AssetCache::release(bg_image);
+        bg_image = Graphics::AssetCache::acquire(bg_filename);
+      } else if (line[0] == L':' && length > 4) {
         charaChanged = true;
-        ++scenarioPos;
-        CHAR16 lr = *scenarioPos;
-        ++scenarioPos;
-        CHAR16 charaId = *scenarioPos;
-        ++scenarioPos;
-        ++scenarioPos;
-        CHAR16 fileName[100];
-        INT32 i = 0;
-        while (TRUE) {
-          if (*scenarioPos == L'\r') {
-            fileName[i] = L'\0';
-            break;
-          }
-          fileName[i] = *scenarioPos;
-          ++scenarioPos;
-          ++i;
-        }
-        scenarioPos += 2;
+        CHAR16 lr = line[1];
+        CHAR16 charaId = line[2];
         if (lr == L'L') {
           leftChara = charaId;
         } else {
@@ -950,55 +4388,114 @@ public:
         } else if (charaId == L'1') {
           charaIdNum = 1;
         }
-        chara[charaIdNum] = Graphics::loadImageFromFile(fileName);
-      } else if (*scenarioPos == L'@') {
-        // Console::write((EFI_STRING)L"@");
-        nameChanged = true;
-        ++scenarioPos;
-        INT32 i = 0;
-        while (TRUE) {
-          if (*scenarioPos == L'\r') {
-            name[i] = L'\0';
-            break;
-          }
-          name[i] = *scenarioPos;
-          ++scenarioPos;
-          ++i;
+        if (charaIdNum >= 0) {
+          Graphics::AssetCache::release(chara[charaIdNum]);
+          chara[charaIdNum] = Graphics::AssetCache::acquire(line + 4);
         }
-        scenarioPos += 2;
-      } else if (*scenarioPos == L'>') {
-        // Console::write((EFI_STRING)L">");
+      } else if (line[0] == L'@') {
+        nameChanged = true;
+        copyString(name, line + 1, sizeof(name) / sizeof(CHAR16));
+      } else if (line[0] == L'>') {
         textChanged = true;
-        ++scenarioPos;
-        while (TRUE) {
-          if (*scenarioPos == L'\r') {
-            text[text_index] = L'\r';
-            text[text_index + 1] = L'\n';
-            text[text_index + 2] = L'\0';
-            text_index += 2;
-            break;
-          }
-          text[text_index] = *scenarioPos;
-          ++scenarioPos;
-          ++text_index;
-        }
-        scenarioPos += 2;
+        // \r\n\0の分を残す
+        INT32 rest = sizeof(text) / sizeof(CHAR16) - text_index - 3;
+        if (rest < 0) continue;
+        copyString(text + text_index, line + 1, rest + 1);
+        text_index += strlen(text + text_index);
+        strcpy(text + text_index, (EFI_STRING)L"\r\n");
+        text_index += 2;
+      } else if (line[0] == L'*') {
+        addChapter(line + 1, offset);
+      } else if (line[0] == L'~') {
+        textSpeed = parseNumber(line + 1);
+      } else if (line[0] == L'!' && text_index == 0 && jumps == MAX_SCENARIO_JUMPS) {
+        showLoopError(textChanged);
+        break;
+      } else if (line[0] == L'!' && text_index == 0 && jumpToChapter(line + 1)) {
+        // 本文の前でだけ飛べる 飛べなければ下でエラーにする
+        ++jumps;
       } else {
         textChanged = true;
-        *(scenarioPos + 20) = '\0';
+        line[20] = '\0';
         strcpy(text, (EFI_STRING)L"シナリオエラー!:");
-        strcat(text, scenarioPos);
+        strcat(text, line);
         break;
       }
     }
-    if (bgChanged || charaChanged) {
-      updateBg();
-    } else {
-      if (nameChanged) updateName();
-      if (textChanged) updateText();
+  }
+
+  /** クリック待ちの無いループを止めたことを本文に出す */
+  void showLoopError(bool &textChanged) {
+    textChanged = true;
+    strcpy(text, (EFI_STRING)L"シナリオエラー!:ループ");
+    currentText = text;
+  }
+
+  /** 先頭の数字を読む 数字でない文字で止める */
+  static UINT32 parseNumber(const CHAR16 *str) {
+    UINT32 n = 0;
+    for (; *str >= L'0' && *str <= L'9'; ++str) n = n * 10 + (*str - L'0');
+    return n;
+  }
+
+  static void copyString(CHAR16 *dest, const CHAR16 *src, UINTN size) {
+    UINTN i;
+    for (i = 0; i + 1 < size && src[i] != L'\0'; ++i) dest[i] = src[i];
+    dest[i] = L'\0';
+  }
+
+  void addChapter(const CHAR16 *label, UINT64 offset) {
+    if (chapterCount >= MAX_CHAPTERS || findChapter(label) >= 0) return;
+    copyString(chapterNames[chapterCount], label, MAX_CHAPTER_NAME);
+    chapterOffsets[chapterCount] = offset;
+    ++chapterCount;
+  }
+
+  INT32 findChapter(const CHAR16 *label) {
+    for (UINT32 i = 0; i < chapterCount; ++i) {
+      if (!strcmp(chapterNames[i], label)) return i;
+    }
+    return -1;
+  }
+
+  /**
+   * scenario.txtの章(*label)の行へ飛ぶ(!label)
+   *
+   * 既に見つけている章ならその位置へシークするだけ まだなら今の位置から探す
+   * 見つからなければ元の位置に戻ってfalseを返す
+   */
+  bool jumpToChapter(const CHAR16 *label) {
+    INT32 index = findChapter(label);
+    if (index >= 0) return FileSystem::seekReader(&scenarioReader, chapterOffsets[index]);
+    UINT64 start = FileSystem::tellReader(&scenarioReader);
+    CHAR16 line[MAX_SCENARIO_LINE];
+    while (TRUE) {
+      UINT64 offset = FileSystem::tellReader(&scenarioReader);
+      if (FileSystem::readLine(&scenarioReader, line, MAX_SCENARIO_LINE) < 0) {
+        FileSystem::seekReader(&scenarioReader, start);
+        return false;
+      }
+      if (line[0] != L'*') continue;
+      addChapter(line + 1, offset);
+      if (!strcmp(line + 1, label)) return FileSystem::seekReader(&scenarioReader, offset);
     }
   }
 
+  static void onAssetLoaded(void *, void *context) {
+    ++((NovelScene*)context)->loadedAssets;
+  }
+
+  /** 先読みの進み具合を画面の中ほどに出す */
+  void drawProgress() {
+    Graphics::Pixel gray {80, 80, 80, 0};
+    Graphics::Pixel white {255, 255, 255, 0};
+    INT32 x = x0 + (WIDTH - PROGRESS_WIDTH) / 2;
+    INT32 y = y0 + (HEIGHT - PROGRESS_HEIGHT) / 2;
+    UINT32 done = PROGRESS_WIDTH * loadedAssets / loadingAssets;
+    Graphics::fillRect(x, y, done, PROGRESS_HEIGHT, white);
+    Graphics::fillRect(x + done, y, PROGRESS_WIDTH - done, PROGRESS_HEIGHT, gray);
+  }
+
   static void setEventHandlers() {
     Input::onMouseLeftClick = &onMouseLeftClick;
     Input::onKeyPress = &onKeyPress;
@@ -1028,8 +4525,7 @@ public:
 
     changeScene(StartScene);
 
-    backupPx = Graphics::loadImageFromFile((EFI_STRING)L"cursor.png");
-    cursorImage = Graphics::loadImageFromFile((EFI_STRING)L"cursor.png");
+    Graphics::Cursor::setImage(Graphics::loadImageFromFile((EFI_STRING)L"cursor.png"));
 
     Main::onUpdate = &onUpdate;
     Main::start();
@@ -0,0 +1,117 @@
+#!/usr/bin/env python
+# fs以下のアセットを1つのアセットファイルにまとめる
+#
+# usage: python make_asset_pack.py [root] [output] [--exclude NAME]... [--sprites raw|lz4]
+#
+# rootからの相対パスで入れる EFIディレクトリとoutput自身、--excludeで指定したファイルやディレクトリは入れない
+# --spritesを付けると.pngはmake_sprite.pyの形式に変換して同じ名前で入れる
+#
+# フォーマット(リトルエンディアン)
+#   header: "EGPK" UINT16 version, UINT16 reserved, UINT32 count, UINT32 name_data_size(CHAR16単位)
+#   index:  count * (UINT32 hash, UINT32 name, UINT64 offset, UINT64 size) hashの昇順
+#           nameは名前データ先頭からのオフセット(CHAR16単位)、offsetはファイル先頭から
+#   names:  \0終端のUTF-16LE文字列 パスは\区切りで、ASCIIの大文字は小文字にする
+#   data:   ファイルの中身 それぞれALIGNバイト境界から置く
+#   hashは正規化したパスのUTF-16LEのFNV-1a(32bit)
+import sys
+import os
+import struct
+
+import make_sprite
+
+MAGIC = b"EGPK"
+VERSION = 1
+
+# FATのセクタに合わせる
+ALIGN = 512
+
+HEADER_SIZE = 16
+ENTRY_SIZE = 24
+
+
+def normalize(path):
+    path = path.replace("/", "\\").lstrip("\\")
+    return "".join(c.lower() if "A" <= c <= "Z" else c for c in path)
+
+
+def fnv1a(data):
+    h = 2166136261
+    for b in bytearray(data):
+        h = ((h ^ b) * 16777619) & 0xFFFFFFFF
+    return h
+
+
+def collect(root, excludes):
+    paths = []
+    for directory, dirs, files in os.walk(root):
+        relative = os.path.relpath(directory, root)
+        dirs[:] = sorted(d for d in dirs if os.path.normpath(os.path.join(relative, d)) not in excludes)
+        for name in sorted(files):
+            path = os.path.normpath(os.path.join(relative, name))
+            if path not in excludes:
+                paths.append(path)
+    return paths
+
+
+def align(n):
+    return (n + ALIGN - 1) // ALIGN * ALIGN
+
+
+def main(argv):
+    args = []
+    excludes = ["EFI"]
+    sprites = None
+    i = 1
+    while i < len(argv):
+        if argv[i] == "--exclude":
+            excludes.append(os.path.normpath(argv[i + 1]))
+            i += 2
+        elif argv[i] == "--sprites":
+            sprites = make_sprite.LZ4 if argv[i + 1] == "lz4" else make_sprite.RAW
+            i += 2
+        else:
+            args.append(argv[i])
+            i += 1
+    root = args[0] if len(args) > 0 else "fs"
+    output = args[1] if len(args) > 1 else os.path.join(root, "assets.pack")
+    excludes.append(os.path.normpath(os.path.relpath(output, root)))
+
+    entries = []
+    for path in collect(root, set(excludes)):
+        name = normalize(path.replace(os.sep, "/")).encode("utf-16-le")
+        entries.append((fnv1a(name), name, os.path.join(root, path)))
+    entries.sort(key=lambda entry: (entry[0], entry[1]))
+
+    names = bytearray()
+    name_offsets = []
+    for _, name, _ in entries:
+        name_offsets.append(len(names) // 2)
+        names += name + b"\0\0"
+
+    offset = align(HEADER_SIZE + ENTRY_SIZE * len(entries) + len(names))
+    index = bytearray()
+    payloads = []
+    for (hash, _, path), name_offset in zip(entries, name_offsets):
+        if sprites is not None and path.lower().endswith(".png"):
+            data = make_sprite.encode(path, sprites)
+        else:
+            with open(path, "rb") as f:
+                data = f.read()
+        index += struct.pack("<IIQQ", hash, name_offset, offset, len(data))
+        payloads.append((offset, data))
+        offset = align(offset + len(data))
+
+    with open(output, "wb") as f:
+        f.write(MAGIC)
+        f.write(struct.pack("<HHII", VERSION, 0, len(entries), len(names) // 2))
+        f.write(index)
+        f.write(names)
+        for offset, data in payloads:
+            f.write(b"\0" * (offset - f.tell()))
+            f.write(data)
+        size = f.tell()
+    print("%s: %d files, %d bytes" % (output, len(entries), size))
+
+
+if __name__ == "__main__":
+    main(sys.argv)
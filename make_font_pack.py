@@ -0,0 +1,78 @@
+#!/usr/bin/env python
+# make_font_png.rbで出力したfs/fonts/<code>.pngを1つのフォントファイルにまとめる
+#
+# usage: python make_font_pack.py [fonts_dir] [output] [--bpp 1|8]
+#
+# フォーマット(リトルエンディアン)
+#   header: "EGFN" UINT16 version, UINT8 bpp, UINT8 reserved, UINT32 count, UINT32 data_size
+#   index:  count * (UINT32 code, UINT16 w, UINT16 h, UINT32 offset) codeの昇順
+#   data:   グリフごとのカバレッジ 1bppなら行ごとにバイト境界でMSBから詰める
+import sys
+import os
+import struct
+
+from PIL import Image
+
+MAGIC = b"EGFN"
+VERSION = 1
+
+
+def load_alphas(path):
+    image = Image.open(path).convert("RGBA")
+    w, h = image.size
+    return w, h, [pixel[3] for pixel in image.getdata()]
+
+
+def pack_glyph(w, h, alphas, bpp):
+    if bpp == 8:
+        return bytes(bytearray(alphas))
+    data = bytearray()
+    stride = (w + 7) // 8
+    for y in range(h):
+        row = bytearray(stride)
+        for x in range(w):
+            if alphas[y * w + x] >= 128:
+                row[x // 8] |= 0x80 >> (x % 8)
+        data += row
+    return bytes(data)
+
+
+def main(argv):
+    args = [arg for arg in argv[1:] if not arg.startswith("--")]
+    bpp = None
+    if "--bpp" in argv:
+        bpp = int(argv[argv.index("--bpp") + 1])
+        args.remove(str(bpp))
+    fonts_dir = args[0] if len(args) > 0 else os.path.join("fs", "fonts")
+    output = args[1] if len(args) > 1 else os.path.join("fs", "font.pack")
+
+    glyphs = []
+    for name in os.listdir(fonts_dir):
+        code, ext = os.path.splitext(name)
+        if ext != ".png" or not code.isdigit() or int(code) > 0xFFFF:
+            continue
+        w, h, alphas = load_alphas(os.path.join(fonts_dir, name))
+        glyphs.append((int(code), w, h, alphas))
+    glyphs.sort(key=lambda glyph: glyph[0])
+
+    if bpp is None:
+        # アンチエイリアス無しで描いたフォントなら1bppで足りる
+        binary = all(alpha in (0, 255) for glyph in glyphs for alpha in glyph[3])
+        bpp = 1 if binary else 8
+
+    index = bytearray()
+    data = bytearray()
+    for code, w, h, alphas in glyphs:
+        index += struct.pack("<IHHI", code, w, h, len(data))
+        data += pack_glyph(w, h, alphas, bpp)
+
+    with open(output, "wb") as f:
+        f.write(MAGIC)
+        f.write(struct.pack("<HBBII", VERSION, bpp, 0, len(glyphs), len(data)))
+        f.write(index)
+        f.write(data)
+    print("%s: %d glyphs, %dbpp, %d bytes" % (output, len(glyphs), bpp, 16 + len(index) + len(data)))
+
+
+if __name__ == "__main__":
+    main(sys.argv)
@@ -0,0 +1,167 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+# scenario.txtをNovelSceneがそのまま実行できるバイトコードに変換する
+#
+# usage: python make_scenario.py [scenario.txt] [scenario.bin]
+#
+# 文法(1行1命令 改行コードは問わない)
+#   -        クリック待ち
+#   #file    背景
+#   :L0 file 立ち絵 L/Rが左右、0/1がキャラ番号
+#   @name    名前
+#   >text    本文 クリック待ちまでの行をまとめて1ページにする
+#   *label   章の見出し 本文の前にだけ置ける
+#   !label   章へ飛ぶ 本文の前にだけ置ける
+#   ~speed   文字送りの速さ(1秒に出す文字数) 0なら一度に出す
+#
+# フォーマット(リトルエンディアン)
+#   header:  "EGSC" UINT16 version, UINT16 reserved,
+#            UINT32 op_count, UINT32 string_count, UINT32 asset_count, UINT32 string_data_size(CHAR16単位)
+#   ops:     op_count * (UINT8 code, UINT8 a, UINT8 b, UINT8 reserved, UINT32 operand)
+#   strings: string_count * UINT32 文字列データ先頭からのオフセット(CHAR16単位)
+#   assets:  asset_count * UINT32 ファイル名の文字列番号
+#   data:    \0終端のUTF-16LE文字列
+import sys
+import codecs
+import struct
+
+MAGIC = b"EGSC"
+VERSION = 1
+
+OP_END = 0
+OP_WAIT = 1
+OP_BG = 2
+OP_CHARA = 3
+OP_NAME = 4
+OP_TEXT = 5
+OP_SPEED = 6
+OP_JUMP = 7
+
+# NovelScene::bg_filenameの大きさ
+MAX_BG_PATH = 50
+
+
+def read_lines(path):
+    data = open(path, "rb").read()
+    if data.startswith(codecs.BOM_UTF16_LE):
+        text = data[2:].decode("utf-16-le")
+    elif data.startswith(codecs.BOM_UTF16_BE):
+        text = data[2:].decode("utf-16-be")
+    elif data.startswith(codecs.BOM_UTF8):
+        text = data[3:].decode("utf-8")
+    elif len(data) % 2 == 0 and b"\x00" in data:
+        text = data.decode("utf-16-le")
+    else:
+        text = data.decode("utf-8")
+    return text.splitlines()
+
+
+class Compiler(object):
+    def __init__(self):
+        self.strings = []
+        self.string_ids = {}
+        self.assets = []
+        self.asset_ids = {}
+        self.ops = []
+        self.text_lines = []
+        # 章の名前 -> 見出しの次の命令の番号
+        self.labels = {}
+        # (命令の番号, 行番号, 飛び先の章の名前)
+        self.jumps = []
+
+    def intern(self, string):
+        if string not in self.string_ids:
+            self.string_ids[string] = len(self.strings)
+            self.strings.append(string)
+        return self.string_ids[string]
+
+    def asset(self, path):
+        if path not in self.asset_ids:
+            self.asset_ids[path] = len(self.assets)
+            self.assets.append(self.intern(path))
+        return self.asset_ids[path]
+
+    def emit(self, code, a=0, b=0, operand=0):
+        self.ops.append((code, a, b, operand))
+
+    def flush_text(self):
+        if self.text_lines:
+            self.emit(OP_TEXT, operand=self.intern("".join(line + "\r\n" for line in self.text_lines)))
+            self.text_lines = []
+
+    def compile_line(self, number, line):
+        if not line:
+            return
+        head, rest = line[0], line[1:]
+        if head == "-":
+            self.flush_text()
+            self.emit(OP_WAIT)
+        elif head == "#":
+            if len(rest) >= MAX_BG_PATH:
+                raise SyntaxError("line %d: background path too long: %s" % (number, line))
+            self.emit(OP_BG, operand=self.asset(rest))
+        elif head == ":":
+            if len(rest) < 4 or rest[0] not in "LR" or rest[1] not in "01":
+                raise SyntaxError("line %d: bad chara line: %s" % (number, line))
+            self.emit(OP_CHARA, 0 if rest[0] == "L" else 1, int(rest[1]), self.asset(rest[3:]))
+        elif head == "@":
+            self.emit(OP_NAME, operand=self.intern(rest))
+        elif head == ">":
+            self.text_lines.append(rest)
+        elif head == "~":
+            if not rest.isdigit():
+                raise SyntaxError("line %d: bad speed: %s" % (number, line))
+            self.emit(OP_SPEED, operand=int(rest))
+        elif head == "*":
+            # 命令は出さず、次の命令の番号を飛び先として覚える
+            if self.text_lines:
+                raise SyntaxError("line %d: label inside a page: %s" % (number, line))
+            self.labels.setdefault(rest, len(self.ops))
+        elif head == "!":
+            if self.text_lines:
+                raise SyntaxError("line %d: jump inside a page: %s" % (number, line))
+            self.jumps.append((len(self.ops), number, rest))
+            self.emit(OP_JUMP)
+        else:
+            raise SyntaxError("line %d: unknown command: %s" % (number, line))
+
+    def compile(self, lines):
+        for number, line in enumerate(lines, 1):
+            self.compile_line(number, line)
+        self.flush_text()
+        self.emit(OP_END)
+        for index, number, label in self.jumps:
+            if label not in self.labels:
+                raise SyntaxError("line %d: unknown label: %s" % (number, label))
+            code, a, b, operand = self.ops[index]
+            self.ops[index] = (code, a, b, self.labels[label])
+
+    def write(self, path):
+        offsets = []
+        data = bytearray()
+        for string in self.strings:
+            offsets.append(len(data) // 2)
+            data += (string + "\0").encode("utf-16-le")
+        with open(path, "wb") as f:
+            f.write(MAGIC)
+            f.write(struct.pack("<HHIIII", VERSION, 0, len(self.ops), len(self.strings), len(self.assets), len(data) // 2))
+            for code, a, b, operand in self.ops:
+                f.write(struct.pack("<BBBBI", code, a, b, 0, operand))
+            for offset in offsets:
+                f.write(struct.pack("<I", offset))
+            for string_id in self.assets:
+                f.write(struct.pack("<I", string_id))
+            f.write(data)
+
+
+def main(argv):
+    source = argv[1] if len(argv) > 1 else "scenario.txt"
+    output = argv[2] if len(argv) > 2 else "scenario.bin"
+    compiler = Compiler()
+    compiler.compile(read_lines(source))
+    compiler.write(output)
+    print("%s: %d ops, %d strings, %d assets" % (output, len(compiler.ops), len(compiler.strings), len(compiler.assets)))
+
+
+if __name__ == "__main__":
+    main(sys.argv)
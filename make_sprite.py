@@ -0,0 +1,152 @@
+#!/usr/bin/env python
+# PNGなどの画像を、実行時にデコードせずそのまま使える形式に変換する
+#
+# usage: python make_sprite.py input.png [output.spr] [--lz4]
+#
+# 拡張子に関わらず中身で見分けるので、.pngの名前のまま置き換えてもよい
+#
+# フォーマット(リトルエンディアン)
+#   header:    "EGSP" UINT16 version, UINT8 compression(0: 無圧縮, 1: LZ4ブロック), UINT8 reserved,
+#              UINT32 width, UINT32 height, UINT32 span_count, UINT32 pixel_data_size
+#   span_rows: (height + 1) * UINT32 各行のspansの開始位置
+#   spans:     span_count * UINT32 上位2bitが種類(0: 飛ばす, 1: 写す, 2: 合成する)、残りが画素数
+#   pixels:    乗算済みアルファのBGRA compressionが1ならLZ4のブロック形式で圧縮する
+import sys
+import os
+import struct
+
+from PIL import Image
+
+MAGIC = b"EGSP"
+VERSION = 1
+
+RAW = 0
+LZ4 = 1
+
+SPAN_SKIP = 0
+SPAN_COPY = 1
+SPAN_BLEND = 2
+SPAN_OP_SHIFT = 30
+
+# Graphics::Blend::premultiplyと同じ丸め
+PREMULTIPLY = [bytes((c * a + 127) // 255 for c in range(256)) for a in range(256)]
+
+
+def span_op(alpha):
+    return SPAN_SKIP if alpha == 0 else SPAN_COPY if alpha == 255 else SPAN_BLEND
+
+
+def convert(image):
+    """乗算済みのBGRAとspansを作る"""
+    w, h = image.size
+    rgba = image.convert("RGBA").tobytes()
+    pixels = bytearray(w * h * 4)
+    span_rows = []
+    spans = []
+    for y in range(h):
+        span_rows.append(len(spans))
+        start = 0
+        start_op = None
+        for x in range(w):
+            i = (y * w + x) * 4
+            r, g, b, a = rgba[i:i + 4]
+            table = PREMULTIPLY[a]
+            pixels[i:i + 4] = bytes((table[b], table[g], table[r], a))
+            op = span_op(a)
+            if start_op is None:
+                start_op = op
+            elif op != start_op:
+                spans.append((start_op << SPAN_OP_SHIFT) | (x - start))
+                start = x
+                start_op = op
+        spans.append((start_op << SPAN_OP_SHIFT) | (w - start))
+    span_rows.append(len(spans))
+    return w, h, bytes(pixels), span_rows, spans
+
+
+MIN_MATCH = 4
+# 1画素分だけの一致は並びを増やして展開を遅くするわりに縮まないので、2画素から使う
+MIN_TAKEN = 8
+# 最後の5バイトはリテラル、最後のマッチは終端の12バイトより前から始める
+LAST_LITERALS = 5
+MATCH_LIMIT = 12
+MAX_OFFSET = 65535
+
+
+def lz4_length(n):
+    data = bytearray()
+    while n >= 255:
+        data.append(255)
+        n -= 255
+    data.append(n)
+    return data
+
+
+def lz4_sequence(out, literals, match_length, offset):
+    literal_length = len(literals)
+    token = min(literal_length, 15) << 4
+    if match_length is not None:
+        token |= min(match_length - MIN_MATCH, 15)
+    out.append(token)
+    if literal_length >= 15:
+        out += lz4_length(literal_length - 15)
+    out += literals
+    if match_length is not None:
+        out += struct.pack("<H", offset)
+        if match_length - MIN_MATCH >= 15:
+            out += lz4_length(match_length - MIN_MATCH - 15)
+
+
+def compress_lz4(data):
+    """LZ4のブロック形式 貪欲に直近の一致を使う"""
+    n = len(data)
+    out = bytearray()
+    table = {}
+    anchor = 0
+    pos = 0
+    limit = n - MATCH_LIMIT
+    while pos < limit:
+        key = data[pos:pos + MIN_MATCH]
+        candidate = table.get(key)
+        table[key] = pos
+        if candidate is None or pos - candidate > MAX_OFFSET:
+            pos += 1
+            continue
+        length = MIN_MATCH
+        end = n - LAST_LITERALS
+        while pos + length < end and data[candidate + length] == data[pos + length]:
+            length += 1
+        if length < MIN_TAKEN:
+            pos += 1
+            continue
+        lz4_sequence(out, data[anchor:pos], length, pos - candidate)
+        pos += length
+        anchor = pos
+    lz4_sequence(out, data[anchor:], None, 0)
+    return bytes(out)
+
+
+def encode(path, compression=RAW):
+    w, h, pixels, span_rows, spans = convert(Image.open(path))
+    pixel_data = compress_lz4(pixels) if compression == LZ4 else pixels
+    data = bytearray(MAGIC)
+    data += struct.pack("<HBBIIII", VERSION, compression, 0, w, h, len(spans), len(pixel_data))
+    data += struct.pack("<%dI" % len(span_rows), *span_rows)
+    data += struct.pack("<%dI" % len(spans), *spans)
+    data += pixel_data
+    return bytes(data)
+
+
+def main(argv):
+    args = [arg for arg in argv[1:] if not arg.startswith("--")]
+    compression = LZ4 if "--lz4" in argv else RAW
+    source = args[0]
+    output = args[1] if len(args) > 1 else os.path.splitext(source)[0] + ".spr"
+    data = encode(source, compression)
+    with open(output, "wb") as f:
+        f.write(data)
+    print("%s: %d bytes%s" % (output, len(data), " (lz4)" if compression == LZ4 else ""))
+
+
+if __name__ == "__main__":
+    main(sys.argv)